@@ -15,20 +15,236 @@
 
 #include "buffered-write-sequencer.h"
 
+#include <limits.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <csignal>
+#include <cstdarg>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <future>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
 #include <utility>
+#include <vector>
 
+#include "timg-memory.h"
 #include "timg-time.h"
+#include "timg-trace.h"
 
 namespace timg {
+namespace {
+// Keeps segments of OutBuffer::kSegmentSize for re-use. Only keeps up to a
+// limited number; the rest is freed.
+class SegmentPool {
+public:
+    static constexpr size_t kMaxPooledSegments = 64;
+
+    SegmentPool() : account_(MemoryAccount::Create("(output buffer pool)")) {}
+
+    char *Acquire() {
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            if (!free_.empty()) {
+                char *const segment = free_.back();
+                free_.pop_back();
+                account_->Add(-(int64_t)OutBuffer::kSegmentSize);
+                return segment;
+            }
+        }
+        return new char[OutBuffer::kSegmentSize];
+    }
+
+    void Release(char *segment) {
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            if (free_.size() < kMaxPooledSegments) {
+                free_.push_back(segment);
+                account_->Add(OutBuffer::kSegmentSize);
+                return;
+            }
+        }
+        delete[] segment;
+    }
+
+private:
+    const std::shared_ptr<MemoryAccount> account_;
+    std::mutex lock_;
+    std::vector<char *> free_;
+};
+
+SegmentPool *GetSegmentPool() {
+    static SegmentPool *const pool = new SegmentPool();  // Never deleted.
+    return pool;
+}
+}  // namespace
+
+OutBuffer::OutBuffer(OutBuffer &&other)
+    : segments_(std::move(other.segments_)),
+      size_(other.size_),
+      on_discard_(std::move(other.on_discard_)),
+      continuation_(std::move(other.continuation_)) {
+    other.segments_.clear();
+    other.size_       = 0;
+    other.on_discard_ = nullptr;
+}
+
+OutBuffer &OutBuffer::operator=(OutBuffer &&other) {
+    if (this == &other) return *this;
+    Release();
+    segments_     = std::move(other.segments_);
+    size_         = other.size_;
+    on_discard_   = std::move(other.on_discard_);
+    continuation_ = std::move(other.continuation_);
+    other.segments_.clear();
+    other.size_       = 0;
+    other.on_discard_ = nullptr;
+    return *this;
+}
+
+OutBuffer::~OutBuffer() { Release(); }
+
+void OutBuffer::Release() {
+    if (on_discard_) {
+        on_discard_();
+        on_discard_ = nullptr;
+    }
+    for (const Segment &segment : segments_) {
+        MemoryAccount::OutputBuffers()->Add(-(int64_t)segment.capacity);
+        if (segment.capacity == kSegmentSize) {
+            GetSegmentPool()->Release(segment.data);
+        }
+        else {
+            delete[] segment.data;
+        }
+    }
+    segments_.clear();
+    size_ = 0;
+    continuation_.reset();
+}
+
+void OutBuffer::SetContinuation(std::future<OutBuffer> rest) {
+    continuation_.reset(new std::future<OutBuffer>(std::move(rest)));
+}
+
+std::future<OutBuffer> OutBuffer::TakeContinuation() {
+    std::future<OutBuffer> rest = std::move(*continuation_);
+    continuation_.reset();
+    return rest;
+}
+
+void OutBuffer::AddSegment(size_t min_capacity) {
+    if (min_capacity <= kSegmentSize) {
+        segments_.push_back({GetSegmentPool()->Acquire(), 0, kSegmentSize});
+    }
+    else {
+        segments_.push_back({new char[min_capacity], 0, min_capacity});
+    }
+    MemoryAccount::OutputBuffers()->Add(segments_.back().capacity);
+}
+
+void OutBuffer::Append(const char *data, size_t len) {
+    while (len > 0) {
+        if (segments_.empty() ||
+            segments_.back().size == segments_.back().capacity) {
+            AddSegment(len);
+        }
+        Segment &segment = segments_.back();
+        const size_t n   = std::min(len, segment.capacity - segment.size);
+        memcpy(segment.data + segment.size, data, n);
+        segment.size += n;
+        size_ += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void OutBuffer::Appendf(const char *format, ...) {
+    static constexpr size_t kTypicalMaxLen = 256;
+    va_list ap;
+    va_start(ap, format);
+    va_list ap_retry;
+    va_copy(ap_retry, ap);
+    int len = vsnprintf(Reserve(kTypicalMaxLen), kTypicalMaxLen, format, ap);
+    va_end(ap);
+    if (len >= (int)kTypicalMaxLen) {  // Did not fit. Now we know the size.
+        len = vsnprintf(Reserve(len + 1), len + 1, format, ap_retry);
+    }
+    va_end(ap_retry);
+    if (len > 0) Commit(len);
+}
+
+char *OutBuffer::Reserve(size_t max_len) {
+    if (segments_.empty() ||
+        segments_.back().capacity - segments_.back().size < max_len) {
+        AddSegment(max_len);
+    }
+    return segments_.back().data + segments_.back().size;
+}
+
+void OutBuffer::Commit(size_t len) {
+    assert(!segments_.empty());
+    Segment &segment = segments_.back();
+    assert(segment.size + len <= segment.capacity);
+    segment.size += len;
+    size_ += len;
+}
+
+OutBufferStream::OutBufferStream(size_t max_pending)
+    : max_pending_(std::max<size_t>(1, max_pending)),
+      state_(std::make_shared<State>()) {}
+
+std::future<OutBuffer> OutBufferStream::GetFuture() {
+    // Deferred: runs in the writer once it gets to this frame.
+    return std::async(std::launch::deferred, &OutBufferStream::TakeNext,
+                      state_);
+}
+
+void OutBufferStream::Append(OutBuffer &&part) {
+    {
+        std::unique_lock<std::mutex> l(state_->lock);
+        state_->sync.wait(l, [this]() {
+            return !state_->started || state_->parts.size() < max_pending_;
+        });
+        state_->parts.push_back(std::move(part));
+    }
+    state_->sync.notify_all();
+}
+
+void OutBufferStream::Finish() {
+    {
+        std::lock_guard<std::mutex> l(state_->lock);
+        state_->finished = true;
+    }
+    state_->sync.notify_all();
+}
+
+OutBuffer OutBufferStream::TakeNext(const std::shared_ptr<State> &state) {
+    OutBuffer part;
+    {
+        std::unique_lock<std::mutex> l(state->lock);
+        state->started = true;
+        state->sync.wait(
+            l, [&state]() { return !state->parts.empty() || state->finished; });
+        if (state->parts.empty()) return part;  // Finished.
+        part = std::move(state->parts.front());
+        state->parts.pop_front();
+        if (!state->parts.empty() || !state->finished) {
+            part.SetContinuation(std::async(
+                std::launch::deferred, &OutBufferStream::TakeNext, state));
+        }
+    }
+    state->sync.notify_all();
+    return part;
+}
 
 BufferedWriteSequencer::BufferedWriteSequencer(
     int fd, bool allow_frame_skip, int max_queu_len, bool debug_no_frame_delay,
@@ -38,6 +254,7 @@ BufferedWriteSequencer::BufferedWriteSequencer(
       max_queue_len_(max_queu_len),
       debug_no_frame_delay_(debug_no_frame_delay),
       interrupt_received_(interrupt_received),
+      cancellation_(interrupt_received),
       work_executor_(
           new std::thread(&BufferedWriteSequencer::ProcessQueue, this)) {}
 
@@ -45,44 +262,78 @@ BufferedWriteSequencer::~BufferedWriteSequencer() {
     Flush();
     {
         std::lock_guard<std::mutex> l(work_lock_);
-        OutBuffer exit_condition;  // nullptr considered exit condition.
-        std::promise<OutBuffer> p;
-        p.set_value(std::move(exit_condition));
-        work_.push({p.get_future(), SeqType::ControlWrite, {}});
+        // A future without state is considered exit condition.
+        work_.push({std::future<OutBuffer>(), SeqType::ControlWrite, {}, 0});
     }
     work_sync_.notify_all();
     work_executor_->join();
     delete work_executor_;
 }
 
-static ssize_t ReliableWrite(int fd, const char *buffer, const size_t size) {
-    if (size == 0) return 0;
-    ssize_t written  = 0;
-    size_t remaining = size;
-    while (remaining && (written = write(fd, buffer, remaining)) > 0) {
-        remaining -= written;
-        buffer += written;
+ssize_t BufferedWriteSequencer::ReliableWrite(const OutBuffer &block) {
+    if (block.empty()) return 0;
+    TraceSpan span("write", "ReliableWrite");
+    if (span.active()) span.set_detail(std::to_string(block.size()) + " bytes");
+
+    // Write all segments with as few calls as possible.
+    std::vector<struct iovec> iov;
+    iov.reserve(block.segments().size());
+    for (const OutBuffer::Segment &segment : block.segments()) {
+        if (segment.size > 0) iov.push_back({segment.data, segment.size});
+    }
+    size_t first = 0;
+    while (first < iov.size()) {
+        const int count = (int)std::min(iov.size() - first, (size_t)IOV_MAX);
+        const Time call_start;
+        const ssize_t written = writev(fd_, &iov[first], count);
+        if (written < 0) return -1;
+        if (written == 0) break;
+        {
+            const Duration call_time = Time::Now() - call_start;
+            std::lock_guard<std::mutex> l(stats_lock_);
+            histograms_.write_call_ns.Add(call_time.nanoseconds());
+            histograms_.write_call_bytes.Add(written);
+        }
+        // Skip what has been written, possibly ending in the middle of a
+        // segment.
+        size_t remaining = written;
+        while (first < iov.size() && remaining >= iov[first].iov_len) {
+            remaining -= iov[first].iov_len;
+            ++first;
+        }
+        if (remaining > 0) {
+            iov[first].iov_base = (char *)iov[first].iov_base + remaining;
+            iov[first].iov_len -= remaining;
+        }
     }
-    if (written < 0) return -1;
-    return size;
+    return block.size();
 }
 
 void BufferedWriteSequencer::WriteBuffer(std::future<OutBuffer> future_block,
                                          SeqType sequence_type,
                                          const Duration &end_of_frame) {
+    const Time start;
+    size_t queue_depth;
     {
         std::unique_lock<std::mutex> l(work_lock_);
         work_sync_.wait(l, [this]() { return work_.size() < max_queue_len_; });
-        work_.push({std::move(future_block), sequence_type, end_of_frame});
+        queue_depth = work_.size();
+        if (sequence_type == SeqType::StartOfAnimation) ++animations_queued_;
+        work_.push({std::move(future_block), sequence_type, end_of_frame,
+                    Time::Now().nanoseconds()});
     }
     work_sync_.notify_all();
+
+    if (sequence_type == SeqType::ControlWrite) return;
+    const Duration blocked = Time::Now() - start;
+    std::lock_guard<std::mutex> l(stats_lock_);
+    histograms_.queue_depth.Add(queue_depth);
+    histograms_.enqueue_blocked_ns.Add(blocked.nanoseconds());
 }
 
 void BufferedWriteSequencer::WriteBuffer(OutBuffer &&block,
                                          SeqType sequence_type,
                                          const Duration &end_of_frame) {
-    assert(block.data != nullptr);
-
     std::promise<OutBuffer> p;  // Internal queue only deals with futures
     p.set_value(std::move(block));
     WriteBuffer(p.get_future(), sequence_type, end_of_frame);
@@ -91,6 +342,9 @@ void BufferedWriteSequencer::WriteBuffer(OutBuffer &&block,
 void BufferedWriteSequencer::ProcessQueue() {
     timg::Time animation_start;
     timg::Duration last_frame_end;
+    uint64_t trace_id = 0;
+
+    Tracer::SetThreadName("write-sequencer");
 
     for (;;) {
         WorkItem work_item;
@@ -102,26 +356,52 @@ void BufferedWriteSequencer::ProcessQueue() {
         }
         work_sync_.notify_all();
 
-        const OutBuffer block = work_item.block.get();
-        if (block.data == nullptr) return;  // Exit condition.
+        if (!work_item.block.valid()) return;  // Exit condition.
+
+        const int64_t wait_start_ns = Time::Now().nanoseconds();
+        Tracer::AddAsyncSpan("sequencer", "queued", ++trace_id,
+                             work_item.enqueued_ns, wait_start_ns);
+
+        OutBuffer block           = work_item.block.get();
+        const int64_t wait_end_ns = Time::Now().nanoseconds();
+        Tracer::AddSpanNanos("sequencer", "wait for buffer", wait_start_ns,
+                             wait_end_ns, {});
+        if (work_item.sequence_type != SeqType::ControlWrite) {
+            std::lock_guard<std::mutex> l(stats_lock_);
+            histograms_.buffer_wait_ns.Add(wait_end_ns - wait_start_ns);
+        }
 
         if (interrupt_received_ &&
             work_item.sequence_type != SeqType::ControlWrite) {
-            continue;  // Finish quickly, discard any queued-up frames.
+            // Finish quickly, discard any queued-up frames. Parts still
+            // generated are taken, so that their generator can finish.
+            while (block.has_continuation()) {
+                block = block.TakeContinuation().get();
+            }
+            continue;
         }
 
-        bool do_skip = false;
+        bool do_skip        = false;
+        int64_t lateness_ns = -1;  // Only known for frames with a schedule.
         switch (work_item.sequence_type) {
-        case SeqType::StartOfAnimation: animation_start = Time::Now(); break;
+        case SeqType::StartOfAnimation:
+            animation_start = Time::Now();
+            animation_start_ns_.store(animation_start.nanoseconds());
+            ++animations_started_;
+            break;
         case SeqType::AnimationFrame:
+        case SeqType::AnimationRepeat:
             if (!last_frame_end.is_zero()) {
                 const Time finish_time = animation_start + last_frame_end;
                 // Only consider skipping if not Immediate or first in frame.
                 // Allow for occasional blip as long as it does not accumulate.
-                static constexpr Duration kAllowedSkew = Duration::Millis(250);
                 do_skip = (allow_frame_skipping_ &&
                            finish_time + kAllowedSkew < Time::Now());
-                if (!debug_no_frame_delay_) finish_time.WaitUntil();
+                if (!debug_no_frame_delay_) {
+                    TraceSpan span("sequencer", "wait for frame time");
+                    finish_time.WaitUntil();
+                    lateness_ns = (Time::Now() - finish_time).nanoseconds();
+                }
             }
             break;
         case SeqType::FrameImmediate:
@@ -129,18 +409,34 @@ void BufferedWriteSequencer::ProcessQueue() {
         }
         last_frame_end = work_item.end_of_frame;
 
-        if (!do_skip) {
-            ReliableWrite(fd_, block.data, block.size);
+        const Time write_start;
+        size_t frame_bytes = 0;
+        for (;;) {
+            if (!do_skip) {
+                ReliableWrite(block);
+                block.MarkWritten();
+            }
+            frame_bytes += block.size();
+            if (!block.has_continuation()) break;
+            // Further parts of a frame that is streamed. Once started, it is
+            // written completely to not leave the terminal within an escape
+            // sequence; the generator stops early if interrupted.
+            block = block.TakeContinuation().get();
         }
+        const Duration write_time = Time::Now() - write_start;
 
         if (work_item.sequence_type != SeqType::ControlWrite) {
             std::lock_guard<std::mutex> l(stats_lock_);
-            stats_bytes_total_ += block.size;
+            stats_bytes_total_ += frame_bytes;
             ++stats_frames_total_;
             if (do_skip) {
-                stats_bytes_skipped_ += block.size;
+                stats_bytes_skipped_ += frame_bytes;
                 ++stats_frames_skipped_;
             }
+            else {
+                histograms_.frame_write_ns.Add(write_time.nanoseconds());
+            }
+            if (lateness_ns >= 0) histograms_.lateness_ns.Add(lateness_ns);
         }
     }
 }
@@ -149,14 +445,36 @@ void BufferedWriteSequencer::Flush() {
     // Sending an empty dummy-write so that we know that this is the
     // last write-in-progress when queue is empty (as the queue is already
     // empty while the call to write() is still in progress)
-    OutBuffer flush_sentinel(new char[1]);
-    WriteBuffer(std::move(flush_sentinel), SeqType::ControlWrite, {});
+    WriteBuffer(OutBuffer(), SeqType::ControlWrite, {});
     {
         std::unique_lock<std::mutex> l(work_lock_);
         work_sync_.wait(l, [this]() { return work_.empty(); });
     }
 }
 
+bool BufferedWriteSequencer::SkipLateFrame(const Duration &end_of_frame) {
+    if (!allow_frame_skipping_) return false;
+    // Animation start of a previous animation if the current one is still
+    // queued up.
+    if (animations_started_.load() != animations_queued_.load()) return false;
+    // The frame is shown at the end of the previous frame, which is before
+    // "end_of_frame". So if this is already late now, it certainly will be
+    // once the frame gets its turn in ProcessQueue().
+    const int64_t deadline_ns = animation_start_ns_.load() +
+                                end_of_frame.nanoseconds() +
+                                kAllowedSkew.nanoseconds();
+    if (deadline_ns >= Time::Now().nanoseconds()) return false;
+    std::lock_guard<std::mutex> l(stats_lock_);
+    ++stats_frames_total_;
+    ++stats_frames_skipped_;
+    return true;
+}
+
+void BufferedWriteSequencer::RecordEncodeTime(const Duration &duration) {
+    std::lock_guard<std::mutex> l(stats_lock_);
+    histograms_.encode_ns.Add(duration.nanoseconds());
+}
+
 int64_t BufferedWriteSequencer::bytes_total() const {
     std::lock_guard<std::mutex> l(stats_lock_);
     return stats_bytes_total_;
@@ -177,4 +495,9 @@ int64_t BufferedWriteSequencer::frames_skipped() const {
     return stats_frames_skipped_;
 }
 
+BufferedWriteSequencer::Histograms BufferedWriteSequencer::histograms() const {
+    std::lock_guard<std::mutex> l(stats_lock_);
+    return histograms_;
+}
+
 }  // namespace timg
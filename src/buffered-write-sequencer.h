@@ -15,37 +15,144 @@
 #ifndef BUFFERED_WRITE_SEQUENCER_H_
 #define BUFFERED_WRITE_SEQUENCER_H_
 
+#include <sys/types.h>
+
+#include <atomic>
 #include <condition_variable>
 #include <csignal>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
+#include "timg-cancel.h"
+#include "timg-histogram.h"
 #include "timg-time.h"
 
 namespace timg {
-// Allocated block of data. It can only be moved, last owner deletes.
-// Typically the frame canvas allocates such  buffer and fills with "size"
-// data, then hand it to the BufferedWriteSequencer.
-struct OutBuffer {
-    OutBuffer(char *data = nullptr, size_t size = 0) : data(data), size(size) {}
-    OutBuffer(OutBuffer &&other) : data(other.data), size(other.size) {
-        other.data = nullptr;
-    }
+// Data to be written, stored in a chain of segments that grows on demand.
+// Typically the frame canvas creates such a buffer and appends data to it,
+// then hands it to the BufferedWriteSequencer.
+//
+// Segments are taken from a pool and returned once the buffer is destroyed
+// after being written, so in a steady state no memory is allocated. Since
+// buffers only grow with the data actually added, the memory held by
+// buffers in flight is the size of the output, not a worst-case estimate.
+// It can only be moved, last owner returns the segments.
+class OutBuffer {
+public:
+    // Size of the pooled segments. Larger segments are only allocated if
+    // more contiguous space is requested in Reserve().
+    static constexpr size_t kSegmentSize = 64 << 10;
+
+    struct Segment {
+        char *data;
+        size_t size;      // Bytes used.
+        size_t capacity;  // Bytes available.
+    };
+
+    OutBuffer() = default;
+    OutBuffer(OutBuffer &&other);
+    OutBuffer &operator=(OutBuffer &&other);
     OutBuffer(const OutBuffer &other) = delete;
-    ~OutBuffer() { delete[] data; }
+    ~OutBuffer();
+
+    // Append "len" bytes of "data".
+    void Append(const char *data, size_t len);
+    void Append(const char *str) { Append(str, strlen(str)); }
+
+    // Append printf()-formatted string.
+    void Appendf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    // Return contiguous space to directly write up to "max_len" bytes to,
+    // then call Commit() with the number of bytes actually written. The
+    // returned pointer is only valid until the next change of the buffer.
+    char *Reserve(size_t max_len);
+    void Commit(size_t len);
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    // The segments making up the content, to be written in sequence.
+    const std::vector<Segment> &segments() const { return segments_; }
+
+    // Call "on_discard" if the content is released without being written,
+    // e.g. if the frame is skipped. Allows to clean up resources outside
+    // the buffer that the content refers to.
+    void SetDiscardCallback(std::function<void()> on_discard) {
+        on_discard_ = std::move(on_discard);
+    }
+
+    // To be called by the writer once the content is written.
+    void MarkWritten() { on_discard_ = nullptr; }
+
+    // Content following this buffer that might still be generated; it is
+    // written right after this buffer as part of the same frame. Used by
+    // OutBufferStream.
+    void SetContinuation(std::future<OutBuffer> rest);
+    bool has_continuation() const { return continuation_ != nullptr; }
+    std::future<OutBuffer> TakeContinuation();
+
+private:
+    void AddSegment(size_t min_capacity);
+    void Release();
+
+    std::vector<Segment> segments_;
+    size_t size_ = 0;
+    std::function<void()> on_discard_;
+    // Behind a pointer, as the future needs a complete OutBuffer.
+    std::unique_ptr<std::future<OutBuffer>> continuation_;
+};
+
+// Content of one frame handed to the BufferedWriteSequencer in parts while
+// it is still being generated, so that writing it to the terminal can start
+// early. The generating side calls Append() for each part, then Finish();
+// the future returned by GetFuture() is passed to WriteBuffer().
+//
+// Once the sequencer started writing the stream, Append() waits while
+// "max_pending" parts are not written yet, so the memory held is bounded by
+// that instead of the size of the frame. It does not wait before, as the
+// sequencer might first wait for frames still waiting for a thread.
+class OutBufferStream {
+public:
+    explicit OutBufferStream(size_t max_pending);
+    OutBufferStream(const OutBufferStream &) = delete;
+    ~OutBufferStream() { Finish(); }
+
+    // Return the future of the first part. To be called once.
+    std::future<OutBuffer> GetFuture();
+
+    void Append(OutBuffer &&part);
+    void Finish();  // No more parts.
+
+private:
+    struct State {
+        std::mutex lock;
+        std::condition_variable sync;
+        std::deque<OutBuffer> parts;  // Generated, not taken by writer yet.
+        bool started  = false;        // Writer waits for parts.
+        bool finished = false;
+    };
+
+    // Called by the writer: wait for the next part and return it, with
+    // the future for the one after as continuation.
+    static OutBuffer TakeNext(const std::shared_ptr<State> &state);
 
-    char *data;
-    size_t size;
+    const size_t max_pending_;
+    const std::shared_ptr<State> state_;
 };
 
 // The last step towards writing content to the terminal.
 // The sequencer provides queueing of write calls with details about the
-// requested timings. Built-in buffer management provides buffers that are
-// re-used to minimize memory allocations.
+// requested timings. Buffers are returned to the OutBuffer segment pool once
+// written, so that they are re-used to minimize memory allocations.
 //
 // That allows for best possible smooth timing even if the upstream pipeline
 // steps (decode, scale, compression, base64 encoding..) might have varying
@@ -59,6 +166,7 @@ enum class SeqType {
     FrameImmediate,    // Don't delay when frame is written.
     StartOfAnimation,  // First frame of an Animation. Hold for duration.
     AnimationFrame,    // Write frame; finish duration relative to start anim
+    AnimationRepeat,   // AnimationFrame repeated in a later loop.
 };
 class BufferedWriteSequencer {
 public:
@@ -101,6 +209,9 @@ public:
     // the start. This establishes the absolute time difference between the
     // start of the Animation and the current frame. So the duration for
     // StartOfAnimation is 1/fps, next AnimationFrame at 2/fps and so on.
+    // Frames of later loops through an animation are sent as AnimationRepeat:
+    // timed the same, but their content is the frame at the same position in
+    // the first loop.
     // This allows to ...
     //   (a) be independent of upstream latencies as only when the first
     //       frame of an animation arrives and is emitted, the clock
@@ -109,6 +220,10 @@ public:
     //       next will try to finish in earlier as the emit time is relative
     //       to the first.
     //
+    // A buffer can have a continuation (see OutBufferStream), which is then
+    // written as part of the same frame, even after "interrupt_received"
+    // is set once it has started.
+    //
     // No return value: the write happens asynchronously.
     void WriteBuffer(std::future<OutBuffer> future_block, SeqType sequence_type,
                      const Duration &end_of_frame = {});
@@ -120,40 +235,86 @@ public:
     // Flush all pending writes.
     void Flush();
 
+    // Returns true if an AnimationFrame finishing at "end_of_frame" would be
+    // skipped as it can't be shown in time anymore; the frame is then
+    // accounted as skipped and is not to be sent. This allows upstream to
+    // save the work of preparing frames that would be thrown away.
+    //
+    // The "end_of_frame" refers to the animation last started with a
+    // StartOfAnimation, so this is only meaningful after that is sent.
+    // Always false unless frame skipping is allowed. Thread-safe.
+    bool SkipLateFrame(const Duration &end_of_frame);
+
     size_t max_queue_len() const { return max_queue_len_; }
 
+    // Cancelled once "interrupt_received" is set and pending frames will be
+    // discarded; encoders can stop working on them.
+    const CancellationToken &cancellation() const { return cancellation_; }
+
+    // Record the time it took to encode a frame written to this sequencer.
+    // Thread-safe; called by the canvases from whatever thread encodes.
+    void RecordEncodeTime(const Duration &duration);
+
     // -- Stats
     int64_t bytes_total() const;
     int64_t bytes_skipped() const;
     int64_t frames_total() const;
     int64_t frames_skipped() const;
 
+    // Distributions of what happens on the write path. Times are in
+    // nanoseconds. Except for the write() calls, they only consider frames,
+    // not control writes.
+    struct Histograms {
+        Histogram queue_depth;         // Items already queued at WriteBuffer()
+        Histogram enqueue_blocked_ns;  // WriteBuffer() waiting for queue space
+        Histogram buffer_wait_ns;      // Waiting for the buffer to be ready.
+        Histogram lateness_ns;         // Animation frame start after schedule
+        Histogram encode_ns;           // See RecordEncodeTime()
+        Histogram frame_write_ns;      // Writing a complete frame.
+        Histogram write_call_ns;       // Individual write() calls.
+        Histogram write_call_bytes;    // Bytes per write() call.
+    };
+    Histograms histograms() const;
+
 private:
+    // Late frames are only skipped if they are behind by more than this.
+    static constexpr Duration kAllowedSkew = Duration::Millis(250);
+
     void ProcessQueue();  // Runs in thread.
+    ssize_t ReliableWrite(const OutBuffer &block);
 
     const int fd_;
     const bool allow_frame_skipping_;
     const size_t max_queue_len_;
     const bool debug_no_frame_delay_;
     const volatile sig_atomic_t &interrupt_received_;
+    const CancellationToken cancellation_;
 
     // Work queue. Items are stored in a FIFO.
     struct WorkItem {
         std::future<OutBuffer> block;
         SeqType sequence_type;
         Duration end_of_frame;
+        int64_t enqueued_ns;
     };
     std::mutex work_lock_;
     std::queue<WorkItem> work_;
     std::condition_variable work_sync_;
     std::thread *work_executor_;
 
+    // Schedule of the current animation for SkipLateFrame(). The start time
+    // is only valid if all queued animations are started.
+    std::atomic<int64_t> animations_queued_{0};
+    std::atomic<int64_t> animations_started_{0};
+    std::atomic<int64_t> animation_start_ns_{0};
+
     // Statistics.
     mutable std::mutex stats_lock_;
     int64_t stats_bytes_total_    = 0;
     int64_t stats_bytes_skipped_  = 0;
     int64_t stats_frames_total_   = 0;
     int64_t stats_frames_skipped_ = 0;
+    Histograms histograms_;
 };
 }  // namespace timg
 #endif  // BUFFERED_WRITE_SEQUENCER_H_
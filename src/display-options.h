@@ -17,6 +17,7 @@
 
 #include <stdlib.h>
 
+#include <cstdint>
 #include <functional>
 #include <limits>
 #include <string>
@@ -80,6 +81,14 @@ struct DisplayOptions {
 
     bool allow_frame_skipping = false;  // skip frame if CPU or terminal slow
 
+    // Memory for keeping the frames of an animation in bytes; frames that
+    // don't fit anymore are decoded again in each loop. 0 for unlimited.
+    int64_t frame_memory_budget = 0;
+
+    // Directory of the persistent cache of scaled images. Empty: no caching.
+    std::string cache_dir;
+    int64_t cache_max_bytes = (int64_t)1 << 30;  // 0 for unlimited.
+
     //-- Background options for transparent images --
     bool local_alpha_handling = true;  // If we alpha blend locally
     // "bgcolor_getter" is a function that can be called to retrieve the
@@ -0,0 +1,89 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "file-list.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace timg {
+FileList::FileList()  = default;
+FileList::~FileList() = default;
+
+void FileList::Add(const std::string &filename) {
+    entries_.push_back({filename, nullptr, ""});
+}
+
+bool FileList::AddFromFile(const std::string &filelist_file,
+                           bool relative_to_filelist) {
+    std::unique_ptr<std::ifstream> filelist_stream(new std::ifstream(
+        filelist_file == "-" ? "/dev/stdin" : filelist_file,
+        std::ifstream::in));
+    if (!*filelist_stream) {
+        fprintf(stderr, "%s: %s\n", filelist_file.c_str(), strerror(errno));
+        return false;
+    }
+    std::string prefix;
+    if (relative_to_filelist) {
+        // Following works as expected if last_slash == npos (+1 == 0)
+        const size_t last_slash = filelist_file.find_last_of('/');
+        prefix                  = filelist_file.substr(0, last_slash + 1);
+    }
+    entries_.push_back({"", std::move(filelist_stream), prefix});
+    return true;
+}
+
+bool FileList::ReadNext() {
+    while (!entries_.empty()) {
+        Entry &entry = entries_.front();
+        if (!entry.filelist) {
+            upcoming_.push_back(entry.filename);
+            entries_.pop_front();
+            return true;
+        }
+        std::string filename;
+        while (std::getline(*entry.filelist, filename)) {
+            if (filename.empty()) continue;
+            if (filename[0] != '/' && !entry.prefix.empty()) {
+                filename.insert(0, entry.prefix);
+            }
+            upcoming_.push_back(filename);
+            return true;
+        }
+        entries_.pop_front();  // Reached the end of this filelist.
+    }
+    return false;
+}
+
+int FileList::LookAhead(int count) {
+    while ((int)upcoming_.size() < count && ReadNext()) {
+    }
+    return std::min(count, (int)upcoming_.size());
+}
+
+bool FileList::Next(std::string *filename) {
+    if (upcoming_.empty() && !ReadNext()) return false;
+    *filename = std::move(upcoming_.front());
+    upcoming_.pop_front();
+    ++returned_;
+    return true;
+}
+}  // namespace timg
@@ -0,0 +1,72 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_FILE_LIST_H
+#define TIMG_FILE_LIST_H
+
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <string>
+
+namespace timg {
+// List of files to show, given on the command line or in filelist files.
+// Filelists are only read while iterating, so that even huge lists don't
+// have to be kept in memory and showing can start right away.
+class FileList {
+public:
+    FileList();
+    FileList(const FileList &) = delete;
+    ~FileList();
+
+    // Add a single filename.
+    void Add(const std::string &filename);
+
+    // Add the newline separated filenames found in "filelist_file" ("-" for
+    // stdin). Non-absolute filenames are resolved relative to the directory
+    // of the filelist if "relative_to_filelist" is set, otherwise relative
+    // to the current working directory.
+    // Returns false, if the filelist can't be opened.
+    bool AddFromFile(const std::string &filelist_file,
+                     bool relative_to_filelist);
+
+    // Read ahead up to "count" filenames. Returns how many are available,
+    // which is less than count if the list ends before.
+    int LookAhead(int count);
+
+    // Get the next filename. Returns false at the end of the list.
+    bool Next(std::string *filename);
+
+    // Number of filenames returned by Next() so far.
+    int returned() const { return returned_; }
+
+private:
+    // Either a single filename or a filelist still to be read.
+    struct Entry {
+        std::string filename;
+        std::unique_ptr<std::ifstream> filelist;
+        std::string prefix;  // To prepend to relative names in filelist.
+    };
+
+    // Read one more filename into upcoming_. Returns false if there is none.
+    bool ReadNext();
+
+    std::deque<Entry> entries_;
+    std::deque<std::string> upcoming_;
+    int returned_ = 0;
+};
+}  // namespace timg
+
+#endif  // TIMG_FILE_LIST_H
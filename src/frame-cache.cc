@@ -0,0 +1,492 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "frame-cache.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "buffered-write-sequencer.h"
+#include "display-options.h"
+#include "framebuffer.h"
+#include "image-source.h"
+#include "renderer.h"
+#include "thread-pool.h"
+#include "timg-time.h"
+#include "timg-trace.h"
+
+namespace fs = std::filesystem;
+
+namespace timg {
+namespace {
+// A cache entry starts with the EntryHeader, followed by the key, padded
+// to four bytes, then frame_count times FrameHeader with the pixels. All
+// fields are 32 bit, so the pixels are aligned in the mapped file.
+constexpr char kMagic[8] = {'t', 'i', 'm', 'g', 'F', 'C', '1', '\n'};
+
+struct EntryHeader {
+    char magic[8];
+    uint32_t key_length;
+    uint32_t frame_count;
+    int32_t orig_width;  // Title parameters of the original source.
+    int32_t orig_height;
+    char decoder[16];
+    uint32_t is_animation_before_frame_limit;
+};
+
+struct FrameHeader {
+    int32_t dx;
+    int32_t dy;
+    int32_t width;  // Followed by width * height pixels.
+    int32_t height;
+};
+
+size_t Padded(size_t len) { return (len + 3) & ~(size_t)3; }
+
+uint64_t Fnv1aHash(const std::string &str) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const char c : str) {
+        hash ^= (uint8_t)c;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// Entries are written in the background if a pool is set; see
+// FrameCache::WriteInBackground().
+struct Writer {
+    std::mutex lock;
+    ThreadPool *pool = nullptr;
+    std::vector<std::future<void>> pending;
+    int64_t cache_bytes = -1;  // Size of the cache directory; -1 unknown.
+};
+Writer *const writer = new Writer();
+
+// Remove the least recently used entries in "dir" until it is well below
+// "max_bytes" once it exceeds it. Hits update the modification time of an
+// entry, so that is the time it was last used.
+// The size of the directory is only determined on the first call and again
+// when it seems to be exceeded; in between, "added_bytes" are counted.
+void LimitCacheSize(const std::string &dir, int64_t max_bytes,
+                    int64_t added_bytes) {
+    std::lock_guard<std::mutex> l(writer->lock);
+    if (writer->cache_bytes >= 0 &&
+        writer->cache_bytes + added_bytes <= max_bytes) {
+        writer->cache_bytes += added_bytes;
+        return;
+    }
+    TraceSpan span("store", "FrameCache::LimitCacheSize");
+    struct Entry {
+        fs::path path;
+        int64_t bytes;
+        fs::file_time_type last_used;
+    };
+    std::vector<Entry> entries;
+    int64_t total = 0;
+    std::error_code err;
+    for (const auto &file : fs::directory_iterator(dir, err)) {
+        // Entries are named with 16 hex digits; others are temporary files.
+        if (file.path().filename().string().size() != 16) continue;
+        const int64_t bytes = file.file_size(err);
+        if (err) continue;
+        const fs::file_time_type last_used = file.last_write_time(err);
+        if (err) continue;
+        entries.push_back({file.path(), bytes, last_used});
+        total += bytes;
+    }
+    if (total > max_bytes) {
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry &a, const Entry &b) {
+                      return a.last_used < b.last_used;
+                  });
+        // Leave some room, so that we don't have to do this on every write.
+        const int64_t target = max_bytes / 4 * 3;
+        for (const Entry &entry : entries) {
+            if (total <= target) break;
+            if (fs::remove(entry.path, err)) total -= entry.bytes;
+        }
+    }
+    writer->cache_bytes = total;
+}
+
+std::ostream &operator<<(std::ostream &out, rgba_t color) {
+    return out << (int)color.r << "," << (int)color.g << "," << (int)color.b
+               << "," << (int)color.a;
+}
+
+// A frame as sent to the sink.
+struct Frame {
+    int dx;
+    int dy;
+    std::unique_ptr<Framebuffer> framebuffer;
+};
+
+// Sends the frames found in a cache entry.
+class CachedImageSource final : public ImageSource {
+public:
+    CachedImageSource(const std::string &filename, int orig_width,
+                      int orig_height, const std::string &decoder,
+                      bool is_animation_before_frame_limit)
+        : ImageSource(filename),
+          orig_width_(orig_width),
+          orig_height_(orig_height),
+          decoder_(decoder),
+          is_animation_before_frame_limit_(is_animation_before_frame_limit) {}
+
+    // Add frame to be sent, taking ownership of "framebuffer".
+    void AddFrame(int dx, int dy, Framebuffer *framebuffer) {
+        AccountMemory(framebuffer->allocated_bytes());
+        frames_.emplace_back(
+            new Frame{dx, dy, std::unique_ptr<Framebuffer>(framebuffer)});
+    }
+
+    bool LoadAndScale(const DisplayOptions &, int, int,
+                      const CancellationToken &) final { return true; }
+
+    void SendFrames(const Duration &duration, int loops,
+                    const volatile sig_atomic_t &interrupt_received,
+                    const Renderer::WriteFramebufferFun &sink) final {
+        for (const auto &frame : frames_) {
+            if (interrupt_received) break;
+            sink(frame->dx, frame->dy, *frame->framebuffer,
+                 SeqType::FrameImmediate, {});
+        }
+    }
+
+    std::string FormatTitle(const std::string &format_string) const final {
+        return FormatFromParameters(format_string, filename_, orig_width_,
+                                    orig_height_, decoder_.c_str());
+    }
+
+    bool IsAnimationBeforeFrameLimit() const final {
+        return is_animation_before_frame_limit_;
+    }
+
+private:
+    const int orig_width_;
+    const int orig_height_;
+    const std::string decoder_;
+    const bool is_animation_before_frame_limit_;
+    std::vector<std::unique_ptr<Frame>> frames_;
+};
+
+// Passes on the frames of the wrapped source and stores them in the cache
+// once all are sent, if they are still images.
+class RecordingImageSource final : public ImageSource {
+public:
+    RecordingImageSource(ImageSource *source, const std::string &key,
+                         const std::string &path, int64_t max_cache_bytes)
+        : ImageSource(source->filename()),
+          source_(source),
+          key_(key),
+          path_(path),
+          max_cache_bytes_(max_cache_bytes) {}
+
+    bool LoadAndScale(const DisplayOptions &, int, int,
+                      const CancellationToken &) final {
+        return true;  // The wrapped source is already loaded.
+    }
+
+    void SendFrames(const Duration &duration, int loops,
+                    const volatile sig_atomic_t &interrupt_received,
+                    const Renderer::WriteFramebufferFun &sink) final {
+        std::vector<std::unique_ptr<Frame>> frames;
+        bool is_still_image = true;
+        auto record         = [&](int dx, int dy, const Framebuffer &fb,
+                                  SeqType seq_type, Duration end_of_frame) {
+            sink(dx, dy, fb, seq_type, end_of_frame);
+            if (seq_type != SeqType::FrameImmediate) {
+                is_still_image = false;
+                frames.clear();
+            }
+            if (is_still_image) {
+                // Shares the pixels; only copied if the source modifies
+                // its framebuffer later.
+                frames.emplace_back(
+                    new Frame{dx, dy, std::make_unique<Framebuffer>(fb)});
+            }
+        };
+        source_->SendFrames(
+            duration, loops, interrupt_received,
+            Renderer::WriteFramebufferFun(
+                record,
+                [&sink](const Duration &end_of_frame) {
+                    return sink.SkipLateFrame(end_of_frame);
+                },
+                [&sink]() { return sink.RepeatContentNeeded(); }));
+        if (is_still_image && !frames.empty() && !interrupt_received) {
+            EntryHeader header;
+            if (PrepareHeader(frames.size(), &header)) {
+                Write(header, std::move(frames));
+            }
+        }
+    }
+
+    std::string FormatTitle(const std::string &format_string) const final {
+        return source_->FormatTitle(format_string);
+    }
+
+    bool IsAnimationBeforeFrameLimit() const final {
+        return source_->IsAnimationBeforeFrameLimit();
+    }
+
+    int64_t memory_bytes() const final { return source_->memory_bytes(); }
+
+private:
+    // Fill the header of an entry with "frame_count" frames from what the
+    // source tells us. Returns false if that is not possible.
+    bool PrepareHeader(int frame_count, EntryHeader *header) const {
+        memset(header, 0, sizeof(*header));
+        memcpy(header->magic, kMagic, sizeof(kMagic));
+        header->key_length  = key_.size();
+        header->frame_count = frame_count;
+        // There is no direct access to the title parameters, but a
+        // title format can reveal them.
+        const std::string params = source_->FormatTitle("%w %h %D");
+        if (sscanf(params.c_str(), "%d %d %15s", &header->orig_width,
+                   &header->orig_height, header->decoder) != 3) {
+            return false;
+        }
+        header->is_animation_before_frame_limit =
+            source_->IsAnimationBeforeFrameLimit();
+        return true;
+    }
+
+    // Write the entry and keep the cache size in its limit; in the
+    // background if possible, as the frames are shown already. The source
+    // might be gone by then, so all that is needed is passed on.
+    void Write(const EntryHeader &header,
+               std::vector<std::unique_ptr<Frame>> frames) const {
+        auto shared_frames =
+            std::make_shared<std::vector<std::unique_ptr<Frame>>>(
+                std::move(frames));
+        const std::function<void()> write =
+            [header, key = key_, path = path_, max_bytes = max_cache_bytes_,
+             shared_frames]() {
+                TraceSpan span("store", "FrameCache::Write");
+                const int64_t bytes =
+                    WriteEntry(header, key, path, *shared_frames);
+                if (bytes > 0 && max_bytes > 0) {
+                    LimitCacheSize(fs::path(path).parent_path().string(),
+                                   max_bytes, bytes);
+                }
+            };
+        std::unique_lock<std::mutex> l(writer->lock);
+        if (!writer->pool) {
+            l.unlock();
+            write();
+            return;
+        }
+        // Forget about the writes that are done already.
+        auto &pending      = writer->pending;
+        const auto is_done = [](const std::future<void> &f) {
+            return f.wait_for(std::chrono::seconds(0)) ==
+                   std::future_status::ready;
+        };
+        pending.erase(std::remove_if(pending.begin(), pending.end(), is_done),
+                      pending.end());
+        pending.push_back(writer->pool->ExecAsync(write));
+    }
+
+    // Write to a temporary file first that is then renamed, so that
+    // concurrently running timg never see a partial entry. Returns the
+    // bytes written or -1 on failure.
+    static int64_t WriteEntry(
+        const EntryHeader &header, const std::string &key,
+        const std::string &path,
+        const std::vector<std::unique_ptr<Frame>> &frames) {
+        std::error_code err;
+        fs::create_directories(fs::path(path).parent_path(), err);
+        if (err) return -1;
+
+        std::string tmp_path = path + ".XXXXXX";
+        const int fd         = mkstemp(&tmp_path[0]);
+        if (fd < 0) return -1;
+        FILE *const out = fdopen(fd, "wb");
+        if (!out) {
+            close(fd);
+            unlink(tmp_path.c_str());
+            return -1;
+        }
+
+        static constexpr char kPadding[4] = {};
+        fwrite(&header, sizeof(header), 1, out);
+        fwrite(key.data(), key.size(), 1, out);
+        fwrite(kPadding, Padded(key.size()) - key.size(), 1, out);
+        for (const auto &frame : frames) {
+            const Framebuffer &fb = *frame->framebuffer;
+            const FrameHeader frame_header{frame->dx, frame->dy, fb.width(),
+                                           fb.height()};
+            fwrite(&frame_header, sizeof(frame_header), 1, out);
+            // Write row by row, as rows might not be packed.
+            for (int y = 0; y < fb.height(); ++y) {
+                fwrite(fb.row(y), sizeof(rgba_t) * fb.width(), 1, out);
+            }
+        }
+        const int64_t bytes = ftell(out);
+        bool success        = !ferror(out);
+        success &= (fclose(out) == 0);
+        success = success && rename(tmp_path.c_str(), path.c_str()) == 0;
+        if (!success) unlink(tmp_path.c_str());
+        return success ? bytes : -1;
+    }
+
+    const std::unique_ptr<ImageSource> source_;
+    const std::string key_;
+    const std::string path_;
+    const int64_t max_cache_bytes_;
+};
+}  // namespace
+
+FrameCache::FrameCache(const std::string &filename,
+                       const DisplayOptions &options, int frame_offset,
+                       int frame_count)
+    : filename_(filename), max_bytes_(options.cache_max_bytes) {
+    if (options.cache_dir.empty() || filename == "-") return;
+    // Scrolling turns a still image into an animation; the cache would
+    // return the still image.
+    if (options.scroll_animation) return;
+
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return;
+    std::error_code err;
+    const fs::path canonical = fs::canonical(filename, err);
+    if (err) return;
+
+    // Resulting pixels depend on the background color, so we have to wait
+    // for it here even if the image turns out not to be transparent.
+    const rgba_t bgcolor =
+        options.bgcolor_getter ? options.bgcolor_getter() : rgba_t{};
+
+    std::stringstream key;
+    key << canonical.string() << "\n"
+        << st.st_dev << " " << st.st_ino << " " << st.st_size << " "
+        << st.st_mtime << "\n"
+        << options.width << "x" << options.height << " "  //
+        << options.cell_x_px << "x" << options.cell_y_px << " "
+        << options.width_stretch << " " << options.upscale
+        << options.upscale_integer << options.fill_width << options.fill_height
+        << options.antialias << options.center_horizontally
+        << options.auto_crop << options.exif_rotate
+        << options.local_alpha_handling << " " << options.crop_border << " "
+        << bgcolor << " " << options.bg_pattern_color << " "
+        << options.pattern_size << " " << frame_offset << " " << frame_count;
+    key_ = key.str();
+
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx",
+             (unsigned long long)Fnv1aHash(key_));
+    path_ = (fs::path(options.cache_dir) / name).string();
+}
+
+ImageSource *FrameCache::Lookup() const {
+    if (key_.empty()) return nullptr;
+    TraceSpan span("load", "FrameCache::Lookup");
+
+    const int fd = open(path_.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(EntryHeader)) {
+        // Private and writable, so that framebuffers could modify the
+        // pixels, copy-on-write.
+        map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return nullptr;
+
+    // Unmapped once the last framebuffer referring to it is gone.
+    const size_t size = st.st_size;
+    std::shared_ptr<uint8_t> mapping(
+        (uint8_t *)map, [size](uint8_t *p) { munmap(p, size); });
+
+    EntryHeader header;
+    memcpy(&header, mapping.get(), sizeof(header));
+    size_t pos = sizeof(header);
+    if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.key_length != key_.size() || pos + Padded(key_.size()) > size ||
+        memcmp(mapping.get() + pos, key_.data(), key_.size()) != 0) {
+        return nullptr;  // Not ours or hash collision.
+    }
+    // Used now; the least recently used entries are removed first.
+    utimensat(AT_FDCWD, path_.c_str(), nullptr, 0);
+    pos += Padded(key_.size());
+    header.decoder[sizeof(header.decoder) - 1] = '\0';
+
+    std::unique_ptr<CachedImageSource> result(new CachedImageSource(
+        filename_, header.orig_width, header.orig_height, header.decoder,
+        header.is_animation_before_frame_limit));
+    for (uint32_t i = 0; i < header.frame_count; ++i) {
+        FrameHeader frame;
+        if (pos + sizeof(frame) > size) return nullptr;
+        memcpy(&frame, mapping.get() + pos, sizeof(frame));
+        pos += sizeof(frame);
+        if (frame.width <= 0 || frame.height <= 0) return nullptr;
+        const size_t bytes = sizeof(rgba_t) * frame.width * frame.height;
+        if (pos + bytes > size) return nullptr;
+        result->AddFrame(frame.dx, frame.dy,
+                         new Framebuffer(frame.width, frame.height,
+                                         (rgba_t *)(mapping.get() + pos),
+                                         [mapping](rgba_t *) {}));
+        pos += bytes;
+    }
+    return result.release();
+}
+
+ImageSource *FrameCache::Record(ImageSource *source) const {
+    if (key_.empty()) return source;
+    return new RecordingImageSource(source, key_, path_, max_bytes_);
+}
+
+void FrameCache::WriteInBackground(ThreadPool *pool) {
+    std::lock_guard<std::mutex> l(writer->lock);
+    writer->pool = pool;
+}
+
+void FrameCache::WaitForWrites() {
+    std::vector<std::future<void>> pending;
+    {
+        std::lock_guard<std::mutex> l(writer->lock);
+        pending.swap(writer->pending);
+    }
+    for (std::future<void> &write : pending) write.wait();
+}
+
+std::string FrameCache::DefaultDirectory() {
+    const char *const xdg_cache = getenv("XDG_CACHE_HOME");
+    if (xdg_cache && xdg_cache[0]) return std::string(xdg_cache) + "/timg";
+    const char *const home = getenv("HOME");
+    if (home && home[0]) return std::string(home) + "/.cache/timg";
+    return "";
+}
+}  // namespace timg
@@ -0,0 +1,76 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_FRAME_CACHE_H
+#define TIMG_FRAME_CACHE_H
+
+#include <cstdint>
+#include <string>
+
+#include "display-options.h"
+#include "image-source.h"
+
+namespace timg {
+class ThreadPool;
+
+// Persistent on-disk cache of the scaled and composited frames of still
+// images, so that showing the same large picture again with the same options
+// (e.g. browsing a directory of photos in a --grid) does not require to
+// decode and scale it again.
+//
+// Each entry is one file, named after a hash of the key. The key consists
+// of the file identity (path, inode, size, modification time) and all the
+// options that influence the resulting pixels. It is stored in the entry as
+// well to verify the hit. Frames are stored uncompressed, so that a hit only
+// costs an mmap(); the framebuffers use the mapped pixels directly.
+//
+// Once the cache grows beyond "options.cache_max_bytes", the least recently
+// used entries are removed.
+class FrameCache {
+public:
+    // Prepare a cache lookup of "filename" shown with "options",
+    // "frame_offset" and "frame_count", using the cache in
+    // "options.cache_dir".
+    FrameCache(const std::string &filename, const DisplayOptions &options,
+               int frame_offset, int frame_count);
+
+    // Returns an ImageSource sending the cached frames or nullptr if
+    // there is no cache entry.
+    ImageSource *Lookup() const;
+
+    // Wrap a successfully loaded "source", taking ownership. The frames it
+    // sends are stored in the cache if they are still images.
+    ImageSource *Record(ImageSource *source) const;
+
+    // Default directory to keep the cache in: $XDG_CACHE_HOME/timg or
+    // ~/.cache/timg; empty string if neither is known.
+    static std::string DefaultDirectory();
+
+    // Write new entries with tasks in "pool" instead of on the thread
+    // sending the frames. Without, they are written right away.
+    static void WriteInBackground(ThreadPool *pool);
+
+    // Wait until all entries started to be written are done.
+    static void WaitForWrites();
+
+private:
+    const std::string filename_;
+    const int64_t max_bytes_;
+    std::string key_;   // Empty if file can't be cached.
+    std::string path_;  // Path to cache entry.
+};
+}  // namespace timg
+
+#endif  // TIMG_FRAME_CACHE_H
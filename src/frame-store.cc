@@ -0,0 +1,188 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "frame-store.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "framebuffer.h"
+#include "timg-time.h"
+#include "timg-trace.h"
+
+namespace timg {
+// The changes are encoded as a sequence of 32 bit words. Each run starts with
+// a word containing the operation in the upper two bits and the number of
+// pixels in the lower bits, followed by the pixel values the operation needs.
+// Runs don't cross rows.
+static constexpr int kOpShift        = 30;
+static constexpr uint32_t kCountMask = (1u << kOpShift) - 1;
+static constexpr uint32_t kSkip      = 0;  // Pixels unchanged.
+static constexpr uint32_t kLiteral   = 1;  // Followed by <count> pixels.
+static constexpr uint32_t kFill      = 2;  // Followed by one pixel to repeat.
+static constexpr int kMinFillLength  = 3;  // Shorter runs are literals.
+
+static uint32_t PixelWord(rgba_t pixel) {
+    uint32_t result;
+    memcpy(&result, &pixel, sizeof(result));
+    return result;
+}
+
+FrameStore::FrameStore(int64_t memory_budget) : memory_budget_(memory_budget) {}
+FrameStore::~FrameStore() = default;
+
+bool FrameStore::Append(const Framebuffer &frame, const Duration &delay) {
+    TraceSpan span("store", "FrameStore::Append");
+    StoredFrame stored;
+    stored.delay             = delay;
+    const int64_t full_bytes = frame.allocated_bytes();
+    int64_t bytes            = full_bytes;
+    if (last_ && last_->width() == frame.width() &&
+        last_->height() == frame.height() && last_->is_packed() &&
+        frame.is_packed()) {
+        EncodeDifference(*last_, frame, &stored);
+        bytes = stored.changes.size() * sizeof(uint32_t);
+    }
+    if (bytes >= full_bytes) {  // Difference not worth it (or first frame).
+        stored.changes.clear();
+        stored.full.reset(new Framebuffer(frame));  // Shares the pixels.
+        bytes = full_bytes;
+    }
+    stored.changes.shrink_to_fit();
+
+    if (memory_budget_ > 0 && !frames_.empty() &&
+        stored_bytes_ + bytes > memory_budget_) {
+        return false;
+    }
+    stored_bytes_ += bytes;
+    frames_.push_back(std::move(stored));
+    last_.reset(new Framebuffer(frame));
+    return true;
+}
+
+void FrameStore::EncodeDifference(const Framebuffer &previous,
+                                  const Framebuffer &current,
+                                  StoredFrame *result) {
+    const int width  = current.width();
+    const int height = current.height();
+
+    // Determine rectangle containing all changes.
+    int top = -1, bottom = -1, left = width, right = -1;
+    for (int y = 0; y < height; ++y) {
+        const rgba_t *const prev_row = previous.row(y);
+        const rgba_t *const cur_row  = current.row(y);
+        if (memcmp(prev_row, cur_row, width * sizeof(rgba_t)) == 0) continue;
+        if (top < 0) top = y;
+        bottom = y;
+        int x  = 0;
+        while (prev_row[x] == cur_row[x]) ++x;
+        left = std::min(left, x);
+        x    = width - 1;
+        while (prev_row[x] == cur_row[x]) --x;
+        right = std::max(right, x);
+    }
+    if (top < 0) return;  // Identical to previous frame: empty rectangle.
+
+    result->x      = left;
+    result->y      = top;
+    result->width  = right - left + 1;
+    result->height = bottom - top + 1;
+
+    std::vector<uint32_t> &out = result->changes;
+    for (int y = top; y <= bottom; ++y) {
+        const rgba_t *const p = previous.row(y) + left;
+        const rgba_t *const c = current.row(y) + left;
+        const int n           = result->width;
+        auto starts_fill      = [c, n](int k) {
+            int end = k + 1;
+            while (end < n && end - k < kMinFillLength && c[end] == c[k]) ++end;
+            return end - k == kMinFillLength;
+        };
+        int i = 0;
+        while (i < n) {
+            int end = i + 1;
+            if (c[i] == p[i]) {
+                while (end < n && c[end] == p[end]) ++end;
+                out.push_back(kSkip << kOpShift | (end - i));
+                i = end;
+                continue;
+            }
+            while (end < n && c[end] == c[i]) ++end;
+            if (end - i >= kMinFillLength) {
+                out.push_back(kFill << kOpShift | (end - i));
+                out.push_back(PixelWord(c[i]));
+                i = end;
+                continue;
+            }
+            // Literal pixels up to the next unchanged pixel or fill run.
+            end = i;
+            while (end < n && c[end] != p[end] && !starts_fill(end)) ++end;
+            out.push_back(kLiteral << kOpShift | (end - i));
+            for (/**/; i < end; ++i) out.push_back(PixelWord(c[i]));
+        }
+    }
+}
+
+void FrameStore::ApplyDifference(const StoredFrame &frame, Framebuffer *fb) {
+    if (frame.width == 0) return;  // Identical to previous frame.
+    const int fb_width   = fb->width();
+    rgba_t *const pixels = fb->begin();  // Copies the pixels if shared.
+    const uint32_t *op   = frame.changes.data();
+    for (int y = frame.y; y < frame.y + frame.height; ++y) {
+        rgba_t *pos       = pixels + y * fb_width + frame.x;
+        rgba_t *const end = pos + frame.width;
+        while (pos < end) {
+            const uint32_t count = *op & kCountMask;
+            switch (*op++ >> kOpShift) {
+            case kLiteral:
+                memcpy(pos, op, count * sizeof(rgba_t));
+                op += count;
+                break;
+            case kFill: {
+                rgba_t value;
+                memcpy(&value, op++, sizeof(value));
+                std::fill(pos, pos + count, value);
+                break;
+            }
+            default: break;  // kSkip
+            }
+            pos += count;
+        }
+    }
+}
+
+const Framebuffer &FrameStore::Player::Get(int index) {
+    assert(index >= 0 && index < store_.size());
+    if (!current_ || index < index_) {
+        // Start over from the last full frame at or before index.
+        index_ = index;
+        while (!store_.frames_[index_].full) --index_;
+        current_.reset(new Framebuffer(*store_.frames_[index_].full));
+    }
+    while (index_ < index) {
+        const StoredFrame &next = store_.frames_[++index_];
+        if (next.full) {
+            current_.reset(new Framebuffer(*next.full));
+        }
+        else {
+            ApplyDifference(next, current_.get());
+        }
+    }
+    return *current_;
+}
+}  // namespace timg
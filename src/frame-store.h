@@ -0,0 +1,95 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_FRAME_STORE_H
+#define TIMG_FRAME_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "framebuffer.h"
+#include "timg-time.h"
+
+namespace timg {
+// Compact storage of the preprocessed frames of an animation, so that they
+// can be shown in a loop without having to be decoded again.
+//
+// Only the first frame is kept in full. Following frames of the same size
+// are stored as difference to the previous frame: the rectangle containing
+// all changed pixels, run-length encoded. Animations typically only change
+// parts of the image, so this only needs a fraction of the memory of full
+// frames. Frames are reconstructed in sequence when played back with a
+// FrameStore::Player.
+class FrameStore {
+public:
+    // Create a frame store that does not hold more than "memory_budget"
+    // bytes; 0 for unlimited.
+    explicit FrameStore(int64_t memory_budget = 0);
+    FrameStore(const FrameStore &) = delete;
+    ~FrameStore();
+
+    // Append frame to be shown for "delay". Returns false if the frame
+    // does not fit into the memory budget anymore; the first frame is
+    // always accepted.
+    bool Append(const Framebuffer &frame, const Duration &delay);
+
+    int size() const { return (int)frames_.size(); }
+    bool empty() const { return frames_.empty(); }
+    Duration delay(int index) const { return frames_[index].delay; }
+
+    // Number of bytes used to store the frames.
+    int64_t stored_bytes() const { return stored_bytes_; }
+
+    // Reconstructs frames from the store. Accessing frames in sequence is
+    // cheap; going backwards starts again from the last full frame before.
+    class Player {
+    public:
+        explicit Player(const FrameStore &store) : store_(store) {}
+
+        // Get frame with the given index. The returned framebuffer is only
+        // valid until the next call; it is modified in place (copy-on-write
+        // if it is still held by someone else).
+        const Framebuffer &Get(int index);
+
+    private:
+        const FrameStore &store_;
+        std::unique_ptr<Framebuffer> current_;
+        int index_ = -1;
+    };
+
+private:
+    // A frame is either stored in full or as difference to the previous.
+    struct StoredFrame {
+        Duration delay;
+        std::unique_ptr<Framebuffer> full;  // Only set for full frames.
+        int x = 0, y = 0, width = 0, height = 0;  // Rectangle with changes.
+        std::vector<uint32_t> changes;  // Run-length encoded, row by row.
+    };
+
+    static void EncodeDifference(const Framebuffer &previous,
+                                 const Framebuffer &current,
+                                 StoredFrame *result);
+    static void ApplyDifference(const StoredFrame &frame, Framebuffer *fb);
+
+    const int64_t memory_budget_;
+    std::vector<StoredFrame> frames_;
+    std::unique_ptr<Framebuffer> last_;  // To compute the next difference.
+    int64_t stored_bytes_ = 0;
+};
+}  // namespace timg
+
+#endif  // TIMG_FRAME_STORE_H
@@ -18,9 +18,14 @@
 #include <strings.h>
 
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <utility>
+
+#include "timg-memory.h"
+#include "timg-trace.h"
 
 namespace timg {
 
@@ -56,11 +61,18 @@ rgba_t rgba_t::ParseColor(const char *color) {
 // a full row.
 static constexpr int SWS_SCRATCH_ADDITIONAL_ROW = 1;
 
+static size_t OwnAllocationBytes(int width, int height) {
+    return sizeof(rgba_t) * width * (height + SWS_SCRATCH_ADDITIONAL_ROW);
+}
+
 Framebuffer::Framebuffer(int w, int h, const rgba_t *from_data)
     : width_(w),
       height_(h),
-      pixels_(new rgba_t[width_ * (height_ + SWS_SCRATCH_ADDITIONAL_ROW)]),
-      end_(pixels_ + width_ * height_) {
+      storage_(new rgba_t[width_ * (height_ + SWS_SCRATCH_ADDITIONAL_ROW)],
+               std::default_delete<rgba_t[]>()),
+      pixels_(storage_.get()),
+      end_(pixels_ + width_ * height_),
+      allocated_bytes_(OwnAllocationBytes(width_, height_)) {
     strides_[0] = (int)sizeof(rgba_t) * width_;
     strides_[1] = 0;  // empty sentinel value.
     if (from_data) {
@@ -74,32 +86,92 @@ Framebuffer::Framebuffer(int w, int h, const rgba_t *from_data)
 Framebuffer::Framebuffer(int w, int h) : Framebuffer(w, h, nullptr) {}
 
 Framebuffer::Framebuffer(const Framebuffer &other)
-    : Framebuffer(other.width(), other.height(), other.pixels_) {}
+    : width_(other.width_),
+      height_(other.height_),
+      storage_(other.storage_),
+      pixels_(other.pixels_),
+      end_(other.end_),
+      allocated_bytes_(other.allocated_bytes_) {
+    strides_[0] = other.strides_[0];
+    strides_[1] = 0;  // empty sentinel value.
+}
+
+Framebuffer::Framebuffer(int w, int h, rgba_t *pixels, PixelDeleter deleter,
+                         int stride)
+    : width_(w),
+      height_(h),
+      storage_(pixels,
+               [deleter = std::move(deleter)](rgba_t *p) {
+                   if (deleter) deleter(p);
+               }),
+      pixels_(pixels),
+      end_(pixels_ + width_ * height_) {
+    strides_[0]      = stride > 0 ? stride : (int)sizeof(rgba_t) * width_;
+    strides_[1]      = 0;  // empty sentinel value.
+    allocated_bytes_ = (size_t)strides_[0] * height_;
+}
 
-Framebuffer::~Framebuffer() {
-    delete[] row_data_;
-    delete[] pixels_;
+Framebuffer::~Framebuffer() { delete[] row_data_; }
+
+size_t Framebuffer::allocated_bytes() const { return allocated_bytes_; }
+
+void Framebuffer::CopyPixels() {
+    TraceSpan span("framebuffer", "CopyPixels");
+    rgba_t *const copy =
+        new rgba_t[width_ * (height_ + SWS_SCRATCH_ADDITIONAL_ROW)];
+    for (int y = 0; y < height_; ++y) {
+        memcpy(copy + (size_t)y * width_, row(y), sizeof(rgba_t) * width_);
+    }
+    const size_t bytes = OwnAllocationBytes(width_, height_);
+    if (is_shared()) {
+        // Extra memory only needed because someone else still holds on to
+        // the original pixels.
+        MemoryAccount *const account = MemoryAccount::FramebufferCopies();
+        account->Add(bytes);
+        storage_.reset(copy, [account, bytes](rgba_t *p) {
+            delete[] p;
+            account->Add(-(int64_t)bytes);
+        });
+    }
+    else {
+        storage_.reset(copy, std::default_delete<rgba_t[]>());
+    }
+    pixels_          = copy;
+    end_             = pixels_ + width_ * height_;
+    strides_[0]      = (int)sizeof(rgba_t) * width_;
+    allocated_bytes_ = bytes;
+    delete[] row_data_;  // Pointing to the old pixels.
+    row_data_ = nullptr;
 }
 
 void Framebuffer::SetPixel(int x, int y, rgba_t value) {
     if (x < 0 || x >= width() || y < 0 || y >= height()) return;
-    pixels_[width_ * y + x] = value;
+    MakeExclusive();
+    mutable_row(y)[x] = value;
 }
 
 rgba_t Framebuffer::at(int x, int y) const {
     assert(x >= 0 && x < width() && y >= 0 && y < height());
-    return pixels_[width_ * y + x];
+    return row(y)[x];
 }
 
 void Framebuffer::Clear() {
-    memset(pixels_, 0, sizeof(*pixels_) * width_ * height_);
+    MakeExclusive();
+    if (is_packed()) {
+        memset(pixels_, 0, sizeof(*pixels_) * width_ * height_);
+        return;
+    }
+    for (int y = 0; y < height_; ++y) {
+        memset(mutable_row(y), 0, sizeof(*pixels_) * width_);
+    }
 }
 
 uint8_t **Framebuffer::row_data() {
+    MakeExclusive();
     if (!row_data_) {
         row_data_ = new uint8_t *[height_ + 1];
         for (int i = 0; i < height_; ++i)
-            row_data_[i] = (uint8_t *)pixels_ + i * width_ * sizeof(rgba_t);
+            row_data_[i] = (uint8_t *)mutable_row(i);
         row_data_[height_] = nullptr;  // empty sentinel value.
     }
     return row_data_;
@@ -110,21 +182,30 @@ void Framebuffer::AlphaComposeBackground(const bgcolor_query &get_bg,
                                          int pheight, int start_row) {
     if (!get_bg) return;  // -b none
 
-    iterator pos = begin() + (start_row * width());
-    for (/**/; pos < end(); ++pos) {
-        if (pos->a < 0xff) break;  // First pixel that is transparent.
+    TraceSpan span("compose", "AlphaComposeBackground");
+    if (!is_packed()) CopyPixels();
+
+    // Only read while looking for transparency, so that shared pixels are
+    // not copied if there is nothing to do.
+    const rgba_t *first = pixels_ + (start_row * width());
+    for (/**/; first < end_; ++first) {
+        if (first->a < 0xff) break;  // First pixel that is transparent.
     }
-    if (pos >= end()) return;  // Nothing transparent all the way to the end.
+    if (first >= end_) return;  // Nothing transparent all the way to the end.
 
     // Need to do alpha blending, so only now we have to retrieve the bgcolor.
     const rgba_t bgcolor = get_bg();
     if (bgcolor.a == 0x00) return;  // nothing to do.
 
+    const ptrdiff_t first_offset = first - pixels_;
+    MakeExclusive();
+    iterator pos = pixels_ + first_offset;
+
     // Fast path if we don't have a pattern color.
     if (pattern_col.a == 0x00 || pattern_col == bgcolor || pwidth <= 0 ||
         pheight <= 0) {
         const LinearColor bg(bgcolor);
-        for (/**/; pos < end(); ++pos) {
+        for (/**/; pos < end_; ++pos) {
             if (pos->a == 0xff) continue;
             *pos = LinearColor(*pos).AlphaBlend(bg).repack();
         }
@@ -137,8 +218,8 @@ void Framebuffer::AlphaComposeBackground(const bgcolor_query &get_bg,
     // Pos moved to the first pixel that required alpha blending.
     // From this pos, we need to recover the x/y position to be in the
     // right place for the checkerboard pattern.
-    const int start_x = (pos - begin()) % width_;
-    const int start_y = (pos - begin()) / width_;
+    const int start_x = first_offset % width_;
+    const int start_y = first_offset / width_;
     for (int y = start_y; y < height_; ++y) {
         const int y_pattern_pos = y / pheight;
         for (int x = (y == start_y ? start_x : 0); x < width_; ++x, pos++) {
@@ -16,11 +16,14 @@
 #ifndef TIMG_FRAMEBUFFER_H
 #define TIMG_FRAMEBUFFER_H
 
+#include <atomic>
+#include <cassert>
 #include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <functional>
 #include <initializer_list>
+#include <memory>
 
 namespace timg {
 struct rgba_t {
@@ -61,16 +64,41 @@ struct rgba_t {
 static_assert(sizeof(rgba_t) == 4, "Unexpected size for rgba_t struct");
 
 // Very simple framebuffer, storing widht*height pixels in RGBA format.
+//
+// Copies are cheap: they share the pixels with the original, which is
+// reference counted, so a frame can be handed to an encoder thread without
+// copying. The pixels are only copied once a framebuffer is modified while
+// shared (copy-on-write), e.g. a source re-using its framebuffer for the
+// next frame while the previous one is still being encoded.
+// Read-only access is safe from multiple threads; all non-const accessors
+// might copy the pixels, so a framebuffer object itself should only be
+// modified by one thread.
 class Framebuffer {
 public:
     typedef rgba_t *iterator;
     typedef const rgba_t *const_iterator;
     class rgb_iterator;
 
+    // Function to release pixels adopted by a Framebuffer.
+    using PixelDeleter = std::function<void(rgba_t *pixels)>;
+
     Framebuffer() = delete;
     Framebuffer(int width, int height);
     explicit Framebuffer(const Framebuffer &other);
 
+    // Create a framebuffer that adopts externally allocated "pixels" instead
+    // of allocating and copying, e.g. to hand the output of a decoder
+    // directly to the scaler. The "deleter" is called with the pixels once
+    // the framebuffer is destroyed (can be empty if the pixels are not to be
+    // owned). The "stride" is the number of bytes from the start of one row
+    // to the next; 0 for tightly packed rows.
+    //
+    // Note, if rows are not tightly packed (see is_packed()), the const
+    // begin()/end() must not be used; use row() instead. The non-const
+    // begin()/end() first copy the pixels to packed rows.
+    Framebuffer(int width, int height, rgba_t *pixels, PixelDeleter deleter,
+                int stride = 0);
+
     ~Framebuffer();
 
     // Set a pixel at position X/Y with rgba_t color value. use to_rgba() to
@@ -80,12 +108,31 @@ public:
     // Get pixel data at given position.
     rgba_t at(int x, int y) const;
 
+    // Pixels of row "y"; works with any stride.
+    const rgba_t *row(int y) const {
+        return (const rgba_t *)((const uint8_t *)pixels_ +
+                                (size_t)y * strides_[0]);
+    }
+
     // Clear to fully transparent black pixels.
     void Clear();
 
     inline int width() const { return width_; }
     inline int height() const { return height_; }
 
+    // Number of bytes allocated for the pixels.
+    size_t allocated_bytes() const;
+
+    // Pixels are shared with another framebuffer and will be copied on
+    // the next modification.
+    bool is_shared() const { return storage_.use_count() > 1; }
+
+    // Rows are immediately following each other without padding. This is
+    // always the case unless pixels are adopted with a larger stride.
+    bool is_packed() const {
+        return strides_[0] == (int)sizeof(rgba_t) * width_;
+    }
+
     // Blend all transparent pixels with a background color and an optional
     // alternative pattern color to make them a solid (alpha=0xff) color.
     // The Background color is queried using the provided callback and only
@@ -106,11 +153,25 @@ public:
                                 int start_row = 0);
 
     // The raw internal buffer containing width()*height() pixels organized
-    // from top left to bottom right.
-    const_iterator begin() const { return pixels_; }
-    iterator begin() { return pixels_; }
-    const_iterator end() const { return end_; }
-    iterator end() { return end_; }
+    // from top left to bottom right. The const versions only if is_packed().
+    // The non-const versions detach shared pixels first, so the returned
+    // iterators are only valid until this framebuffer is copied.
+    const_iterator begin() const {
+        assert(is_packed());
+        return pixels_;
+    }
+    iterator begin() {
+        MakeExclusive(true);
+        return pixels_;
+    }
+    const_iterator end() const {
+        assert(is_packed());
+        return end_;
+    }
+    iterator end() {
+        MakeExclusive(true);
+        return end_;
+    }
 
     /* the following two methods are useful with line-oriented sws_scale()
      * to allow it to directly write into our frame-buffer
@@ -121,16 +182,34 @@ public:
     const int *stride() const { return strides_; }
 
     // Return an array containing pointers to the data for each line.
+    // Detaches shared pixels first, see begin().
     uint8_t **row_data();
 
 private:
     Framebuffer(int width, int height, const rgba_t *from_data);
 
+    // Copy pixels if shared, so that they can be modified. Also copy if
+    // packed rows are needed, but we have adopted pixels with a larger stride.
+    void MakeExclusive(bool need_packed = false) {
+        if (is_shared() || (need_packed && !is_packed())) {
+            CopyPixels();
+            return;
+        }
+        // use_count() is a relaxed load; make sure the reads of another
+        // thread that just released its copy happen before we write.
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    void CopyPixels();
+
+    rgba_t *mutable_row(int y) { return const_cast<rgba_t *>(row(y)); }
+
     const int width_;
     const int height_;
-    rgba_t *const pixels_;
-    rgba_t *const end_;
+    std::shared_ptr<rgba_t> storage_;  // Owns pixels; shared between copies.
+    rgba_t *pixels_;
+    rgba_t *end_;
     int strides_[2];
+    size_t allocated_bytes_;
     uint8_t **row_data_ = nullptr;  // Only allocated if requested.
 };
 
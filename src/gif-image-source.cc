@@ -0,0 +1,320 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "gif-image-source.h"
+
+// A private copy of the GIF decoder of stb; we use its internal API to read
+// one frame at a time, which is not available in the public API.
+#define STB_IMAGE_STATIC
+#define STBI_ONLY_GIF
+#define STB_IMAGE_IMPLEMENTATION
+
+#include <algorithm>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "display-options.h"
+#include "frame-store.h"
+#include "framebuffer.h"
+#include "image-scaler.h"
+#include "image-source.h"
+#include "renderer.h"
+#include "timg-cancel.h"
+#include "timg-time.h"
+
+// Most of the static copy is not used by us.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "stb/stb_image.h"
+#pragma GCC diagnostic pop
+
+namespace timg {
+// State of the stb GIF decoder between frames. The decoded frames are
+// composited onto one canvas, taking care of the disposal modes.
+// Note, the stbi__context points to a buffer inside itself, so it must
+// not be moved once opened.
+class GIFImageSource::Decoder {
+public:
+    Decoder() {
+        memset(&context_, 0, sizeof(context_));
+        memset(&gif_, 0, sizeof(gif_));
+    }
+    Decoder(const Decoder &) = delete;
+    ~Decoder() {
+        STBI_FREE(gif_.out);
+        STBI_FREE(gif_.history);
+        STBI_FREE(gif_.background);
+        if (file_) fclose(file_);
+    }
+
+    // Open file. Returns false if this is not a GIF.
+    bool Open(const std::string &filename) {
+        file_ = stbi__fopen(filename.c_str(), "rb");
+        if (!file_) return false;
+        stbi__start_file(&context_, file_);
+        return stbi__gif_test(&context_);
+    }
+
+    // Decode the next frame onto the canvas. Returns false at the end of
+    // the file or on error; the canvas then still contains the last frame.
+    bool Next() {
+        // Dispose of the last frame. stb keeps the canvas from before the
+        // last frame was drawn in gif_.background; mode 3 ("restore to
+        // previous") restores to that if passed as "two_back". stb restores
+        // mode 2 ("restore to background") to it as well, so clear the area
+        // of the last frame to transparent first, like GraphicsMagick does.
+        if (gif_.out && ((gif_.eflags & 0x1C) >> 2) == 2) {
+            const int pixels = gif_.w * gif_.h;
+            for (int i = 0; i < pixels; ++i) {
+                if (gif_.history[i]) {
+                    memset(&gif_.background[i * kDesiredChannels], 0,
+                           kDesiredChannels);
+                }
+            }
+        }
+        int channels;
+        const uint8_t *const data = stbi__gif_load_next(
+            &context_, &gif_, &channels, kDesiredChannels, gif_.background);
+        if (!data || data == (const uint8_t *)&context_) return false;
+        ++frames_read_;
+        return true;
+    }
+
+    int width() const { return gif_.w; }
+    int height() const { return gif_.h; }
+    uint8_t *canvas() const { return gif_.out; }
+    int frames_read() const { return frames_read_; }
+
+    // Like browsers and GraphicsMagick, show frames without delay for 1/10s
+    Duration delay() const {
+        return Duration::Millis(gif_.delay < 10 ? 100 : gif_.delay);
+    }
+
+private:
+    static constexpr int kDesiredChannels = 4;  // RGBA, our framebuffer format
+
+    FILE *file_ = nullptr;
+    stbi__context context_;
+    stbi__gif gif_;
+    int frames_read_ = 0;
+};
+
+GIFImageSource::GIFImageSource(const std::string &filename)
+    : ImageSource(filename) {}
+
+GIFImageSource::~GIFImageSource() = default;
+
+std::string GIFImageSource::FormatTitle(
+    const std::string &format_string) const {
+    return FormatFromParameters(format_string, filename_, orig_width_,
+                                orig_height_, "gif");
+}
+
+bool GIFImageSource::LoadAndScale(const DisplayOptions &options,
+                                  int frame_offset, int frame_count,
+                                  const CancellationToken &cancel) {
+    // Reading stdin can't be undone if this is not a GIF, so leave that to
+    // the other sources.
+    if (filename() == "-") return false;
+#ifdef WITH_TIMG_GRPAPHICSMAGICK
+    if (options.scroll_animation) return false;  // GraphicsMagick can scroll.
+#endif
+
+    options_ = options;
+    decoder_.reset(new Decoder());
+    if (!decoder_->Open(filename()) || !decoder_->Next()) {
+        decoder_.reset();
+        return false;
+    }
+
+    // Skip up to the first frame to show; frames are composited on top of
+    // each other, so they need to be decoded but not scaled. If there are
+    // fewer frames, the last one is shown.
+    for (int i = 0; i < frame_offset; ++i) {
+        if (cancel.cancelled()) {
+            decoder_.reset();
+            return false;
+        }
+        if (!decoder_->Next()) break;
+    }
+    skipped_frames_ = decoder_->frames_read() - 1;
+
+    orig_width_  = decoder_->width();
+    orig_height_ = decoder_->height();
+    CalcScaleToFitDisplay(orig_width_, orig_height_, options, false,
+                          &target_width_, &target_height_);
+    scaler_ = ImageScaler::Create(orig_width_, orig_height_,
+                                  ImageScaler::ColorFmt::kRGBA, target_width_,
+                                  target_height_);
+
+    frames_.reset(new FrameStore(options.frame_memory_budget));
+    AppendDecodedFrame();  // The first frame is always accepted.
+
+    // Already decode the next frame to know if this is an animation; it is
+    // only scaled once needed.
+    have_decoded_frame_              = decoder_->Next();
+    is_animation_before_frame_limit_ = decoder_->frames_read() > 1;
+    is_animation_ = have_decoded_frame_ && (frame_count < 0 || frame_count > 1);
+    max_frames_   = frame_count;
+
+    if (!is_animation_) {
+        // Cropping is only done for still images; that is left to the
+        // other sources.
+        if (options.crop_border > 0 || options.auto_crop) return false;
+        decoder_.reset();
+        have_decoded_frame_ = false;
+    }
+
+    return true;
+}
+
+void GIFImageSource::ScaleDecodedFrame(Framebuffer *frame) {
+    // Scale straight from the decoder canvas, which we don't own.
+    Framebuffer canvas(orig_width_, orig_height_, (rgba_t *)decoder_->canvas(),
+                       nullptr);
+    if (scaler_) {
+        scaler_->Scale(canvas, frame);
+    }
+    frame->AlphaComposeBackground(
+        options_.bgcolor_getter, options_.bg_pattern_color,
+        options_.pattern_size * options_.cell_x_px,
+        options_.pattern_size * options_.cell_y_px / 2);
+}
+
+bool GIFImageSource::AppendDecodedFrame() {
+    Framebuffer frame(target_width_, target_height_);
+    ScaleDecodedFrame(&frame);
+    const int64_t stored_before = frames_->stored_bytes();
+    if (!frames_->Append(frame, decoder_->delay())) return false;
+    AccountMemory(frames_->stored_bytes() - stored_before);
+    return true;
+}
+
+bool GIFImageSource::DecodeNextFrame() {
+    if (!decoder_ || store_full_) return false;  // All frames read already.
+    const bool limit_reached =
+        max_frames_ >= 0 && frames_->size() >= max_frames_;
+    if (limit_reached || (!have_decoded_frame_ && !decoder_->Next())) {
+        decoder_.reset();  // Done; release decoder memory and file.
+        have_decoded_frame_ = false;
+        return false;
+    }
+    have_decoded_frame_ = false;
+    if (!AppendDecodedFrame()) {
+        // The decoder keeps this frame; it and all following are decoded
+        // again in each loop.
+        store_full_ = true;
+        ReportError(filename() + ": --frame-memory exceeded after " +
+                    std::to_string(frames_->size()) +
+                    " frames; decoding the following frames in each loop.");
+        return false;
+    }
+    return true;
+}
+
+bool GIFImageSource::DecodeUnstoredFrame(int index) {
+    if (max_frames_ >= 0 && index >= max_frames_) return false;
+    // The frame the decoder canvas has, relative to the first shown.
+    auto decoded_index = [this]() {
+        return decoder_->frames_read() - 1 - skipped_frames_;
+    };
+    if (!decoder_ || decoded_index() > index) {
+        // Frames are composited on top of each other: start over.
+        decoder_.reset(new Decoder());
+        if (!decoder_->Open(filename()) || !decoder_->Next()) {
+            decoder_.reset();
+            return false;
+        }
+    }
+    while (decoded_index() < index) {
+        if (!decoder_->Next()) {
+            decoder_.reset();  // End of the animation.
+            return false;
+        }
+    }
+    unstored_frame_.reset(new Framebuffer(target_width_, target_height_));
+    ScaleDecodedFrame(unstored_frame_.get());
+    if (index - frames_->size() == (int)unstored_delays_.size()) {
+        unstored_delays_.push_back(decoder_->delay());
+    }
+    return true;
+}
+
+void GIFImageSource::SendFrames(const Duration &duration, int loops,
+                                const volatile sig_atomic_t &interrupt_received,
+                                const Renderer::WriteFramebufferFun &sink) {
+    int last_height = -1;  // First image emit will not have a height.
+    if (!is_animation_) {
+        loops = 1;  // If there is no animation, nothing to repeat.
+    }
+    // Not initialized or negative value wants us to loop forever.
+    // (note, kNotInitialized is actually negative, but here for clarity
+    const bool loop_forever =
+        (loops < 0) || (loops == timg::kNotInitialized);  // NOLINT
+
+    const int indentation =
+        options_.center_horizontally ? (options_.width - target_width_) / 2 : 0;
+
+    FrameStore::Player player(*frames_);
+    timg::Duration time_from_first_frame;
+    bool is_first                 = true;
+    const Framebuffer *last_frame = nullptr;
+    for (int k = 0; (loop_forever || k < loops) && !interrupt_received &&
+                    time_from_first_frame < duration;
+         ++k) {
+        for (int f = 0; !interrupt_received; ++f) {
+            // If the terminal repeats the animation by itself, we only keep
+            // the pace and send the last frame again instead.
+            const bool pace_only =
+                k > 0 && last_frame && !sink.RepeatContentNeeded();
+            const int unstored = f - frames_->size();
+            if (pace_only) {
+                if (unstored >= (int)unstored_delays_.size()) break;
+            }
+            // In the first loop, frames are decoded while the previous ones
+            // are already being encoded and written. Frames that did not fit
+            // into the store anymore are decoded again in each loop.
+            else if (unstored >= 0 && !DecodeNextFrame() &&
+                     (!store_full_ || !DecodeUnstoredFrame(f))) {
+                break;
+            }
+            const bool stored        = f < frames_->size();
+            const Framebuffer &frame = pace_only ? *last_frame
+                                       : stored  ? player.Get(f)
+                                                 : *unstored_frame_;
+            time_from_first_frame.Add(
+                stored ? frames_->delay(f)
+                       : unstored_delays_[f - frames_->size()]);
+            const int dy = is_animation_ && last_height > 0 ? -last_height : 0;
+            SeqType seq_type = SeqType::FrameImmediate;
+            if (is_animation_) {
+                seq_type =
+                    k > 0 ? SeqType::AnimationRepeat : SeqType::AnimationFrame;
+                if (is_first) seq_type = SeqType::StartOfAnimation;
+            }
+            sink(indentation, dy, frame, seq_type,
+                 std::min(time_from_first_frame, duration));
+            last_height = frame.height();
+            last_frame  = &frame;
+            if (time_from_first_frame > duration) break;
+            is_first = false;
+        }
+    }
+}
+}  // namespace timg
@@ -0,0 +1,96 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_GIF_IMAGE_SOURCE_H
+#define TIMG_GIF_IMAGE_SOURCE_H
+
+#include <csignal>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "display-options.h"
+#include "frame-store.h"
+#include "framebuffer.h"
+#include "image-scaler.h"
+#include "image-source.h"
+#include "renderer.h"
+#include "timg-time.h"
+
+namespace timg {
+// Streaming GIF source. Frames are decoded, composited and scaled one at a
+// time while the animation is shown, so the first frame is on screen after
+// decoding just that instead of the whole file. Frames are kept in a
+// FrameStore to be played again in following loops.
+class GIFImageSource final : public ImageSource {
+public:
+    explicit GIFImageSource(const std::string &filename);
+    ~GIFImageSource() final;
+
+    // Open the GIF and prepare the first frame to be shown. Following
+    // frames are only decoded in SendFrames().
+    bool LoadAndScale(const DisplayOptions &options, int frame_offset,
+                      int frame_count, const CancellationToken &cancel) final;
+
+    void SendFrames(const Duration &duration, int loops,
+                    const volatile sig_atomic_t &interrupt_received,
+                    const Renderer::WriteFramebufferFun &sink) final;
+
+    std::string FormatTitle(const std::string &format_string) const final;
+
+    bool IsAnimationBeforeFrameLimit() const final {
+        return is_animation_before_frame_limit_;
+    }
+
+private:
+    class Decoder;
+
+    // Scale the frame the decoder currently has into "frame".
+    void ScaleDecodedFrame(Framebuffer *frame);
+
+    // Scale the frame the decoder currently has and append it to frames_.
+    // Returns false if it does not fit into the memory budget.
+    bool AppendDecodedFrame();
+
+    // Decode the next frame to be shown and append it to frames_. Returns
+    // false if there are no more frames or the store is full.
+    bool DecodeNextFrame();
+
+    // Once the store is full: decode frame "index" after the stored ones
+    // into unstored_frame_. Returns false if there is no such frame.
+    bool DecodeUnstoredFrame(int index);
+
+    DisplayOptions options_;
+    std::unique_ptr<Decoder> decoder_;  // Released once all frames are read.
+    bool have_decoded_frame_ = false;   // Decoder has a frame not yet stored.
+    std::unique_ptr<ImageScaler> scaler_;
+    std::unique_ptr<FrameStore> frames_;
+    int orig_width_    = 0;
+    int orig_height_   = 0;
+    int target_width_  = 0;
+    int target_height_ = 0;
+    int max_frames_    = -1;  // Number of frames to show; -1 for all.
+    bool is_animation_ = false;
+    bool is_animation_before_frame_limit_ = false;
+
+    // Frames after the store is full are decoded again in each loop.
+    int skipped_frames_ = 0;  // Before the first frame shown (frame offset).
+    bool store_full_    = false;
+    std::unique_ptr<Framebuffer> unstored_frame_;
+    std::vector<Duration> unstored_delays_;  // Known from the first loop.
+};
+}  // namespace timg
+
+#endif  // TIMG_GIF_IMAGE_SOURCE_H
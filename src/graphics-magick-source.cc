@@ -27,14 +27,18 @@
 #include <cstdio>
 #include <cstring>
 #include <exception>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
+#include "frame-store.h"
 #include "framebuffer.h"
 #include "renderer.h"
+#include "timg-cancel.h"
 #include "timg-time.h"
+#include "timg-trace.h"
 
 static constexpr bool kDebug = false;
 
@@ -85,9 +89,19 @@ private:
     timg::Framebuffer framebuffer_;
 };
 
-GraphicsMagickSource::~GraphicsMagickSource() {
-    for (PreprocessedFrame *f : frames_) delete f;
-}
+// Frames after the frame store was full. They are read again from the file
+// at the start of their sequence in each loop and prepared one by one.
+class GraphicsMagickSource::UnstoredFrames {
+public:
+    std::vector<Magick::Image> images;  // Coalesced, not scaled yet.
+    std::unique_ptr<Framebuffer> frame;  // Current prepared frame.
+    std::vector<Duration> delays;        // Known from the first loop.
+};
+
+GraphicsMagickSource::GraphicsMagickSource(const std::string &filename)
+    : ImageSource(filename) {}
+
+GraphicsMagickSource::~GraphicsMagickSource() = default;
 
 const char *GraphicsMagickSource::VersionInfo() {
     return "GraphicsMagick " MagickLibVersionText " (" MagickReleaseDate ")";
@@ -153,9 +167,84 @@ static void readImagesWithTransparentBackground(
     Magick::throwException(exception_info);
 }
 
+// Cancellation of the image load running in this thread, if any.
+static thread_local const CancellationToken *tls_load_cancel = nullptr;
+
+// GraphicsMagick calls the monitor regularly while reading and processing
+// images; returning failure makes it abandon the operation.
+static MagickLib::MagickPassFail CancellationMonitor(
+    const char *, const MagickLib::magick_int64_t,
+    const MagickLib::magick_uint64_t, MagickLib::ExceptionInfo *) {
+    const bool cancelled = tls_load_cancel && tls_load_cancel->cancelled();
+    return cancelled ? MagickFail : MagickPass;
+}
+
+// Have the monitor poll "cancel" for GraphicsMagick operations in this
+// thread while in scope.
+class ScopedLoadCancellation {
+public:
+    explicit ScopedLoadCancellation(const CancellationToken &cancel) {
+        static std::once_flag install_monitor;
+        std::call_once(install_monitor, []() {
+            MagickLib::SetMonitorHandler(CancellationMonitor);
+        });
+        tls_load_cancel = &cancel;
+    }
+    ~ScopedLoadCancellation() { tls_load_cancel = nullptr; }
+};
+
+// Crop, scale and rotate "img" as requested in "opts". Returns false if
+// scaling failed.
+static bool PrepareFrame(const DisplayOptions &opts, bool is_animation,
+                         const std::string &filename, Magick::Image *img) {
+    ExifImageOp exif_op;
+    if (opts.exif_rotate) exif_op = GetExifOp(*img);
+
+    // We do trimming only if this is not an animation, which will likely
+    // not create a pleasent result.
+    if (!is_animation) {
+        if (opts.crop_border > 0) {
+            const int c = opts.crop_border;
+            const int w = std::max(1, (int)img->columns() - 2 * c);
+            const int h = std::max(1, (int)img->rows() - 2 * c);
+            img->crop(Magick::Geometry(w, h, c, c));
+        }
+        if (opts.auto_crop) {
+            img->trim();
+        }
+    }
+
+    // Figure out scaling for the image.
+    int target_width = 0, target_height = 0;
+    if (CalcScaleToFitDisplay(img->columns(), img->rows(), opts,
+                              abs(exif_op.angle) == 90, &target_width,
+                              &target_height)) {
+        try {
+            TraceSpan span("scale", "Magick::Image::scale");
+            auto geometry = Magick::Geometry(target_width, target_height);
+            geometry.aspect(true);  // Force to scale to given size.
+            if (opts.antialias)
+                img->scale(geometry);
+            else
+                img->sample(geometry);
+        }
+        catch (const std::exception &e) {
+            if (kDebug) fprintf(stderr, "%s: %s\n", filename.c_str(), e.what());
+            return false;
+        }
+    }
+
+    // Now that the image is nice and small, the following ops are cheap
+    if (exif_op.flip) img->flip();
+    img->rotate(exif_op.angle);
+    return true;
+}
+
 bool GraphicsMagickSource::LoadAndScale(const DisplayOptions &opts,
-                                        int frame_offset, int frame_count) {
+                                        int frame_offset, int frame_count,
+                                        const CancellationToken &cancel) {
     options_ = opts;
+    frames_.reset(new FrameStore(opts.frame_memory_budget));
 
 #ifdef WITH_TIMG_VIDEO
     if (LooksLikeAPNG(filename())) {
@@ -163,6 +252,7 @@ bool GraphicsMagickSource::LoadAndScale(const DisplayOptions &opts,
     }
 #endif
 
+    const ScopedLoadCancellation scoped_cancellation(cancel);
     std::vector<Magick::Image> frames;
     try {
         readImagesWithTransparentBackground(
@@ -181,6 +271,7 @@ bool GraphicsMagickSource::LoadAndScale(const DisplayOptions &opts,
         return false;
     }
 
+    if (cancel.cancelled()) return false;
     if (frames.empty()) {
         if (kDebug) fprintf(stderr, "No image found.");
         return false;
@@ -222,63 +313,71 @@ bool GraphicsMagickSource::LoadAndScale(const DisplayOptions &opts,
         result.erase(result.begin(), result.begin() + frame_offset);
     }
 
+    frame_offset_ = std::max(frame_offset, 0);
     for (Magick::Image &img : result) {
-        ExifImageOp exif_op;
-        if (opts.exif_rotate) exif_op = GetExifOp(img);
-
-        // We do trimming only if this is not an animation, which will likely
-        // not create a pleasent result.
-        if (!is_animation_) {
-            if (opts.crop_border > 0) {
-                const int c = opts.crop_border;
-                const int w = std::max(1, (int)img.columns() - 2 * c);
-                const int h = std::max(1, (int)img.rows() - 2 * c);
-                img.crop(Magick::Geometry(w, h, c, c));
-            }
-            if (opts.auto_crop) {
-                img.trim();
-            }
-        }
-
-        // Figure out scaling for the image.
-        int target_width = 0, target_height = 0;
-        if (CalcScaleToFitDisplay(img.columns(), img.rows(), opts,
-                                  abs(exif_op.angle) == 90, &target_width,
-                                  &target_height)) {
-            try {
-                auto geometry = Magick::Geometry(target_width, target_height);
-                geometry.aspect(true);  // Force to scale to given size.
-                if (opts.antialias)
-                    img.scale(geometry);
-                else
-                    img.sample(geometry);
-            }
-            catch (const std::exception &e) {
-                if (kDebug)
-                    fprintf(stderr, "%s: %s\n", filename().c_str(), e.what());
-                return false;
-            }
+        if (cancel.cancelled()) return false;
+        if (!PrepareFrame(opts, is_animation_, filename(), &img)) return false;
+        const PreprocessedFrame frame(img, opts, result.size() > 1);
+        if (!frames_->Append(frame.framebuffer(), frame.delay())) {
+            ReportError(filename() + ": --frame-memory exceeded after " +
+                        std::to_string(frames_->size()) +
+                        " frames; decoding the following frames in each "
+                        "loop.");
+            unstored_.reset(new UnstoredFrames());
+            break;
         }
-
-        // Now that the image is nice and small, the following ops are cheap
-        if (exif_op.flip) img.flip();
-        img.rotate(exif_op.angle);
-
-        frames_.push_back(new PreprocessedFrame(img, opts, result.size() > 1));
     }
+    AccountMemory(frames_->stored_bytes());
 
-    max_frames_ = (frame_count < 0)
-                      ? (int)frames_.size()
-                      : std::min(frame_count, (int)frames_.size());
+    // Frames not stored are read again when needed.
+    const int available = unstored_ ? (int)result.size() : frames_->size();
+    max_frames_ =
+        (frame_count < 0) ? available : std::min(frame_count, available);
 
     return true;
 }
 
 int GraphicsMagickSource::IndentationIfCentered(
-    const PreprocessedFrame *frame) const {
-    return options_.center_horizontally
-               ? (options_.width - frame->framebuffer().width()) / 2
-               : 0;
+    const Framebuffer &frame) const {
+    return options_.center_horizontally ? (options_.width - frame.width()) / 2
+                                        : 0;
+}
+
+bool GraphicsMagickSource::DecodeUnstoredFrame(int index) {
+    const int first_unstored = frames_->size();
+    if (index == first_unstored) {
+        // Start of the unstored sequence in this loop: read them again.
+        std::vector<Magick::Image> frames;
+        try {
+            readImagesWithTransparentBackground(&frames, filename());
+        }
+        catch (Magick::Warning &) {
+            // Same as in LoadAndScale(): use what we got.
+        }
+        catch (std::exception &) {
+            return false;
+        }
+        const size_t needed = frame_offset_ + max_frames_;
+        if (frames.size() > needed) frames.resize(needed);
+        unstored_->images.clear();
+        Magick::coalesceImages(&unstored_->images, frames.begin(),
+                               frames.end());
+        const size_t skip = std::min(unstored_->images.size(),
+                                     (size_t)(frame_offset_ + first_unstored));
+        unstored_->images.erase(unstored_->images.begin(),
+                                unstored_->images.begin() + skip);
+    }
+    const size_t i = index - first_unstored;
+    if (i >= unstored_->images.size()) return false;
+    Magick::Image &img = unstored_->images[i];
+    if (!PrepareFrame(options_, is_animation_, filename(), &img)) return false;
+    const PreprocessedFrame frame(img, options_, true);
+    unstored_->frame.reset(new Framebuffer(frame.framebuffer()));
+    if (i == unstored_->delays.size()) {
+        unstored_->delays.push_back(frame.delay());
+    }
+    img = Magick::Image();  // Not needed anymore in this loop.
+    return true;
 }
 
 void GraphicsMagickSource::SendFrames(
@@ -292,31 +391,49 @@ void GraphicsMagickSource::SendFrames(
     }
 
     int last_height = -1;  // First image emit will not have a height.
-    if (frames_.size() == 1 || !is_animation_)
+    if (max_frames_ == 1 || !is_animation_)
         loops = 1;  // If there is no animation, nothing to repeat.
 
     // Not initialized or negative value wants us to loop forever.
     // (note, kNotInitialized is actually negative, but here for clarity
     const bool loop_forever = (loops < 0) || (loops == timg::kNotInitialized);
 
+    FrameStore::Player player(*frames_);
     timg::Duration time_from_first_frame;
-    bool is_first = true;
+    bool is_first                 = true;
+    const Framebuffer *last_frame = nullptr;
     for (int k = 0; (loop_forever || k < loops) && !interrupt_received &&
                     time_from_first_frame < duration;
          ++k) {
         for (int f = 0; f < max_frames_ && !interrupt_received; ++f) {
-            const auto &frame = frames_[f];
-            time_from_first_frame.Add(frame->delay());
+            // If the terminal repeats the animation by itself, we only keep
+            // the pace and send the last frame again instead.
+            const bool pace_only =
+                k > 0 && last_frame && !sink.RepeatContentNeeded();
+            // Frames that did not fit into the store are decoded again.
+            const bool stored     = f < frames_->size();
+            const size_t unstored = f - frames_->size();
+            if (!stored && (pace_only ? unstored >= unstored_->delays.size()
+                                      : !DecodeUnstoredFrame(f))) {
+                break;
+            }
+            const Framebuffer &frame = pace_only ? *last_frame
+                                       : stored  ? player.Get(f)
+                                                 : *unstored_->frame;
+            time_from_first_frame.Add(stored ? frames_->delay(f)
+                                             : unstored_->delays[unstored]);
             const int dx = IndentationIfCentered(frame);
             const int dy = is_animation_ && last_height > 0 ? -last_height : 0;
             SeqType seq_type = SeqType::FrameImmediate;
             if (is_animation_) {
-                seq_type = is_first ? SeqType::StartOfAnimation
-                                    : SeqType::AnimationFrame;
+                seq_type =
+                    k > 0 ? SeqType::AnimationRepeat : SeqType::AnimationFrame;
+                if (is_first) seq_type = SeqType::StartOfAnimation;
             }
-            sink(dx, dy, frame->framebuffer(), seq_type,
+            sink(dx, dy, frame, seq_type,
                  std::min(time_from_first_frame, duration));
-            last_height = frame->framebuffer().height();
+            last_height = frame.height();
+            last_frame  = &frame;
             if (time_from_first_frame > duration) break;
             is_first = false;
         }
@@ -330,7 +447,7 @@ void GraphicsMagickSource::Scroll(
     const volatile sig_atomic_t &interrupt_received, int dx, int dy,
     const Duration &scroll_delay,
     const Renderer::WriteFramebufferFun &write_fb) {
-    if (frames_.size() > 1) {
+    if (frames_->size() > 1) {
         if (kDebug)
             fprintf(stderr,
                     "This is an %simage format, "
@@ -340,7 +457,8 @@ void GraphicsMagickSource::Scroll(
         // TODO: do both.
     }
 
-    const Framebuffer &img = frames_[0]->framebuffer();
+    FrameStore::Player player(*frames_);
+    const Framebuffer &img = player.Get(0);
     const int img_width    = img.width();
     const int img_height   = img.height();
 
@@ -381,7 +499,10 @@ void GraphicsMagickSource::Scroll(
             if (interrupt_received || time_from_first_frame > duration) break;
             const int64_t x_cycle_pos = dx * cycle_pos;
             const int64_t y_cycle_pos = dy * cycle_pos;
-            for (int y = 0; y < display_h; ++y) {
+            // If the terminal repeats the scrolling by itself, we only keep
+            // the pace with the last frame.
+            const bool pace_only = k > 0 && !write_fb.RepeatContentNeeded();
+            for (int y = 0; y < display_h && !pace_only; ++y) {
                 for (int x = 0; x < display_w; ++x) {
                     const int x_src = (x_init + x_cycle_pos + x) % img_width;
                     const int y_src = (y_init + y_cycle_pos + y) % img_height;
@@ -389,10 +510,11 @@ void GraphicsMagickSource::Scroll(
                 }
             }
             time_from_first_frame.Add(scroll_delay);
-            write_fb(
-                0, is_first ? 0 : -display_fb.height(), display_fb,
-                is_first ? SeqType::StartOfAnimation : SeqType::AnimationFrame,
-                time_from_first_frame);
+            SeqType seq_type =
+                k > 0 ? SeqType::AnimationRepeat : SeqType::AnimationFrame;
+            if (is_first) seq_type = SeqType::StartOfAnimation;
+            write_fb(0, is_first ? 0 : -display_fb.height(), display_fb,
+                     seq_type, time_from_first_frame);
             is_first = false;
         }
     }
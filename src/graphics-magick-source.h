@@ -17,10 +17,12 @@
 #define GRAPHICS_MAGICK_SOURCE_H_
 
 #include <csignal>
+#include <memory>
 #include <string>
-#include <vector>
 
 #include "display-options.h"
+#include "frame-store.h"
+#include "framebuffer.h"
 #include "image-source.h"
 #include "renderer.h"
 #include "timg-time.h"
@@ -29,8 +31,7 @@ namespace timg {
 
 class GraphicsMagickSource final : public ImageSource {
 public:
-    explicit GraphicsMagickSource(const std::string &filename)
-        : ImageSource(filename) {}
+    explicit GraphicsMagickSource(const std::string &filename);
     ~GraphicsMagickSource() final;
 
     static const char *VersionInfo();
@@ -43,7 +44,7 @@ public:
     // If this is not a loadable image, returns false, otherwise
     // We're ready for display.
     bool LoadAndScale(const DisplayOptions &options, int frame_offset,
-                      int frame_count) final;
+                      int frame_count, const CancellationToken &cancel) final;
 
     // Display loaded image. If this is an animation, then
     // "duration", "max_frames" and "loops" will limit the duration of the
@@ -64,6 +65,11 @@ public:
 
 private:
     class PreprocessedFrame;
+    class UnstoredFrames;
+
+    // Read and prepare frame "index" after the ones stored into
+    // unstored_->frame. Returns false if there is no such frame.
+    bool DecodeUnstoredFrame(int index);
 
     // Provide image scrolling in dx/dy direction for up to the given time.
     void Scroll(const Duration &duration, int loops,
@@ -72,12 +78,14 @@ private:
                 const Renderer::WriteFramebufferFun &write_fb);
 
     // Return how much we should indent a frame if centering is requested.
-    int IndentationIfCentered(const PreprocessedFrame *frame) const;
+    int IndentationIfCentered(const Framebuffer &frame) const;
 
     DisplayOptions options_;
-    std::vector<PreprocessedFrame *> frames_;
+    std::unique_ptr<FrameStore> frames_;
     int orig_width_, orig_height_;
     int max_frames_;
+    int frame_offset_ = 0;
+    std::unique_ptr<UnstoredFrames> unstored_;  // Set if store was full.
     bool is_animation_before_frame_limit_ = false;
     bool is_animation_                    = false;
 };
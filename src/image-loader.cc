@@ -0,0 +1,102 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "image-loader.h"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+
+#include "file-list.h"
+#include "image-source.h"
+#include "thread-pool.h"
+#include "timg-cancel.h"
+
+namespace timg {
+ImageLoader::ImageLoader(ThreadPool *pool, FileList *files,
+                         const LoadFun &load, int max_ahead,
+                         int64_t max_bytes_ahead,
+                         const volatile sig_atomic_t &interrupt_received)
+    : pool_(pool),
+      files_(files),
+      load_(load),
+      max_ahead_(max_ahead > 0 ? max_ahead : 1),
+      max_bytes_ahead_(max_bytes_ahead),
+      interrupt_received_(interrupt_received),
+      bytes_ahead_(std::make_shared<std::atomic<int64_t>>(0)) {}
+
+ImageLoader::~ImageLoader() {
+    // Images that are still loading are cancelled and left behind; no need
+    // to wait for them (possibly blocking) if we're interrupted.
+    for (Pending &pending : pending_) {
+        pending.cancel->Cancel();
+        if (pending.loaded.wait_for(std::chrono::seconds(0)) ==
+            std::future_status::ready) {
+            delete pending.loaded.get().source;
+        }
+    }
+}
+
+void ImageLoader::FillWindow() {
+    while ((int)pending_.size() < max_ahead_ &&
+           (max_bytes_ahead_ <= 0 || *bytes_ahead_ < max_bytes_ahead_)) {
+        std::string filename;
+        if (!files_->Next(&filename)) break;
+        auto cancel = std::make_shared<CancellationToken>(interrupt_received_);
+        const std::function<Loaded()> f = [filename, load = load_, cancel,
+                                           bytes_ahead = bytes_ahead_]() {
+            ImageSource *const source = load(filename, *cancel);
+            const int64_t bytes       = source ? source->memory_bytes() : 0;
+            *bytes_ahead += bytes;
+            return Loaded{source, bytes};
+        };
+        pending_.push_back(
+            {pool_->ExecAsync(f, ThreadPool::Priority::kDecode), cancel});
+    }
+}
+
+bool ImageLoader::Next(std::unique_ptr<ImageSource> *source) {
+    FillWindow();
+    if (pending_.empty()) return false;
+    const Loaded loaded = pending_.front().loaded.get();
+    pending_.pop_front();
+    *bytes_ahead_ -= loaded.bytes;
+    source->reset(loaded.source);
+    FillWindow();  // Load more while this one is shown.
+    return true;
+}
+
+void ImageLoader::WaitForReadAhead() {
+    FillWindow();
+    for (Pending &pending : pending_) pending.loaded.wait();
+}
+
+int64_t ImageLoader::DefaultMaxBytesAhead() {
+#ifdef _SC_AVPHYS_PAGES
+    const long pages = sysconf(_SC_AVPHYS_PAGES);
+#else
+    const long pages = sysconf(_SC_PHYS_PAGES);  // e.g. macOS: only total.
+#endif
+    const long page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0) return 0;
+    return (int64_t)pages * page_size / 4;
+}
+}  // namespace timg
@@ -0,0 +1,96 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_IMAGE_LOADER_H
+#define TIMG_IMAGE_LOADER_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+
+#include "file-list.h"
+#include "image-source.h"
+#include "thread-pool.h"
+#include "timg-cancel.h"
+
+namespace timg {
+// Loads the images of a FileList in a thread pool ahead of them being shown.
+// Only a window of upcoming images is loaded at a time, limited by number
+// and memory held by loaded images, so that huge file lists don't need
+// unbounded memory.
+// Loads that are still in progress when the loader is destroyed, or once
+// "interrupt_received" is set, are cancelled.
+class ImageLoader {
+public:
+    // Function loading the image source of a file; nullptr on failure.
+    // Should give up early once "cancel" is cancelled.
+    using LoadFun = std::function<ImageSource *(
+        const std::string &filename, const CancellationToken &cancel)>;
+
+    // Load images from "files" using "load" in the "pool". Keep up to
+    // "max_ahead" images loading or loaded ahead of being requested with
+    // Next(), but stop loading more if these hold more than
+    // "max_bytes_ahead" of memory (0 for no limit).
+    ImageLoader(ThreadPool *pool, FileList *files, const LoadFun &load,
+                int max_ahead, int64_t max_bytes_ahead,
+                const volatile sig_atomic_t &interrupt_received);
+    ImageLoader(const ImageLoader &) = delete;
+    ~ImageLoader();
+
+    // Get the next image source in order of the file list, waiting for it
+    // to be loaded if needed. The source is nullptr if it could not be
+    // loaded. Returns false at the end of the list.
+    bool Next(std::unique_ptr<ImageSource> *source);
+
+    // Wait until all images in the read-ahead window are loaded.
+    void WaitForReadAhead();
+
+    // Default memory limit for images loaded ahead: a quarter of the memory
+    // currently available.
+    static int64_t DefaultMaxBytesAhead();
+
+private:
+    struct Loaded {
+        ImageSource *source;
+        int64_t bytes;  // Accounted to bytes_ahead_.
+    };
+
+    struct Pending {
+        std::future<Loaded> loaded;
+        std::shared_ptr<CancellationToken> cancel;  // Shared with the task.
+    };
+
+    // Start loading more images until the window is full.
+    void FillWindow();
+
+    ThreadPool *const pool_;
+    FileList *const files_;
+    const LoadFun load_;
+    const int max_ahead_;
+    const int64_t max_bytes_ahead_;
+    const volatile sig_atomic_t &interrupt_received_;
+    std::deque<Pending> pending_;
+
+    // Memory held by loaded images not requested yet. Shared with the
+    // loading tasks, which could outlive us.
+    const std::shared_ptr<std::atomic<int64_t>> bytes_ahead_;
+};
+}  // namespace timg
+
+#endif  // TIMG_IMAGE_LOADER_H
@@ -34,6 +34,7 @@ extern "C" {  // avutil is missing extern "C"
 #endif
 
 #include "framebuffer.h"
+#include "timg-trace.h"
 
 // TODO: there is also zimg.
 
@@ -61,6 +62,7 @@ public:
     ~SWSImageScaler() { sws_freeContext(sws_context_); }
 
     void Scale(Framebuffer &in, Framebuffer *out) final {
+        TraceSpan span("scale", "ImageScaler::Scale");
         sws_scale(sws_context_, in.row_data(), in.stride(), 0, in.height(),
                   out->row_data(), out->stride());
     }
@@ -81,10 +83,12 @@ public:
     }
 
     void Scale(Framebuffer &in, Framebuffer *out) final {
+        TraceSpan span("scale", "ImageScaler::Scale");
         struct STBIR_RESIZE context {};
-        stbir_resize_init(&context, (uint8_t *)in.begin(), in.width(),
-                          in.height(), 0, (uint8_t *)out->begin(), out->width(),
-                          out->height(), 0, STBIR_RGBA, STBIR_TYPE_UINT8);
+        stbir_resize_init(&context, (const uint8_t *)in.row(0), in.width(),
+                          in.height(), in.stride()[0], (uint8_t *)out->begin(),
+                          out->width(), out->height(), out->stride()[0],
+                          STBIR_RGBA, STBIR_TYPE_UINT8);
         stbir_set_pixel_layouts(
             &context, in_fmt_ == ColorFmt::kRGBA ? STBIR_RGBA : STBIR_BGRA,
             STBIR_RGBA);
@@ -32,6 +32,8 @@
 
 // Various implementations for the factory.
 #include "display-options.h"
+#include "frame-cache.h"
+#include "gif-image-source.h"
 #include "graphics-magick-source.h"
 #include "jpeg-source.h"
 #include "openslide-source.h"
@@ -39,10 +41,26 @@
 #include "qoi-image-source.h"
 #include "stb-image-source.h"
 #include "svg-image-source.h"
+#include "timg-cancel.h"
+#include "timg-memory.h"
+#include "timg-trace.h"
 #include "video-source.h"
 
 namespace timg {
 
+ImageSource::~ImageSource() {
+    if (memory_account_) memory_account_->Add(-memory_account_->current());
+}
+
+int64_t ImageSource::memory_bytes() const {
+    return memory_account_ ? memory_account_->current() : 0;
+}
+
+void ImageSource::AccountMemory(int64_t bytes) {
+    if (!memory_account_) memory_account_ = MemoryAccount::Create(filename_);
+    memory_account_->Add(bytes);
+}
+
 // Returns 'true' if image needs scaling.
 bool ImageSource::CalcScaleToFitDisplay(int img_width, int img_height,
                                         const DisplayOptions &orig_options,
@@ -157,66 +175,107 @@ ImageSource *ImageSource::Create(const std::string &filename,
                                  int frame_offset, int frame_count,
                                  bool attempt_image_loading,
                                  bool attempt_video_loading,
+                                 const CancellationToken &cancel,
                                  std::string *error) {
+    TraceSpan create_span("load", "ImageSource::Create");
+    if (create_span.active()) create_span.set_detail(filename);
+
+    // Attempt to LoadAndScale() with the given source, which we take
+    // ownership of.
     std::unique_ptr<ImageSource> result;
+    auto try_load = [&](ImageSource *source, const char *name) {
+        result.reset(source);
+        TraceSpan span("load", "LoadAndScale");
+        if (span.active()) span.set_detail(name);
+        return result->LoadAndScale(options, frame_offset, frame_count,
+                                    cancel);
+    };
+    // A source giving up as we're cancelled is no reason to try the next.
+    auto cancelled = [&]() {
+        if (!cancel.cancelled()) return false;
+        result.reset();
+        return true;
+    };
+
+    if (cancelled()) return nullptr;
+
+    // Still images shown before with the same options might be cached.
+    std::unique_ptr<FrameCache> cache;
+    if (attempt_image_loading && !options.cache_dir.empty()) {
+        cache.reset(
+            new FrameCache(filename, options, frame_offset, frame_count));
+        if (ImageSource *cached = cache->Lookup()) return cached;
+    }
+    auto loaded_image = [&]() {
+        return cache ? cache->Record(result.release()) : result.release();
+    };
+
     if (attempt_image_loading) {
 #ifdef WITH_TIMG_OPENSLIDE_SUPPORT
-        result.reset(new OpenSlideSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (try_load(new OpenSlideSource(filename), "openslide")) {
+            return loaded_image();
         }
+        if (cancelled()) return nullptr;
 #endif
 
 #ifdef WITH_TIMG_QOI
-        result.reset(new QOIImageSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (try_load(new QOIImageSource(filename), "qoi")) {
+            return loaded_image();
         }
+        if (cancelled()) return nullptr;
 #endif
 
 #ifdef WITH_TIMG_JPEG
-        result.reset(new JPEGSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (try_load(new JPEGSource(filename), "jpeg")) {
+            return loaded_image();
         }
+        if (cancelled()) return nullptr;
 #endif
 
 #ifdef WITH_TIMG_RSVG
-        result.reset(new SVGImageSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (try_load(new SVGImageSource(filename), "svg")) {
+            return loaded_image();
         }
+        if (cancelled()) return nullptr;
 #endif
 
 #ifdef WITH_TIMG_POPPLER
-        result.reset(new PDFImageSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (try_load(new PDFImageSource(filename), "pdf")) {
+            return loaded_image();
+        }
+        if (cancelled()) return nullptr;
+#endif
+
+#ifdef WITH_TIMG_STB
+        // Streaming GIF decoding, so that animations start right away.
+        if (try_load(new GIFImageSource(filename), "gif")) {
+            return loaded_image();
         }
+        if (cancelled()) return nullptr;
 #endif
 
 #ifdef WITH_TIMG_GRPAPHICSMAGICK
-        result.reset(new GraphicsMagickSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (try_load(new GraphicsMagickSource(filename), "graphicsmagick")) {
+            return loaded_image();
         }
+        if (cancelled()) return nullptr;
 #endif
 
 #ifdef WITH_TIMG_STB
         // STB image loading always last as last fallback resort.
-        result.reset(new STBImageSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (try_load(new STBImageSource(filename), "stb")) {
+            return loaded_image();
         }
+        if (cancelled()) return nullptr;
 #endif
     }  // end attempt image loading
 
 #ifdef WITH_TIMG_VIDEO
     if (attempt_video_loading) {
-        result.reset(new VideoSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
+        if (try_load(new VideoSource(filename), "video")) {
             return result.release();
         }
+        if (cancelled()) return nullptr;
     }  // end attempt video loading
 #endif
 
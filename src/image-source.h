@@ -18,10 +18,16 @@
 
 #include <signal.h>
 
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "display-options.h"
 #include "renderer.h"
+#include "timg-cancel.h"
+#include "timg-memory.h"
 #include "timg-time.h"
 
 namespace timg {
@@ -34,12 +40,16 @@ public:
     // Returns a fully LoadAndScale()'d ImageSource that SendFrame()
     // can be called on, or nullptr if file can not be opened.
     // In case of an error, the error message is filled into "error" out param.
+    // Loading is abandoned early once "cancel" is cancelled; nullptr is then
+    // returned without an error message.
     static ImageSource *Create(const std::string &filename,
                                const DisplayOptions &options, int frame_offset,
                                int frames_count, bool attempt_image_loading,
-                               bool attempt_video_loading, std::string *error);
+                               bool attempt_video_loading,
+                               const CancellationToken &cancel,
+                               std::string *error);
 
-    virtual ~ImageSource() {}
+    virtual ~ImageSource();
 
     // Send preprocessed frames for a maximum of given, max frames and loops,
     // whatever comes first. Stop loop when "interrupt_received" is true.
@@ -59,6 +69,15 @@ public:
     // limited by frames_count (Context: Issue #86)
     virtual bool IsAnimationBeforeFrameLimit() const { return false; }
 
+    // Memory currently held by this source, as accounted with
+    // AccountMemory().
+    virtual int64_t memory_bytes() const;
+
+    // Return and forget messages about problems that did not prevent showing
+    // the image. They are collected to be shown after the image output, not
+    // to clutter it.
+    std::vector<std::string> TakeErrors() { return std::move(errors_); }
+
 protected:
     explicit ImageSource(const std::string &filename) : filename_(filename) {}
 
@@ -66,10 +85,13 @@ protected:
     // Images are processed using the parameters in DisplayOptions.
     // Return 'true' if successful. Only then, it is allowed to call
     // SendFrames().
+    // Long running loads should poll "cancel" and return false once it is
+    // cancelled.
     // Implementations of this will be called by the ImageSource::Create
     // factory.
     virtual bool LoadAndScale(const DisplayOptions &options, int frame_offset,
-                              int frame_count) = 0;
+                              int frame_count,
+                              const CancellationToken &cancel) = 0;
 
     // Utility function that derived ImageSources are interested in.
     //
@@ -96,8 +118,23 @@ protected:
     // by various sources to choose to pass it on to the video subsystem.
     static bool LooksLikeAPNG(const std::string &filename);
 
+    // Account "bytes" of memory held by this source, e.g. decoded frames;
+    // negative if released. Whatever is still accounted for is released
+    // once the source is destroyed; the peak is kept for reporting.
+    void AccountMemory(int64_t bytes);
+
+    // Report a problem, e.g. a limit that was hit, to be shown later; see
+    // TakeErrors().
+    void ReportError(const std::string &message) {
+        errors_.push_back(message);
+    }
+
 protected:
     const std::string filename_;
+
+private:
+    std::shared_ptr<MemoryAccount> memory_account_;  // Created on first use.
+    std::vector<std::string> errors_;
 };
 }  // namespace timg
 
@@ -15,6 +15,7 @@
 
 #include "iterm2-canvas.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdio>
@@ -29,31 +30,48 @@
 #include "timg-base64.h"
 #include "timg-png.h"
 #include "timg-time.h"
-
-#define SCREEN_CURSOR_UP_FORMAT    "\033[%dA"  // Move cursor up given lines.
-#define SCREEN_CURSOR_RIGHT_FORMAT "\033[%dC"  // Move cursor right given cols
+#include "timg-trace.h"
 
 namespace timg {
 ITerm2GraphicsCanvas::ITerm2GraphicsCanvas(BufferedWriteSequencer *ws,
                                            ThreadPool *thread_pool,
+                                           bool multipart,
                                            const DisplayOptions &opts)
-    : TerminalCanvas(ws), options_(opts), executor_(thread_pool) {}
+    : TerminalCanvas(ws),
+      options_(opts),
+      executor_(thread_pool),
+      multipart_(multipart) {}
 
 void ITerm2GraphicsCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
                                 SeqType seq_type, Duration end_of_frame) {
+    if (SkipLateSend(seq_type, end_of_frame)) return;
+
     if (dy < 0) {
         MoveCursorDY(cell_height_for_pixels(dy));
     }
     MoveCursorDX(x / options_.cell_x_px);
 
-    // Create copy to be used in threads.
+    if (multipart_) {
+        SendMultipart(fb_orig, seq_type, end_of_frame);
+        return;
+    }
+
+    // Handle to be used in threads; shares the pixels with the original.
     const Framebuffer *const fb = new Framebuffer(fb_orig);
-    char *const buffer          = RequestBuffer(fb->width(), fb->height());
-    char *const offset          = AppendPrefixToBuffer(buffer);
+    OutBuffer *const buffer     = new OutBuffer();
+    AppendPrefixToBuffer(buffer);
 
-    const auto &options                   = options_;
-    std::function<OutBuffer()> encode_fun = [options, fb, buffer, offset]() {
+    const auto &options                     = options_;
+    BufferedWriteSequencer *const sequencer = write_sequencer_;
+    ThreadPool *const pool                  = executor_;
+    std::function<OutBuffer()> encode_fun   = [options, fb, buffer, sequencer,
+                                               pool]() {
+        TraceSpan span("encode", "iterm2");
+        const Time encode_start;
         std::unique_ptr<const Framebuffer> auto_delete(fb);
+        std::unique_ptr<OutBuffer> auto_delete_buffer(buffer);
+        // Pending frames are discarded once interrupted.
+        if (sequencer->cancellation().cancelled()) return OutBuffer();
         const size_t png_buf_size = png::UpperBound(fb->width(), fb->height());
         std::unique_ptr<char[]> png_buf(new char[png_buf_size]);
 
@@ -61,32 +79,102 @@ void ITerm2GraphicsCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
                                          options.local_alpha_handling
                                              ? png::ColorEncoding::kRGB_24
                                              : png::ColorEncoding::kRGBA_32,
-                                         png_buf.get(), png_buf_size);
+                                         png_buf.get(), png_buf_size, pool);
+
+        buffer->Appendf("\e]1337;File=size=%d;width=%dpx;height=%dpx;inline=1:",
+                        png_size, fb->width(), fb->height());
 
-        char *pos = offset;
-        pos += sprintf(pos,
-                       "\e]1337;File=size=%d;width=%dpx;height=%dpx;inline=1:",
-                       png_size, fb->width(), fb->height());
-        pos = timg::EncodeBase64(png_buf.get(), png_size, pos);
+        // Encode in chunks that fit into one buffer segment.
+        static constexpr int kChunkBytes = OutBuffer::kSegmentSize / 4 * 3;
+        for (int done = 0; done < png_size; done += kChunkBytes) {
+            const int chunk_bytes   = std::min(png_size - done, kChunkBytes);
+            char *const chunk_start = buffer->Reserve(chunk_bytes / 3 * 4 + 4);
+            char *const chunk_end   = timg::EncodeBase64(
+                png_buf.get() + done, chunk_bytes, chunk_start);
+            buffer->Commit(chunk_end - chunk_start);
+        }
 
-        *pos++ = '\007';
-        *pos++ = '\n';  // Need one final cursor movement.
-        return OutBuffer(buffer, pos - buffer);
+        buffer->Append("\007\n");  // Need one final cursor movement.
+        sequencer->RecordEncodeTime(Time::Now() - encode_start);
+        return std::move(*buffer);
     };
-    write_sequencer_->WriteBuffer(executor_->ExecAsync(encode_fun), seq_type,
-                                  end_of_frame);
+    write_sequencer_->WriteBuffer(
+        executor_->ExecAsync(encode_fun, ThreadPool::Priority::kEncode),
+        seq_type, end_of_frame);
 }
 
-char *ITerm2GraphicsCanvas::RequestBuffer(int width, int height) {
-    const size_t png_compressed_size = png::UpperBound(width, height);
-    const int encoded_base64_size    = png_compressed_size * 4 / 3;
-    const size_t content_size =
-        strlen(SCREEN_CURSOR_UP_FORMAT) + strlen(SCREEN_CURSOR_RIGHT_FORMAT) +
-        encoded_base64_size  //
-        + strlen("\e\1337;File=width=9999px;height=9999px;inline=1:\007") + 4 +
-        1; /* digit space for cursor up/right; \n */
+void ITerm2GraphicsCanvas::SendMultipart(const Framebuffer &fb_orig,
+                                         SeqType seq_type,
+                                         Duration end_of_frame) {
+    // Handle to be used in threads; shares the pixels with the original.
+    const Framebuffer *const fb = new Framebuffer(fb_orig);
+    OutBuffer *const buffer     = new OutBuffer();
+    AppendPrefixToBuffer(buffer);
+
+    // The parts are handed to the sequencer as soon as they are encoded, so
+    // the terminal already receives the image while the rest is compressed.
+    auto stream = std::make_shared<OutBufferStream>(kMaxPendingParts);
+
+    const auto &options                     = options_;
+    BufferedWriteSequencer *const sequencer = write_sequencer_;
+    ThreadPool *const pool                  = executor_;
+    std::function<void()> encode_fun        = [options, fb, buffer, stream,
+                                               sequencer, pool]() {
+        TraceSpan span("encode", "iterm2");
+        const Time encode_start;
+        std::unique_ptr<const Framebuffer> auto_delete(fb);
+        std::unique_ptr<OutBuffer> part(buffer);
+        // Pending frames are discarded once interrupted.
+        if (sequencer->cancellation().cancelled()) {
+            stream->Finish();
+            return;
+        }
+
+        part->Appendf(
+            "\e]1337;MultipartFile=width=%dpx;height=%dpx;inline=1\007",
+            fb->width(), fb->height());
+
+        std::unique_ptr<char[]> part_bytes(new char[kPartBytes]);
+        int part_fill  = 0;
+        auto emit_part = [&]() {
+            char *const start = part->Reserve(kPartBytes / 3 * 4 + 32);
+            char *pos         = start + sprintf(start, "\e]1337;FilePart=");
+            pos = timg::EncodeBase64(part_bytes.get(), part_fill, pos);
+            *pos++ = '\007';
+            part->Commit(pos - start);
+            stream->Append(std::move(*part));
+            part_fill = 0;
+        };
+        // Once interrupted, no more parts are sent; FileEnd still finishes
+        // the sequence that might already be written in part.
+        png::EncodeStream(
+            *fb, options.compress_pixel_level,
+            options.local_alpha_handling ? png::ColorEncoding::kRGB_24
+                                         : png::ColorEncoding::kRGBA_32,
+            [&](const char *data, size_t len) {
+                while (len > 0) {
+                    const size_t n =
+                        std::min(len, (size_t)(kPartBytes - part_fill));
+                    memcpy(part_bytes.get() + part_fill, data, n);
+                    part_fill += n;
+                    data += n;
+                    len -= n;
+                    if (part_fill == kPartBytes) emit_part();
+                }
+                return !sequencer->cancellation().cancelled();
+            },
+            pool);
+        if (part_fill > 0) emit_part();
 
-    return new char[content_size];
+        // Need one final cursor movement.
+        part->Append("\e]1337;FileEnd\007\n");
+        stream->Append(std::move(*part));
+        stream->Finish();
+        sequencer->RecordEncodeTime(Time::Now() - encode_start);
+    };
+    // The returned future is not needed; the stream tells when done.
+    executor_->ExecAsync(encode_fun, ThreadPool::Priority::kEncode);
+    write_sequencer_->WriteBuffer(stream->GetFuture(), seq_type, end_of_frame);
 }
 
 int ITerm2GraphicsCanvas::cell_height_for_pixels(int pixels) const {
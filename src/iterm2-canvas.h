@@ -27,8 +27,10 @@ namespace timg {
 // Implements https://iterm2.com/documentation-images.html
 class ITerm2GraphicsCanvas final : public TerminalCanvas {
 public:
+    // With "multipart", images are sent with the MultipartFile sequence
+    // (iTerm2 >= 3.5) in parts while they are still being encoded.
     ITerm2GraphicsCanvas(BufferedWriteSequencer *ws, ThreadPool *thread_pool,
-                         const DisplayOptions &opts);
+                         bool multipart, const DisplayOptions &opts);
 
     int cell_height_for_pixels(int pixels) const final;
 
@@ -36,10 +38,19 @@ public:
               SeqType sequence_type, Duration end_of_frame) override;
 
 private:
+    // PNG bytes sent per FilePart; a multiple of 3 to be base64-encoded on
+    // its own, and small enough to fit into one buffer segment.
+    static constexpr int kPartBytes = (OutBuffer::kSegmentSize - 64) / 4 * 3;
+
+    // Parts encoded ahead of being written; this bounds the memory needed.
+    static constexpr int kMaxPendingParts = 4;
+
+    void SendMultipart(const Framebuffer &fb, SeqType seq_type,
+                       Duration end_of_frame);
+
     const DisplayOptions &options_;
     ThreadPool *const executor_;
-
-    char *RequestBuffer(int width, int height);
+    const bool multipart_;
 };
 }  // namespace timg
 #endif  // ITERM2_CANVAS_H
@@ -129,7 +129,8 @@ std::string JPEGSource::FormatTitle(const std::string &format_string) const {
                                 orig_height_, "jpeg");
 }
 
-bool JPEGSource::LoadAndScale(const DisplayOptions &opts, int, int) {
+bool JPEGSource::LoadAndScale(const DisplayOptions &opts, int, int,
+                              const CancellationToken &) {
     options_ = opts;
     if (opts.scroll_animation || filename() == "/dev/stdin" ||
         filename() == "-") {
@@ -215,6 +216,7 @@ bool JPEGSource::LoadAndScale(const DisplayOptions &opts, int, int) {
     scaler->Scale(decode_image, image_.get());
 
     image_.reset(ApplyExifOp(image_.release(), exif_op));
+    AccountMemory(image_->allocated_bytes());
     return true;
 }
 
@@ -36,7 +36,7 @@ public:
     static const char *VersionInfo();
 
     bool LoadAndScale(const DisplayOptions &options, int frame_offset,
-                      int frame_count) final;
+                      int frame_count, const CancellationToken &cancel) final;
 
     void SendFrames(const Duration &duration, int loops,
                     const volatile sig_atomic_t &interrupt_received,
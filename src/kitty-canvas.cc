@@ -25,16 +25,19 @@
 #include <ctime>
 #include <functional>
 #include <memory>
+#include <string>
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
+#include "kitty-transfer.h"
+#include "term-query.h"
 #include "terminal-canvas.h"
 #include "thread-pool.h"
 #include "timg-base64.h"
 #include "timg-png.h"
 #include "timg-time.h"
+#include "timg-trace.h"
 
-#define SCREEN_CURSOR_UP_FORMAT    "\033[%dA"  // Move cursor up given lines.
 #define SCREEN_CURSOR_RIGHT_FORMAT "\033[%dC"  // Move cursor right given cols
 
 #define TMUX_START_PASSTHROUGH "\ePtmux;"
@@ -55,10 +58,13 @@ static uint32_t CreateId() {
 // Placehholder unicode characters to be used in tmux image output.
 // https://sw.kovidgoyal.net/kitty/graphics-protocol/#unicode-placeholders
 static char *append_xy_msb(char *buffer, int x, int y, uint8_t msb);
-static char *AppendUnicodePicureTiles(char *pos, uint32_t id, int indent,
-                                      int rows, int cols) {
-    *pos++ = '\r';
+static void AppendUnicodePicureTiles(OutBuffer *out, uint32_t id, int indent,
+                                     int rows, int cols) {
+    out->Append("\r");
     for (int r = 0; r < rows; ++r) {
+        // Each tile is one character plus up to three diacritics.
+        char *const row_start = out->Reserve(64 + cols * 16);
+        char *pos             = row_start;
         if (indent > 0) {
             pos += sprintf(pos, SCREEN_CURSOR_RIGHT_FORMAT, indent);
         }
@@ -69,8 +75,25 @@ static char *AppendUnicodePicureTiles(char *pos, uint32_t id, int indent,
             pos = append_xy_msb(pos, r, c, (id >> 24) & 0xff);
         }
         pos += sprintf(pos, "\e[39m\n\r");
+        out->Commit(pos - row_start);
+    }
+}
+
+// Write pixels of "fb" as tightly packed rows of RGBA or RGB bytes to "out".
+static void PackPixels(const Framebuffer &fb, bool with_alpha, char *out) {
+    for (int y = 0; y < fb.height(); ++y) {
+        const rgba_t *pixel = fb.row(y);
+        if (with_alpha) {
+            memcpy(out, pixel, fb.width() * sizeof(rgba_t));
+            out += fb.width() * sizeof(rgba_t);
+            continue;
+        }
+        for (int x = 0; x < fb.width(); ++x, ++pixel) {
+            *out++ = pixel->r;
+            *out++ = pixel->g;
+            *out++ = pixel->b;
+        }
     }
-    return pos;
 }
 
 static char *AppendEscaped(char *pos, char c, bool wrap_tmux) {
@@ -113,81 +136,384 @@ static void EnableTmuxPassthrough() {
 KittyGraphicsCanvas::KittyGraphicsCanvas(BufferedWriteSequencer *ws,
                                          ThreadPool *thread_pool,
                                          bool tmux_passthrough_needed,
+                                         KittyTransmission transmission,
+                                         bool terminal_animation,
+                                         bool reuse_images,
                                          const DisplayOptions &opts)
     : TerminalCanvas(ws),
       options_(opts),
       tmux_passthrough_needed_(tmux_passthrough_needed),
+      transmission_(transmission),
+      terminal_animation_(terminal_animation),
+      reuse_images_(reuse_images),
       executor_(thread_pool) {
     if (tmux_passthrough_needed) {
         EnableTmuxPassthrough();
     }
 }
 
+KittyGraphicsCanvas::~KittyGraphicsCanvas() {
+    EndAnimation();  // Final commands are written by ~TerminalCanvas()
+}
+
+std::string KittyGraphicsCanvas::Command(const char *keys) const {
+    const bool wrap_tmux = tmux_passthrough_needed_;
+    char buffer[256];
+    char *pos = buffer;
+    if (wrap_tmux) pos += sprintf(pos, TMUX_START_PASSTHROUGH);
+    pos = AppendEscaped(pos, '_', wrap_tmux);
+    pos += sprintf(pos, "G%s,q=2", keys);
+    pos = AppendEscaped(pos, '\\', wrap_tmux);
+    if (wrap_tmux) pos += sprintf(pos, TMUX_END_PASSTHROUGH);
+    return std::string(buffer, pos - buffer);
+}
+
+void KittyGraphicsCanvas::EndAnimation() {
+    if (animation_.looping) {
+        // Stopping leaves whatever frame was shown; show the last frame as
+        // it would have been without looping in the terminal.
+        char keys[64];
+        snprintf(keys, sizeof(keys), "a=a,i=%u,s=1", animation_.id);
+        std::string stop = Command(keys);
+        snprintf(keys, sizeof(keys), "a=a,i=%u,c=%d", animation_.id,
+                 animation_.frames);
+        stop += Command(keys);
+        AddPrefixNextSend(stop.data(), stop.size());
+    }
+    animation_ = {};
+}
+
+// Gap in milliseconds a frame is shown; kitty treats 0 as default gap.
+static int FrameGapMillis(const Duration &start, const Duration &end) {
+    const int64_t gap_ns = end.nanoseconds() - start.nanoseconds();
+    return std::max<int64_t>(1, (gap_ns + 500000) / 1000000);
+}
+
+// Hash of size and pixels of "fb"; good enough to tell images apart.
+static uint64_t ContentHash(const Framebuffer &fb) {
+    uint64_t hash = ((uint64_t)fb.width() << 32) | (uint32_t)fb.height();
+    for (int y = 0; y < fb.height(); ++y) {
+        const rgba_t *const end = fb.row(y) + fb.width();
+        for (const rgba_t *pixel = fb.row(y); pixel < end; ++pixel) {
+            uint32_t value;
+            memcpy(&value, pixel, sizeof(value));
+            hash = (hash ^ value) * 0x100000001b3;  // FNV-1a prime.
+            hash ^= hash >> 29;
+        }
+    }
+    return hash;
+}
+
+// Determine the bounding rectangle of the pixels that differ between the
+// equally sized "previous" and "current". Returns false if there are none.
+static bool FindChangedRect(const Framebuffer &previous,
+                            const Framebuffer &current, int *x, int *y,
+                            int *width, int *height) {
+    const int w            = current.width();
+    const int h            = current.height();
+    const size_t row_bytes = w * sizeof(rgba_t);
+    int top                = 0;
+    while (top < h &&
+           memcmp(previous.row(top), current.row(top), row_bytes) == 0) {
+        ++top;
+    }
+    if (top == h) return false;
+    int bottom = h - 1;
+    while (memcmp(previous.row(bottom), current.row(bottom), row_bytes) == 0) {
+        --bottom;
+    }
+    // Each row only needs to be looked at up to the bounds found so far.
+    int left  = w;
+    int right = -1;
+    for (int row = top; row <= bottom; ++row) {
+        const rgba_t *const before = previous.row(row);
+        const rgba_t *const after  = current.row(row);
+        int first                  = 0;
+        while (first < left && before[first] == after[first]) ++first;
+        left     = first;
+        int last = w - 1;
+        while (last > right && before[last] == after[last]) --last;
+        right = last;
+    }
+    *x      = left;
+    *y      = top;
+    *width  = right - left + 1;
+    *height = bottom - top + 1;
+    return true;
+}
+
 void KittyGraphicsCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
                                SeqType seq_type, Duration end_of_frame) {
-    if (dy < 0) {
-        MoveCursorDY(cell_height_for_pixels(dy));
+    if (SkipLateSend(seq_type, end_of_frame)) return;
+
+    // An animation is shown as one image in the terminal; following frames
+    // only send what changed relative to the previous one. These are not
+    // placed, so the cursor stays below the image.
+    // If the terminal keeps all frames, it loops the animation on its own
+    // once it repeats and we only keep the pace. Otherwise, the frame shown
+    // is edited in place.
+    const int64_t frame_bytes =
+        (int64_t)fb_orig.width() * fb_orig.height() * sizeof(rgba_t);
+    std::string postfix;  // Control commands sent after the frame.
+    char keys[64];        // Command keys for the frame, without the data.
+    bool place = true;
+    std::shared_ptr<const Framebuffer> previous;  // Set to send difference.
+    if (animation_.id) {
+        const bool continues = (seq_type == SeqType::AnimationFrame ||
+                                seq_type == SeqType::AnimationRepeat) &&
+                               fb_orig.width() == animation_.width &&
+                               fb_orig.height() == animation_.height;
+        if (continues && seq_type == SeqType::AnimationRepeat &&
+            animation_.keep_frames) {
+            OutBuffer buffer;
+            AppendPrefixToBuffer(&buffer);
+            if (!animation_.looping) {
+                // Infinite loops (v=1); the animation is stopped once we
+                // are done with it.
+                snprintf(keys, sizeof(keys), "a=a,i=%u,c=1,s=3,v=1",
+                         animation_.id);
+                const std::string start_loop = Command(keys);
+                buffer.Append(start_loop.data(), start_loop.size());
+                animation_.looping = true;
+            }
+            write_sequencer_->WriteBuffer(std::move(buffer), seq_type,
+                                          end_of_frame);
+            return;
+        }
+        if (continues && !animation_.looping) {
+            if (animation_.keep_frames &&
+                animation_.bytes + frame_bytes > kMaxTerminalAnimationBytes) {
+                // From now on, we edit the last frame.
+                animation_.keep_frames = false;
+            }
+            if (animation_.keep_frames) {
+                // New frame on top of the previous one.
+                ++animation_.frames;
+                animation_.bytes += frame_bytes;
+                snprintf(keys, sizeof(keys), "a=f,i=%u,c=%d,z=%d,X=1",
+                         animation_.id, animation_.frames - 1,
+                         FrameGapMillis(animation_.last_end, end_of_frame));
+                char show[64];
+                snprintf(show, sizeof(show), "a=a,i=%u,c=%d", animation_.id,
+                         animation_.frames);
+                postfix += Command(show);
+            }
+            else {
+                snprintf(keys, sizeof(keys), "a=f,i=%u,r=%d,X=1",
+                         animation_.id, animation_.frames);
+            }
+            animation_.last_end = end_of_frame;
+            previous            = animation_.previous;
+            place               = false;
+        }
+        else {
+            EndAnimation();
+        }
     }
-    MoveCursorDX(x / options_.cell_x_px);
 
-    // Create independent copy of frame buffer for use in thread.
-    Framebuffer *const fb = new Framebuffer(fb_orig);
-    char *const buffer    = RequestBuffer(fb->width(), fb->height());
-    char *const offset    = AppendPrefixToBuffer(buffer);
+    if (place) {
+        if (dy < 0) {
+            MoveCursorDY(cell_height_for_pixels(dy));
+        }
+        MoveCursorDX(x / options_.cell_x_px);
+    }
+
+    // An image shown before only needs to be placed again if the terminal
+    // still has it.
+    const bool reusable =
+        reuse_images_ && seq_type == SeqType::FrameImmediate;
+    const uint64_t content_hash = reusable ? ContentHash(fb_orig) : 0;
+    if (reusable) {
+        // The size is checked as well to make a hash collision less likely.
+        const auto found = transmitted_.find(content_hash);
+        if (found != transmitted_.end() &&
+            found->second.width == fb_orig.width() &&
+            found->second.height == fb_orig.height() &&
+            bytes_transmitted_ - found->second.transmitted_at <=
+                kMaxReuseDistanceBytes) {
+            OutBuffer buffer;
+            AppendPrefixToBuffer(&buffer);
+            snprintf(keys, sizeof(keys), "a=p,i=%u,p=%u", found->second.id,
+                     ++placement_id_);
+            const std::string placement = Command(keys);
+            buffer.Append(placement.data(), placement.size());
+            buffer.Append("\n");  // Cursor below the image, as if sent.
+            write_sequencer_->WriteBuffer(std::move(buffer), seq_type,
+                                          end_of_frame);
+            return;
+        }
+    }
+
+    // Handle for use in thread; shares the pixels with the original.
+    const Framebuffer *const fb = new Framebuffer(fb_orig);
+    OutBuffer *const buffer     = new OutBuffer();
+    AppendPrefixToBuffer(buffer);
 
     const auto &opts = options_;
 
     // Creating a new ID. Some terminals store the images in a GPU texture
     // buffer (looking at you, wezterm) and index by the ID, so we need to be
     // economical with IDs.
-    uint32_t id                  = 0;
-    static uint32_t animation_id = 0;
-    static uint8_t flip_buffer   = 0;
-    switch (seq_type) {
-    case SeqType::FrameImmediate:
-        // Ideally we use the content hash here. However, that means that
-        // if we have the same image in the same timg session, this would
-        // replace images. This could be addressed by remembering the ID
-        // and do a placement with the ID, however this is only really
-        // supported by Kitty directly while other compatible terminals can't
-        // deal with it yet reliably.
-        // So compromise: create unique ID for regular images.
-        id = CreateId();
-        break;
-    case SeqType::StartOfAnimation:
-        // Sending a bunch of images with different IDs overwhelms some
-        // terminals. So, for animations, just use two IDs back/forth.
-        id = CreateId();
-        CreateId();  // Also, reserve the next ID that we use in the flip-buffer
-        animation_id = id;
-        flip_buffer  = 0;
-        break;
-    case SeqType::AnimationFrame:
-        ++flip_buffer;
-        id = animation_id + (flip_buffer % 2);
-        break;
-    case SeqType::ControlWrite: {
-        // should not happen.
-    }
+    uint32_t id = 0;
+    if (place) {
+        switch (seq_type) {
+        case SeqType::FrameImmediate:
+            // Ideally we use the content hash here. However, that means that
+            // if we have the same image in the same timg session, this would
+            // replace images. Instead, we remember the ID and do a placement
+            // with the ID (see above), however this is only really supported
+            // by Kitty directly while other compatible terminals can't deal
+            // with it yet reliably; so only if the terminal was probed.
+            // So compromise: create unique ID for regular images.
+            id = CreateId();
+            if (reusable) {
+                transmitted_[content_hash] = {id, fb_orig.width(),
+                                              fb_orig.height(),
+                                              bytes_transmitted_};
+            }
+            break;
+        case SeqType::StartOfAnimation:
+        case SeqType::AnimationFrame:
+        case SeqType::AnimationRepeat:
+            if (terminal_animation_) {
+                // Also if an animation changes size midway: start over.
+                id                  = CreateId();
+                animation_.id       = id;
+                animation_.width    = fb->width();
+                animation_.height   = fb->height();
+                animation_.frames   = 1;
+                animation_.bytes    = frame_bytes;
+                animation_.last_end = end_of_frame;
+                animation_.keep_frames =
+                    frame_bytes <= kMaxTerminalAnimationBytes;
+                if (animation_.keep_frames) {
+                    snprintf(keys, sizeof(keys), "a=a,i=%u,r=1,z=%d", id,
+                             FrameGapMillis(Duration(), end_of_frame));
+                    postfix += Command(keys);
+                }
+                break;
+            }
+            if (seq_type == SeqType::StartOfAnimation) {
+                // Sending a bunch of images with different IDs overwhelms
+                // some terminals. So, for animations, just use two IDs
+                // back/forth.
+                id = CreateId();
+                CreateId();  // Also, reserve the next ID for the flip-buffer
+                animation_id_ = id;
+                flip_buffer_  = 0;
+                break;
+            }
+            ++flip_buffer_;
+            id = animation_id_ + (flip_buffer_ % 2);
+            break;
+        case SeqType::ControlWrite: {
+            // should not happen.
+        }
+        }
+        snprintf(keys, sizeof(keys), "a=T,i=%u", id);
     }
+    if (animation_.id) animation_.previous = std::make_shared<Framebuffer>(*fb);
+    bytes_transmitted_ += frame_bytes;
 
-    const int cols       = fb->width() / opts.cell_x_px;
-    const int rows       = -cell_height_for_pixels(-fb->height());
-    const int indent     = x / opts.cell_x_px;
-    const bool wrap_tmux = tmux_passthrough_needed_;
-    std::function<OutBuffer()> encode_fun = [opts, fb, id, buffer, offset, rows,
-                                             cols, indent, wrap_tmux]() {
+    const int cols                = fb->width() / opts.cell_x_px;
+    const int rows                = -cell_height_for_pixels(-fb->height());
+    const int indent              = x / opts.cell_x_px;
+    const bool wrap_tmux          = tmux_passthrough_needed_;
+    const std::string keys_prefix = keys;
+    const KittyTransmission transmission    = transmission_;
+    BufferedWriteSequencer *const sequencer = write_sequencer_;
+    ThreadPool *const pool                  = executor_;
+    std::function<OutBuffer()> encode_fun   = [opts, fb, previous, id,
+                                               keys_prefix, place, postfix,
+                                               buffer, rows, cols, indent,
+                                               wrap_tmux, transmission,
+                                               sequencer, pool]() {
+        TraceSpan span("encode", "kitty");
+        const Time encode_start;
         std::unique_ptr<const Framebuffer> auto_delete(fb);
-        const size_t png_buf_size = png::UpperBound(fb->width(), fb->height());
-        std::unique_ptr<char[]> png_buf(new char[png_buf_size]);
+        std::unique_ptr<OutBuffer> auto_delete_buffer(buffer);
+        // Pending frames are discarded once interrupted.
+        if (sequencer->cancellation().cancelled()) return OutBuffer();
 
-        int png_size = png::Encode(*fb, opts.compress_pixel_level,
-                                   opts.local_alpha_handling
-                                       ? png::ColorEncoding::kRGB_24
-                                       : png::ColorEncoding::kRGBA_32,
-                                   png_buf.get(), png_buf_size);
+        // Frames following in an animation only send the rectangle that
+        // changed. If nothing did, still a pixel as a frame is expected.
+        std::string command = keys_prefix;
+        std::unique_ptr<const Framebuffer> changed;
+        if (previous) {
+            int rect_x = 0, rect_y = 0, width = 1, height = 1;
+            FindChangedRect(*previous, *fb, &rect_x, &rect_y, &width, &height);
+            const rgba_t *const start = fb->row(rect_y) + rect_x;
+            changed.reset(new Framebuffer(width, height, (rgba_t *)start,
+                                          nullptr, fb->stride()[0]));
+            char offset[32];
+            snprintf(offset, sizeof(offset), ",x=%d,y=%d", rect_x, rect_y);
+            command += offset;
+        }
+        const Framebuffer *const pixels = changed ? changed.get() : fb;
+
+        // A terminal on the same host reads raw pixels from shared memory
+        // or a temporary file; then we only send its name. Otherwise, the
+        // pixels are sent inline.
+        std::string transfer_name;
+        if (transmission != KittyTransmission::kDirect) {
+            const size_t size =
+                pixels->width() * pixels->height() * sizeof(rgba_t);
+            transfer_name = CreateKittyTransfer(
+                transmission, size,
+                [pixels](char *out) { PackPixels(*pixels, true, out); });
+        }
+        char format[64];  // Keys describing the data.
+        std::unique_ptr<char[]> pixel_buf;
+        const char *data;
+        int data_size;
+        if (!transfer_name.empty()) {
+            // Not left behind if the terminal never gets to read it.
+            buffer->SetDiscardCallback([transmission, transfer_name]() {
+                RemoveKittyTransfer(transmission, transfer_name);
+            });
+            snprintf(format, sizeof(format), "f=32,s=%d,v=%d,t=%c",
+                     pixels->width(), pixels->height(),
+                     KittyTransmissionKey(transmission));
+            data      = transfer_name.data();
+            data_size = transfer_name.size();
+        }
+        else {
+            // Plain pixels, zlib-compressed if requested. Unlike a PNG, this
+            // needs neither a filter pass nor chunk checksums on our side.
+            const bool with_alpha     = !opts.local_alpha_handling;
+            const int bytes_per_pixel = with_alpha ? 4 : 3;
+            const bool compress       = opts.compress_pixel_level > 0;
+            const int pixel_count     = pixels->width() * pixels->height();
+            if (compress) {
+                const size_t buf_size =
+                    png::UpperBound(pixels->width(), pixels->height());
+                pixel_buf.reset(new char[buf_size]);
+                data_size = png::CompressPixels(
+                    *pixels, opts.compress_pixel_level,
+                    with_alpha ? png::ColorEncoding::kRGBA_32
+                               : png::ColorEncoding::kRGB_24,
+                    pixel_buf.get(), buf_size, pool);
+                data = pixel_buf.get();
+            }
+            else if (with_alpha && pixels->is_packed()) {
+                data_size = pixel_count * sizeof(rgba_t);
+                data      = (const char *)pixels->begin();
+            }
+            else {
+                data_size = pixel_count * bytes_per_pixel;
+                pixel_buf.reset(new char[data_size]);
+                PackPixels(*pixels, with_alpha, pixel_buf.get());
+                data = pixel_buf.get();
+            }
+            snprintf(format, sizeof(format), "f=%d,s=%d,v=%d%s",
+                     8 * bytes_per_pixel, pixels->width(), pixels->height(),
+                     compress ? ",o=z" : "");
+        }
 
-        char *pos = offset;  // Appending to the partially populated buffer.
+        // Appending to the partially populated buffer. Each section is
+        // written into space reserved for its maximum size.
+        char *const header_start = buffer->Reserve(256);
+        char *pos                = header_start;
 
         // Need to send an image with an id (i=...) as some terminals interpet
         // no id with id=0 and just keep replacing one picture.
@@ -195,61 +521,54 @@ void KittyGraphicsCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
         // read.
         if (wrap_tmux) pos += sprintf(pos, TMUX_START_PASSTHROUGH);
         pos = AppendEscaped(pos, '_', wrap_tmux);
-        pos +=
-            sprintf(pos, "Ga=T,i=%u,q=2,f=100,m=%d", id, png_size > kByteChunk);
-        if (wrap_tmux) {
+        pos += sprintf(pos, "G%s,q=2,%s,m=%d", command.c_str(), format,
+                       data_size > kByteChunk);
+        if (wrap_tmux && place) {
             pos += sprintf(pos, ",U=1,c=%d,r=%d", cols, rows);
         }
         *pos++ = ';';  // End of Kitty command
+        buffer->Commit(pos - header_start);
 
         // Write out binary data base64-encoded in chunks of limited size.
-        const char *png_data = png_buf.get();
-        while (png_size) {
-            const int chunk_bytes = std::min(png_size, kByteChunk);
-            pos = timg::EncodeBase64(png_data, chunk_bytes, pos);
-            png_data += chunk_bytes;
-            png_size -= chunk_bytes;
-            if (png_size) {  // More to come. Finish chunk and start next.
+        while (data_size) {
+            const int chunk_bytes = std::min(data_size, kByteChunk);
+            char *const chunk_start =
+                buffer->Reserve(kBase64EncodedChunkSize + 64);
+            pos = timg::EncodeBase64(data, chunk_bytes, chunk_start);
+            data += chunk_bytes;
+            data_size -= chunk_bytes;
+            if (data_size) {  // More to come. Finish chunk and start next.
                 pos = AppendEscaped(pos, '\\', wrap_tmux);  // finish
                 if (wrap_tmux) {
                     pos += sprintf(pos,
                                    TMUX_END_PASSTHROUGH TMUX_START_PASSTHROUGH);
                 }
                 pos = AppendEscaped(pos, '_', wrap_tmux);
-                pos += sprintf(pos, "Gq=2,m=%d;", png_size > kByteChunk);
+                pos += sprintf(pos, "Gq=2,m=%d;", data_size > kByteChunk);
             }
+            buffer->Commit(pos - chunk_start);
         }
-        pos = AppendEscaped(pos, '\\', wrap_tmux);
-
+        char *const end_start = buffer->Reserve(16);
+        pos                   = AppendEscaped(end_start, '\\', wrap_tmux);
         if (wrap_tmux) {
             pos += sprintf(pos, TMUX_END_PASSTHROUGH);
-            pos = AppendUnicodePicureTiles(pos, id, indent, rows, cols);
         }
-        else {
+        else if (place) {
             *pos++ = '\n';  // Need one final cursor movement.
         }
-        return OutBuffer(buffer, pos - buffer);
-    };
+        buffer->Commit(pos - end_start);
 
-    write_sequencer_->WriteBuffer(executor_->ExecAsync(encode_fun), seq_type,
-                                  end_of_frame);
-}
+        if (wrap_tmux && place) {
+            AppendUnicodePicureTiles(buffer, id, indent, rows, cols);
+        }
+        buffer->Append(postfix.data(), postfix.size());
+        sequencer->RecordEncodeTime(Time::Now() - encode_start);
+        return std::move(*buffer);
+    };
 
-char *KittyGraphicsCanvas::RequestBuffer(int width, int height) {
-    const size_t png_compressed_size = png::UpperBound(width, height);
-    const int encoded_base64_size    = png_compressed_size * 4 / 3;
-    const int cols                   = width / options_.cell_x_px;
-    const int rows                   = -cell_height_for_pixels(-height);
-
-    const size_t content_size =
-        strlen(SCREEN_CURSOR_UP_FORMAT) + strlen(SCREEN_CURSOR_RIGHT_FORMAT) +
-        encoded_base64_size  //
-        + strlen("\e_Ga=T,f=XX,s=9999,v=9999,m=1;\e\\") +
-        (encoded_base64_size / kBase64EncodedChunkSize) *
-            strlen("\e_Gm=0;\e\\") +
-        4 + 1 +            // digit space for cursor up/right; \n
-        rows * cols * 16;  // Some space for unicode tiles with diacritics.
-    return new char[content_size];
+    write_sequencer_->WriteBuffer(
+        executor_->ExecAsync(encode_fun, ThreadPool::Priority::kEncode),
+        seq_type, end_of_frame);
 }
 
 int KittyGraphicsCanvas::cell_height_for_pixels(int pixels) const {
@@ -16,9 +16,15 @@
 #ifndef KITTY_CANVAS_H
 #define KITTY_CANVAS_H
 
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
 #include "framebuffer.h"
+#include "term-query.h"
 #include "terminal-canvas.h"
 #include "thread-pool.h"
 #include "timg-time.h"
@@ -27,21 +33,93 @@ namespace timg {
 // Implements https://sw.kovidgoyal.net/kitty/graphics-protocol.html
 class KittyGraphicsCanvas final : public TerminalCanvas {
 public:
+    // The pixels are sent using the "transmission" medium. With
+    // KittyTransmission::kDirect, raw pixels are sent inline, zlib-compressed
+    // if DisplayOptions::compress_pixel_level is set. Otherwise only the
+    // name of the shared memory or file is sent; if that fails for a frame,
+    // it is sent directly.
+    //
+    // If "terminal_animation" is set, the terminal is known to support
+    // animations (see QueryKittyAnimation()). An animation is then shown as
+    // one image, to which each frame only sends the rectangle that changed.
+    // The terminal keeps the frames if they fit and loops them by itself
+    // once the animation repeats.
+    //
+    // If "reuse_images" is set, the terminal is known to place images again
+    // by their ID (see QueryKittyPlacement()). Images shown before in this
+    // session are then placed again instead of transmitting them again.
     KittyGraphicsCanvas(BufferedWriteSequencer *ws, ThreadPool *thread_pool,
                         bool tmux_passthrough_needed,
+                        KittyTransmission transmission,
+                        bool terminal_animation, bool reuse_images,
                         const DisplayOptions &opts);
+    ~KittyGraphicsCanvas() final;
 
     int cell_height_for_pixels(int pixels) const final;
 
     void Send(int x, int dy, const Framebuffer &framebuffer,
               SeqType sequence_type, Duration end_of_frame) override;
 
+    // Not needed once the terminal keeps all frames of the animation.
+    bool RepeatContentNeeded() const final {
+        return !animation_.id || !animation_.keep_frames;
+    }
+
 private:
+    // Kitty has a storage quota for all images (320MB by default) and evicts
+    // the oldest once exceeded, so animations kept in the terminal have to
+    // stay well below that.
+    static constexpr int64_t kMaxTerminalAnimationBytes = 32 << 20;
+
+    // For the same reason, only images transmitted less than this many bytes
+    // ago are expected to be still there to be placed again.
+    static constexpr int64_t kMaxReuseDistanceBytes = 128 << 20;
+
+    // Animation shown as one image in the terminal. The id is 0 if none.
+    struct TerminalAnimation {
+        uint32_t id   = 0;
+        int width     = 0;
+        int height    = 0;
+        int frames    = 0;         // Number of frames the terminal keeps.
+        int64_t bytes = 0;         // Uncompressed size of all frames.
+        Duration last_end;         // End of the last frame.
+        bool keep_frames = false;  // Otherwise, the last frame is edited.
+        bool looping     = false;  // Terminal loops it by itself.
+
+        // Last frame sent; the next one only sends what changed.
+        std::shared_ptr<const Framebuffer> previous;
+    };
+
+    // Image transmitted before, to be placed again if shown again.
+    struct TransmittedImage {
+        uint32_t id;
+        int width;
+        int height;
+        int64_t transmitted_at;  // bytes_transmitted_ before it was sent.
+    };
+
+    // Return a kitty graphics command with the given keys, without response.
+    std::string Command(const char *keys) const;
+
+    // Done with the current animation; stop the terminal looping it and
+    // show its last frame.
+    void EndAnimation();
+
     const DisplayOptions &options_;
     const bool tmux_passthrough_needed_;
+    const KittyTransmission transmission_;
+    const bool terminal_animation_;
+    const bool reuse_images_;
     ThreadPool *const executor_;
 
-    char *RequestBuffer(int width, int height);
+    TerminalAnimation animation_;
+    uint32_t animation_id_ = 0;  // Flip-buffer IDs of a regular animation.
+    uint8_t flip_buffer_   = 0;
+
+    // Still images sent in this session by content hash; only if reusing.
+    std::unordered_map<uint64_t, TransmittedImage> transmitted_;
+    int64_t bytes_transmitted_ = 0;  // Uncompressed size of all images sent.
+    uint32_t placement_id_     = 0;  // Last placement id of a reused image.
 };
 }  // namespace timg
 #endif  // KITTY_CANVAS_H
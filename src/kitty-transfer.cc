@@ -0,0 +1,107 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "kitty-transfer.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+
+#include "term-query.h"
+
+namespace timg {
+char KittyTransmissionKey(KittyTransmission medium) {
+    switch (medium) {
+    case KittyTransmission::kDirect: return 'd';
+    case KittyTransmission::kTempFile: return 't';
+    case KittyTransmission::kSharedMemory: return 's';
+    }
+    return 'd';  // Make compiler happy.
+}
+
+// Size "fd" to "size" bytes and fill it. Closes "fd".
+static bool FillFile(int fd, size_t size,
+                     const std::function<void(char *)> &fill) {
+    bool success = false;
+    if (ftruncate(fd, size) == 0) {
+        void *const mem =
+            mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem != MAP_FAILED) {
+            fill((char *)mem);
+            munmap(mem, size);
+            success = true;
+        }
+    }
+    close(fd);
+    return success;
+}
+
+static std::string CreateSharedMemory(size_t size,
+                                      const std::function<void(char *)> &fill) {
+    // Names are kept short; some systems only allow 31 characters.
+    static std::atomic<uint32_t> counter{0};
+    char name[32];
+    snprintf(name, sizeof(name), "/timg-%d-%u", (int)getpid(), ++counter);
+    const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return "";
+    if (!FillFile(fd, size, fill)) {
+        shm_unlink(name);
+        return "";
+    }
+    return name;
+}
+
+static std::string CreateTempFile(size_t size,
+                                  const std::function<void(char *)> &fill) {
+    // The terminal only reads temporary files from a temp directory that
+    // contain this marker in their name.
+    const char *tmpdir = getenv("TMPDIR");
+    if (!tmpdir || !*tmpdir) tmpdir = "/tmp";
+    std::string name = std::string(tmpdir) + "/tty-graphics-protocol-XXXXXX";
+    const int fd     = mkstemp(&name[0]);
+    if (fd < 0) return "";
+    if (!FillFile(fd, size, fill)) {
+        unlink(name.c_str());
+        return "";
+    }
+    return name;
+}
+
+std::string CreateKittyTransfer(KittyTransmission medium, size_t size,
+                                const std::function<void(char *)> &fill) {
+    switch (medium) {
+    case KittyTransmission::kSharedMemory:
+        return CreateSharedMemory(size, fill);
+    case KittyTransmission::kTempFile: return CreateTempFile(size, fill);
+    case KittyTransmission::kDirect: break;
+    }
+    return "";
+}
+
+void RemoveKittyTransfer(KittyTransmission medium, const std::string &name) {
+    switch (medium) {
+    case KittyTransmission::kSharedMemory: shm_unlink(name.c_str()); break;
+    case KittyTransmission::kTempFile: unlink(name.c_str()); break;
+    case KittyTransmission::kDirect: break;
+    }
+}
+}  // namespace timg
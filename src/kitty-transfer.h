@@ -0,0 +1,46 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_KITTY_TRANSFER_H
+#define TIMG_KITTY_TRANSFER_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+#include "term-query.h"
+
+namespace timg {
+// A kitty graphics terminal on the same host can read the pixels from a
+// shared memory object or temporary file, so that only its name needs to be
+// sent in the escape sequence.
+// https://sw.kovidgoyal.net/kitty/graphics-protocol/#the-transmission-medium
+//
+// The terminal removes the object or file once it has read it.
+
+// The value of the kitty "t=" key for the given medium.
+char KittyTransmissionKey(KittyTransmission medium);
+
+// Create a shared memory object or temporary file of "size" bytes, depending
+// on "medium", and call "fill" to write its content. Returns the name to be
+// sent to the terminal, or an empty string if that was not possible.
+std::string CreateKittyTransfer(KittyTransmission medium, size_t size,
+                                const std::function<void(char *)> &fill);
+
+// Remove what CreateKittyTransfer() created, if the terminal did not.
+void RemoveKittyTransfer(KittyTransmission medium, const std::string &name);
+}  // namespace timg
+
+#endif  // TIMG_KITTY_TRANSFER_H
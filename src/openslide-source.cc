@@ -18,6 +18,8 @@
 
 #include <openslide.h>
 
+#include <algorithm>
+#include <cmath>
 #include <csignal>
 #include <cstdint>
 #include <cstring>
@@ -30,6 +32,7 @@
 #include "framebuffer.h"
 #include "image-scaler.h"
 #include "renderer.h"
+#include "timg-cancel.h"
 #include "timg-time.h"
 
 namespace timg {
@@ -48,13 +51,17 @@ struct ScopeGuard {
     std::function<void()> f_;
 };
 
+// Rows of the chosen level read from the slide at once.
+static constexpr int64_t kReadStripRows = 512;
+
 static inline bool invalid_dimensions(int64_t width, int64_t height) {
     return (width < 0 || height < 0) ||
            (width > std::numeric_limits<int>::max() ||
             height > std::numeric_limits<int>::max());
 }
 
-bool OpenSlideSource::LoadAndScale(const DisplayOptions &opts, int, int) {
+bool OpenSlideSource::LoadAndScale(const DisplayOptions &opts, int, int,
+                                   const CancellationToken &cancel) {
     options_ = opts;
     if (opts.scroll_animation || filename() == "/dev/stdin" ||
         filename() == "-") {
@@ -116,10 +123,19 @@ bool OpenSlideSource::LoadAndScale(const DisplayOptions &opts, int, int) {
         openslide_get_level_dimensions(osr, level, &width, &height);
         if (invalid_dimensions(width, height)) return false;
 
+        // Read in strips, so that we can stop in between if cancelled.
+        // Region coordinates are given in the level 0 reference frame;
+        // rounded, so that the strips line up with the level's pixels.
+        const double downsample = openslide_get_level_downsample(osr, level);
         source_image.reset(new timg::Framebuffer(width, height));
-        openslide_read_region(osr, (uint32_t *)source_image->begin(), 0, 0,
-                              level, width, height);
-        if (openslide_get_error(osr)) return false;
+        for (int64_t y = 0; y < height; y += kReadStripRows) {
+            if (cancel.cancelled()) return false;
+            const int64_t rows = std::min(kReadStripRows, height - y);
+            openslide_read_region(
+                osr, (uint32_t *)(source_image->begin() + y * width), 0,
+                llround(y * downsample), level, width, rows);
+            if (openslide_get_error(osr)) return false;
+        }
     }
 
     // Further scaling to desired target width/height
@@ -128,6 +144,7 @@ bool OpenSlideSource::LoadAndScale(const DisplayOptions &opts, int, int) {
                             target_width, target_height);
     if (!scaler) return false;
     image_.reset(new timg::Framebuffer(target_width, target_height));
+    AccountMemory(image_->allocated_bytes());
     scaler->Scale(*source_image, image_.get());
     image_->AlphaComposeBackground(opts.bgcolor_getter, opts.bg_pattern_color,
                                    opts.pattern_size * options_.cell_x_px,
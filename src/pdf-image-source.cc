@@ -28,6 +28,7 @@
 #include "display-options.h"
 #include "framebuffer.h"
 #include "renderer.h"
+#include "timg-cancel.h"
 #include "timg-time.h"
 
 namespace fs = std::filesystem;
@@ -41,7 +42,8 @@ std::string PDFImageSource::FormatTitle(
 }
 
 bool PDFImageSource::LoadAndScale(const DisplayOptions &opts, int frame_offset,
-                                  int frame_count) {
+                                  int frame_count,
+                                  const CancellationToken &cancel) {
     options_ = opts;
 
     // Poppler wants a URI as input.
@@ -61,6 +63,12 @@ bool PDFImageSource::LoadAndScale(const DisplayOptions &opts, int frame_offset,
                           : std::min(page_count, start_page + frame_count);
     PopplerRectangle bounding_box;
     for (int page_num = start_page; page_num < max_display_page; ++page_num) {
+        // Poppler can't be interrupted while rendering, but at least we
+        // don't start on the next page.
+        if (cancel.cancelled()) {
+            success = false;
+            break;
+        }
         PopplerPage *const page = poppler_document_get_page(document, page_num);
         if (page == nullptr) {
             success = false;
@@ -86,14 +94,21 @@ bool PDFImageSource::LoadAndScale(const DisplayOptions &opts, int frame_offset,
         CalcScaleToFitDisplay(orig_width_, orig_height_, opts, false,
                               &render_width, &render_height);
 
-        const auto kCairoFormat = CAIRO_FORMAT_ARGB32;
-        int stride = cairo_format_stride_for_width(kCairoFormat, render_width);
-        auto image =
-            std::make_unique<timg::Framebuffer>(stride / 4, render_height);
-
-        cairo_surface_t *surface = cairo_image_surface_create_for_data(
-            (uint8_t *)image->begin(), kCairoFormat, render_width,
-            render_height, stride);
+        // Render into a surface allocated by cairo, which the framebuffer
+        // then adopts; it is destroyed with the framebuffer.
+        cairo_surface_t *const surface = cairo_image_surface_create(
+            CAIRO_FORMAT_ARGB32, render_width, render_height);
+        if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+            cairo_surface_destroy(surface);
+            g_object_unref(page);
+            success = false;
+            break;
+        }
+        auto image = std::make_unique<timg::Framebuffer>(
+            render_width, render_height,
+            (rgba_t *)cairo_image_surface_get_data(surface),
+            [surface](rgba_t *) { cairo_surface_destroy(surface); },
+            cairo_image_surface_get_stride(surface));
 
         cairo_t *cr = cairo_create(surface);
         cairo_scale(cr, 1.0 * render_width / orig_width_,
@@ -111,13 +126,16 @@ bool PDFImageSource::LoadAndScale(const DisplayOptions &opts, int frame_offset,
         g_object_unref(page);
 
         cairo_destroy(cr);
-        cairo_surface_destroy(surface);
+        cairo_surface_flush(surface);
 
         // Cairo stores A (high-byte), R, G, B (low-byte). We need ABGR.
+        // (Rows are always packed for 4 byte pixels, but if cairo ever pads
+        // them, iterating makes a packed copy first).
         for (rgba_t &pixel : *image) {
             std::swap(pixel.r, pixel.b);
         }
 
+        AccountMemory(image->allocated_bytes());
         pages_.emplace_back(std::move(image));
     }
     g_object_unref(document);
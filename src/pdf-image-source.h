@@ -34,7 +34,7 @@ public:
         : ImageSource(filename) {}
 
     bool LoadAndScale(const DisplayOptions &options, int frame_offset,
-                      int frame_count) final;
+                      int frame_count, const CancellationToken &cancel) final;
 
     void SendFrames(const Duration &duration, int loops,
                     const volatile sig_atomic_t &interrupt_received,
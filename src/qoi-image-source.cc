@@ -39,17 +39,16 @@ std::string QOIImageSource::FormatTitle(
                                 orig_height_, "qoi");
 }
 
-bool QOIImageSource::LoadAndScale(const DisplayOptions &opts, int, int) {
+bool QOIImageSource::LoadAndScale(const DisplayOptions &opts, int, int,
+                                  const CancellationToken &) {
     options_ = opts;
     qoi_desc desc;
     void *const qoi_pic = qoi_read(filename().c_str(), &desc, 4);
     if (!qoi_pic) return false;
 
-    // TODO: would be good if Framebuffer supported adopting foreign buffer.
-    timg::Framebuffer image_in(desc.width, desc.height);
-    memcpy((void *)image_in.begin(), qoi_pic,
-           (size_t)image_in.width() * image_in.height() * sizeof(rgba_t));
-    free(qoi_pic);
+    // Scale straight from the decoded pixels; freed with image_in.
+    timg::Framebuffer image_in(desc.width, desc.height, (rgba_t *)qoi_pic,
+                               [](rgba_t *pixels) { free(pixels); });
 
     orig_width_  = image_in.width();
     orig_height_ = image_in.height();
@@ -65,6 +64,7 @@ bool QOIImageSource::LoadAndScale(const DisplayOptions &opts, int, int) {
                                       target_width, target_height);
     if (!scaler) return false;
     image_.reset(new timg::Framebuffer(target_width, target_height));
+    AccountMemory(image_->allocated_bytes());
     scaler->Scale(image_in, image_.get());
 
     if (desc.channels == 4) {
@@ -52,10 +52,15 @@ public:
     WriteFramebufferFun render_cb(const std::string &title) final {
         // For single column mode, implementation is straightforward
         RenderTitle(title);
-        return [this](int x, int dy, const Framebuffer &fb, SeqType seq_type,
-                      const Duration &end_of_frame) {
-            canvas_->Send(x, dy, fb, seq_type, end_of_frame);
-        };
+        return WriteFramebufferFun(
+            [this](int x, int dy, const Framebuffer &fb, SeqType seq_type,
+                   const Duration &end_of_frame) {
+                canvas_->Send(x, dy, fb, seq_type, end_of_frame);
+            },
+            [this](const Duration &end_of_frame) {
+                return canvas_->SkipLateFrame(end_of_frame);
+            },
+            [this]() { return canvas_->RepeatContentNeeded(); });
     }
 
     void MaybeWaitBetweenImageSources() const final {
@@ -104,8 +109,9 @@ public:
         AdvanceColumn();
         PrepareTitle(title);
         first_render_call_ = true;
-        return [this](int x, int dy, const Framebuffer &fb, SeqType seq_type,
-                      const Duration &end_of_frame) {
+
+        auto write_fb = [this](int x, int dy, const Framebuffer &fb,
+                               SeqType seq_type, const Duration &end_of_frame) {
             int y_offset;
             if (first_render_call_) {
                 // Unless we're in the first column, we've to move up from last
@@ -145,6 +151,10 @@ public:
                 highest_fb_column_height_ = last_fb_height_;
             first_render_call_ = false;
         };
+        return WriteFramebufferFun(
+            write_fb,
+            [this](const Duration &end) { return canvas_->SkipLateFrame(end); },
+            [this]() { return canvas_->RepeatContentNeeded(); });
     }
 
     void MaybeWaitBetweenImageSources() const final {
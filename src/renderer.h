@@ -19,6 +19,7 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <utility>
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
@@ -35,9 +36,52 @@ public:
     // A function to write a framebuffer and its offset with timing.
     // This callback is handed over to each ImageSource::SendFrames to
     // emit their content.
-    using WriteFramebufferFun =
-        std::function<void(int x, int dy, const Framebuffer &fb,
-                           SeqType seq_type, Duration end_of_frame)>;
+    //
+    // It can also be asked if an animation frame would be too late to be
+    // shown, or if a repeated frame is needed at all, so that sources can
+    // save the work of preparing it.
+    class WriteFramebufferFun {
+    public:
+        using WriteFun =
+            std::function<void(int x, int dy, const Framebuffer &fb,
+                               SeqType seq_type, Duration end_of_frame)>;
+        using SkipFun = std::function<bool(const Duration &end_of_frame)>;
+        using RepeatFun = std::function<bool()>;
+
+        // The "skip" and "repeat_needed" functions are optional; without,
+        // frames are never late and repeated frames always needed.
+        explicit WriteFramebufferFun(WriteFun write, SkipFun skip = nullptr,
+                                     RepeatFun repeat_needed = nullptr)
+            : write_(std::move(write)),
+              skip_(std::move(skip)),
+              repeat_needed_(std::move(repeat_needed)) {}
+
+        void operator()(int x, int dy, const Framebuffer &fb, SeqType seq_type,
+                        Duration end_of_frame) const {
+            write_(x, dy, fb, seq_type, end_of_frame);
+        }
+
+        // Returns true if an AnimationFrame finishing at "end_of_frame" is
+        // too late to be shown. It is then counted as skipped and must not
+        // be sent. Only meaningful once the first frame of the animation is
+        // sent. Thread-safe.
+        bool SkipLateFrame(const Duration &end_of_frame) const {
+            return skip_ && skip_(end_of_frame);
+        }
+
+        // Returns false if the content of the next AnimationRepeat frame is
+        // not needed as the terminal repeats the animation by itself. Then,
+        // the frames only keep the pace; sending the last frame again is
+        // enough, only its size matters.
+        bool RepeatContentNeeded() const {
+            return !repeat_needed_ || repeat_needed_();
+        }
+
+    private:
+        WriteFun write_;
+        SkipFun skip_;
+        RepeatFun repeat_needed_;
+    };
 
     // Create a renderer that writes to the terminal canvas.
     // The single column vs. multi column are different implementations.
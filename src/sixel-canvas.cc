@@ -19,9 +19,13 @@
 
 #include <algorithm>
 #include <cassert>
+#include <climits>
+#include <cstdint>
 #include <cstring>
 #include <functional>
 #include <memory>
+#include <utility>
+#include <vector>
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
@@ -29,7 +33,10 @@
 #include "term-query.h"
 #include "terminal-canvas.h"
 #include "thread-pool.h"
+#include "timg-cancel.h"
+#include "timg-memory.h"
 #include "timg-time.h"
+#include "timg-trace.h"
 
 #define CSI "\033["
 
@@ -79,79 +86,255 @@ SixelCanvas::SixelCanvas(BufferedWriteSequencer *ws, ThreadPool *thread_pool,
     }
 }
 
-// Char needs to be non-const to be compatible sixel-callback.
-static int WriteToOutBuffer(char *data, int size, void *outbuf_param) {
-    OutBuffer *outbuffer = (OutBuffer *)outbuf_param;
-    // TODO realloc
-    memcpy(outbuffer->data + outbuffer->size, data, size);
-    outbuffer->size += size;
-    return size;
-}
-
 static inline int round_to_sixel(int pixels) {
     pixels += 5;
     return pixels - pixels % 6;
 }
 
-static void WriteStringToOutBuffer(const char *str, OutBuffer *outbuffer) {
-    WriteToOutBuffer(const_cast<char *>(str), strlen(str), outbuffer);
+// Bands of six pixel rows encoded in one piece of work.
+static constexpr int kBandsPerChunk = 8;
+
+// Start of the sixel image with raster attributes and the color palette,
+// the same way libsixel emits them.
+static void AppendSixelHeader(int width, int height, const uint8_t *palette,
+                              int ncolors, OutBuffer *out) {
+    out->Appendf("\033Pq\"1;1;%d;%d", width, height);
+    for (int c = 0; c < ncolors; ++c) {
+        const uint8_t *const rgb = palette + 3 * c;
+        out->Appendf("#%d;2;%d;%d;%d", c, (rgb[0] * 100 + 127) / 255,
+                     (rgb[1] * 100 + 127) / 255, (rgb[2] * 100 + 127) / 255);
+    }
+}
+
+// Append "count" sixels of the same value, run-length encoded if shorter.
+static char *AppendSixelRun(char *pos, uint8_t bits, int count) {
+    const char sixel = '?' + bits;
+    if (count >= 4) {
+        pos += sprintf(pos, "!%d", count);
+        *pos++ = sixel;
+        return pos;
+    }
+    while (count--) *pos++ = sixel;
+    return pos;
+}
+
+// Map the bands [first_band, last_band) of "fb" to the palette, with
+// Floyd-Steinberg dithering, and append their sixel data to "out".
+// Independent of other chunks of bands, so they can be encoded in parallel.
+static void EncodeSixelBands(const Framebuffer &fb, const uint8_t *palette,
+                             int ncolors, int first_band, int last_band,
+                             OutBuffer *out) {
+    const int width = fb.width();
+
+    // Nearest palette color, cached by color with 5 bits per channel.
+    std::vector<int16_t> nearest_cache(1 << 15, -1);
+    auto nearest_color = [&](int r, int g, int b) {
+        const int key   = (r >> 3) << 10 | (g >> 3) << 5 | b >> 3;
+        int16_t &cached = nearest_cache[key];
+        if (cached < 0) {
+            int best_distance = INT_MAX;
+            for (int c = 0; c < ncolors; ++c) {
+                const uint8_t *const rgb = palette + 3 * c;
+                const int distance       = (r - rgb[0]) * (r - rgb[0]) +
+                                           (g - rgb[1]) * (g - rgb[1]) +
+                                           (b - rgb[2]) * (b - rgb[2]);
+                if (distance < best_distance) {
+                    best_distance = distance;
+                    cached        = c;
+                }
+            }
+        }
+        return cached;
+    };
+
+    // Quantization error in 1/16 units, to be distributed to the current and
+    // next row. One extra pixel on each side to not have to special-case.
+    std::vector<int> error_current(3 * (width + 2));
+    std::vector<int> error_next(3 * (width + 2));
+    std::vector<uint8_t> indices(6 * width);  // Palette index of band pixels.
+
+    // Sixel bits of each color used in the band; slots allocated on use.
+    std::vector<int> slot_of_color(ncolors, -1);
+    std::vector<int> used_colors;
+    std::vector<uint8_t> sixels;
+
+    for (int band = first_band; band < last_band; ++band) {
+        for (int row = 0; row < 6; ++row) {
+            const rgba_t *pixel      = fb.row(band * 6 + row);
+            uint8_t *const index_row = &indices[row * width];
+            int *const err           = error_current.data() + 3;
+            int *const err_next      = error_next.data() + 3;
+            for (int x = 0; x < width; ++x, ++pixel) {
+                const int value[3] = {
+                    std::clamp(pixel->r + err[3 * x + 0] / 16, 0, 255),
+                    std::clamp(pixel->g + err[3 * x + 1] / 16, 0, 255),
+                    std::clamp(pixel->b + err[3 * x + 2] / 16, 0, 255),
+                };
+                const int c  = nearest_color(value[0], value[1], value[2]);
+                index_row[x] = c;
+                for (int ch = 0; ch < 3; ++ch) {
+                    const int e = value[ch] - palette[3 * c + ch];
+                    err[3 * (x + 1) + ch] += 7 * e;
+                    err_next[3 * (x - 1) + ch] += 3 * e;
+                    err_next[3 * x + ch] += 5 * e;
+                    err_next[3 * (x + 1) + ch] += e;
+                }
+            }
+            error_current.swap(error_next);
+            std::fill(error_next.begin(), error_next.end(), 0);
+        }
+
+        used_colors.clear();
+        for (int row = 0; row < 6; ++row) {
+            const uint8_t *const index_row = &indices[row * width];
+            for (int x = 0; x < width; ++x) {
+                const int c = index_row[x];
+                if (slot_of_color[c] < 0) {
+                    slot_of_color[c] = used_colors.size();
+                    used_colors.push_back(c);
+                    sixels.resize(std::max(sixels.size(),
+                                           used_colors.size() * width));
+                    std::fill_n(&sixels[slot_of_color[c] * width], width, 0);
+                }
+                sixels[slot_of_color[c] * width + x] |= 1 << row;
+            }
+        }
+
+        // Each color drawn over the band; carriage return '$' in between,
+        // next band after '-'.
+        if (band > first_band) out->Append("-", 1);
+        for (size_t i = 0; i < used_colors.size(); ++i) {
+            const int c               = used_colors[i];
+            const uint8_t *const bits = &sixels[slot_of_color[c] * width];
+            slot_of_color[c]          = -1;
+            int end                   = width;
+            while (end > 0 && bits[end - 1] == 0) --end;  // Nothing to draw.
+
+            char *const start = out->Reserve(width + 16);
+            char *pos         = start;
+            if (i > 0) *pos++ = '$';
+            pos += sprintf(pos, "#%d", c);
+            int run = 0;
+            for (int x = 0; x < end; ++x) {
+                if (x > 0 && bits[x] != bits[x - 1]) {
+                    pos = AppendSixelRun(pos, bits[x - 1], run);
+                    run = 0;
+                }
+                ++run;
+            }
+            if (run) pos = AppendSixelRun(pos, bits[end - 1], run);
+            out->Commit(pos - start);
+        }
+    }
 }
 
 void SixelCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
                        SeqType seq_type, Duration end_of_frame) {
+    if (SkipLateSend(seq_type, end_of_frame)) return;
+
     if (dy < 0) {
         MoveCursorDY(cell_height_for_pixels(dy));
     }
     MoveCursorDX(x / options_.cell_x_px);
 
-    // Create copy to be used in threads.
-
-    // Round height to next possible sixel cut-off treat the remaining strip
-    // at the bottom as transparent.
-    Framebuffer *const fb =
-        new Framebuffer(fb_orig.width(), round_to_sixel(fb_orig.height()));
-    // First, make it transparent with whatever choosen (ideally, we only
-    // do the last couple of rows)
-    fb->AlphaComposeBackground(
-        options_.bgcolor_getter, options_.bg_pattern_color,
-        options_.pattern_size * options_.cell_x_px,
-        options_.pattern_size * options_.cell_y_px / 2, fb_orig.height());
-    // .. overwrite with whatever is in the orig.
-    std::copy(fb_orig.begin(), fb_orig.end(), fb->begin());
-
-    // TODO: this should be realloced as needed.
-    char *const buffer = new char[1024 + fb->width() * fb->height() * 5];
-    char *const offset = AppendPrefixToBuffer(buffer);
+    // Handle to be used in threads. Shares the pixels with the original if
+    // it is already a multiple of the sixel height.
+    const Framebuffer *fb;
+    size_t padded_copy_bytes = 0;
+    if (fb_orig.height() == round_to_sixel(fb_orig.height()) &&
+        fb_orig.is_packed()) {
+        fb = new Framebuffer(fb_orig);
+    }
+    else {
+        // Round height to next possible sixel cut-off treat the remaining
+        // strip at the bottom as transparent.
+        Framebuffer *const padded =
+            new Framebuffer(fb_orig.width(), round_to_sixel(fb_orig.height()));
+        // First, make it transparent with whatever choosen (ideally, we only
+        // do the last couple of rows)
+        padded->AlphaComposeBackground(
+            options_.bgcolor_getter, options_.bg_pattern_color,
+            options_.pattern_size * options_.cell_x_px,
+            options_.pattern_size * options_.cell_y_px / 2, fb_orig.height());
+        // .. overwrite with whatever is in the orig.
+        for (int y = 0; y < fb_orig.height(); ++y) {
+            memcpy(padded->begin() + y * padded->width(), fb_orig.row(y),
+                   sizeof(rgba_t) * fb_orig.width());
+        }
+        padded_copy_bytes = padded->allocated_bytes();
+        MemoryAccount::FramebufferCopies()->Add(padded_copy_bytes);
+        fb = padded;
+    }
+
+    OutBuffer *const buffer = new OutBuffer();
+    AppendPrefixToBuffer(buffer);
     // avoid capture whole 'this', so copy values locally
     const char *const cursor_handling_start = cursor_move_before_;
     const char *const cursor_handling_end   = cursor_move_after_;
+    BufferedWriteSequencer *const sequencer = write_sequencer_;
+    ThreadPool *const pool                  = executor_;
     const std::function<OutBuffer()> encode_fun =
-        [fb, buffer, offset, cursor_handling_start, cursor_handling_end]() {
+        [fb, padded_copy_bytes, buffer, cursor_handling_start,
+         cursor_handling_end, sequencer, pool]() {
+            TraceSpan span("encode", "sixel");
+            const Time encode_start;
             std::unique_ptr<const Framebuffer> auto_delete(fb);
 
-            OutBuffer out(buffer, offset - buffer);
-            WriteStringToOutBuffer(cursor_handling_start, &out);
-            sixel_output_t *sixel_out = nullptr;
-            sixel_output_new(&sixel_out, WriteToOutBuffer, &out, nullptr);
+            OutBuffer out(std::move(*buffer));
+            delete buffer;
+            // Pending frames are discarded once interrupted.
+            const CancellationToken &cancel = sequencer->cancellation();
+            if (cancel.cancelled()) {
+                MemoryAccount::FramebufferCopies()->Add(
+                    -(int64_t)padded_copy_bytes);
+                return OutBuffer();
+            }
+            out.Append(cursor_handling_start);
 
+            // One palette for the whole image, so that bands can be encoded
+            // independently.
             sixel_dither_t *sixel_dither = nullptr;
             sixel_dither_new(&sixel_dither, 256, nullptr);
             sixel_dither_initialize(
                 sixel_dither, (unsigned char *)fb->begin(), fb->width(),
                 fb->height(), SIXEL_PIXELFORMAT_RGBA8888, SIXEL_LARGE_LUM,
                 SIXEL_REP_AVERAGE_COLORS, SIXEL_QUALITY_AUTO);
+            const uint8_t *const palette =
+                sixel_dither_get_palette(sixel_dither);
+            const int ncolors =
+                sixel_dither_get_num_of_palette_colors(sixel_dither);
+            AppendSixelHeader(fb->width(), fb->height(), palette, ncolors,
+                              &out);
 
-            sixel_encode((unsigned char *)fb->begin(), fb->width(),
-                         fb->height(), 0, sixel_dither, sixel_out);
-
+            const int bands = fb->height() / 6;
+            std::vector<OutBuffer> chunks(
+                (bands + kBandsPerChunk - 1) / kBandsPerChunk);
+            pool->ParallelFor(0, bands, kBandsPerChunk,
+                              [&](int first, int last) {
+                                  if (cancel.cancelled()) return;
+                                  EncodeSixelBands(
+                                      *fb, palette, ncolors, first, last,
+                                      &chunks[first / kBandsPerChunk]);
+                              });
             sixel_dither_destroy(sixel_dither);
-            sixel_output_destroy(sixel_out);
 
-            WriteStringToOutBuffer(cursor_handling_end, &out);
+            for (size_t i = 0; i < chunks.size(); ++i) {
+                if (i > 0) out.Append("-", 1);
+                for (const auto &segment : chunks[i].segments()) {
+                    out.Append(segment.data, segment.size);
+                }
+            }
+            out.Append("\033\\", 2);  // String terminator.
+
+            out.Append(cursor_handling_end);
+            sequencer->RecordEncodeTime(Time::Now() - encode_start);
+            MemoryAccount::FramebufferCopies()->Add(
+                -(int64_t)padded_copy_bytes);
             return out;
         };
-    write_sequencer_->WriteBuffer(executor_->ExecAsync(encode_fun), seq_type,
-                                  end_of_frame);
+    write_sequencer_->WriteBuffer(
+        executor_->ExecAsync(encode_fun, ThreadPool::Priority::kEncode),
+        seq_type, end_of_frame);
 }
 
 int SixelCanvas::cell_height_for_pixels(int pixels) const {
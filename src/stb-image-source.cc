@@ -27,11 +27,13 @@
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
+#include "frame-store.h"
 #include "framebuffer.h"
 #include "image-scaler.h"
 #include "image-source.h"
 #include "renderer.h"
 #include "stb/stb_image.h"
+#include "timg-cancel.h"
 #include "timg-time.h"
 
 // TODO: preprocessed frame and SendFrames() are similar to
@@ -45,9 +47,10 @@ public:
                       size_t source_h, size_t target_w, size_t target_h,
                       const Duration &delay, const DisplayOptions &opt)
         : delay_(delay), framebuffer_(target_w, target_h) {
-        const size_t len = source_w * source_h * 4;
-        Framebuffer source_img(source_w, source_h);  // TODO: avoid copy.
-        std::copy(image_data, image_data + len, (uint8_t *)source_img.begin());
+        // Scale straight from the decoder output, which we don't own.
+        Framebuffer source_img(source_w, source_h,
+                               (rgba_t *)const_cast<uint8_t *>(image_data),
+                               nullptr);
         auto scaler = ImageScaler::Create(source_w, source_h,
                                           ImageScaler::ColorFmt::kRGBA,
                                           target_w, target_h);
@@ -67,12 +70,61 @@ private:
     timg::Framebuffer framebuffer_;
 };
 
+// Decodes the frames of a GIF one at a time, from "data" if not empty,
+// otherwise from the file. Uses the internal stb API like LoadAndScale().
+// The stbi__context points to a buffer inside itself, so it must not be
+// moved once opened.
+class STBImageSource::GIFDecoder {
+public:
+    GIFDecoder(const std::string &filename, const std::string &data) {
+        memset(&context_, 0, sizeof(context_));
+        memset(&gif_, 0, sizeof(gif_));
+        if (!data.empty()) {
+            stbi__start_mem(&context_, (const uint8_t *)data.data(),
+                            data.size());
+            opened_ = true;
+        }
+        else if ((file_ = stbi__fopen(filename.c_str(), "rb"))) {
+            stbi__start_file(&context_, file_);
+            opened_ = true;
+        }
+    }
+    GIFDecoder(const GIFDecoder &) = delete;
+    ~GIFDecoder() {
+        STBI_FREE(gif_.out);
+        STBI_FREE(gif_.history);
+        STBI_FREE(gif_.background);
+        if (file_) fclose(file_);
+    }
+
+    // Decode the next frame. Returns false at the end or on error.
+    bool Next() {
+        if (!opened_) return false;
+        int channels;
+        const uint8_t *const data = stbi__gif_load_next(
+            &context_, &gif_, &channels, kDesiredChannels, nullptr);
+        if (!data || data == (const uint8_t *)&context_) return false;
+        ++frames_read_;
+        return true;
+    }
+
+    int width() const { return gif_.w; }
+    int height() const { return gif_.h; }
+    const uint8_t *canvas() const { return gif_.out; }
+    int frames_read() const { return frames_read_; }
+
+private:
+    FILE *file_  = nullptr;
+    bool opened_ = false;
+    stbi__context context_;
+    stbi__gif gif_;
+    int frames_read_ = 0;
+};
+
 STBImageSource::STBImageSource(const std::string &filename)
     : ImageSource(filename) {}
 
-STBImageSource::~STBImageSource() {
-    for (PreprocessedFrame *f : frames_) delete f;
-}
+STBImageSource::~STBImageSource() = default;
 
 std::string STBImageSource::FormatTitle(
     const std::string &format_string) const {
@@ -84,13 +136,16 @@ std::string STBImageSource::FormatTitle(
 // dependent on the implemantation used; but since we ship it in third_party/,
 // this is not an issue.
 bool STBImageSource::LoadAndScale(const DisplayOptions &options,
-                                  int frame_offset, int frame_count) {
+                                  int frame_offset, int frame_count,
+                                  const CancellationToken &cancel) {
 #ifdef WITH_TIMG_VIDEO
     if (LooksLikeAPNG(filename())) {
         return false;  // STB can't apng animate. Let Video do it.
     }
 #endif
 
+    options_ = options;
+    frames_.reset(new FrameStore(options.frame_memory_budget));
     stbi__context context;
 
     FILE *img_file = nullptr;
@@ -100,9 +155,11 @@ bool STBImageSource::LoadAndScale(const DisplayOptions &options,
         // For stdin, we need to fill a buffer, as stb needs seek functionality.
         char buffer[4096];
         ssize_t r;
-        while ((r = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) {
+        while (!cancel.cancelled() &&
+               (r = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) {
             mem_buffer.append(buffer, r);
         }
+        if (cancel.cancelled()) return false;
         stbi__start_mem(&context, (const uint8_t *)mem_buffer.data(),
                         mem_buffer.size());
     }
@@ -124,14 +181,28 @@ bool STBImageSource::LoadAndScale(const DisplayOptions &options,
         while ((data = stbi__gif_load_next(&context, &gdata, &channels,
                                            kDesiredChannels, nullptr))) {
             if (data == (const uint8_t *)&context) break;
+            if (cancel.cancelled()) break;
             orig_width_  = gdata.w;
             orig_height_ = gdata.h;
 
             CalcScaleToFitDisplay(gdata.w, gdata.h, options, false,
                                   &target_width, &target_height);
-            frames_.push_back(new PreprocessedFrame(
-                data, gdata.w, gdata.h, target_width, target_height,
-                Duration::Millis(gdata.delay), options));
+            const Duration delay = Duration::Millis(gdata.delay);
+            if (!unstored_delays_.empty()) {
+                // Store is full; decoded again in each loop while shown.
+                unstored_delays_.push_back(delay);
+                continue;
+            }
+            const PreprocessedFrame frame(data, gdata.w, gdata.h,
+                                          target_width, target_height, delay,
+                                          options);
+            if (!frames_->Append(frame.framebuffer(), frame.delay())) {
+                ReportError(filename() + ": --frame-memory exceeded after " +
+                            std::to_string(frames_->size()) +
+                            " frames; decoding the following frames in each "
+                            "loop.");
+                unstored_delays_.push_back(delay);
+            }
         }
         STBI_FREE(gdata.out);
         STBI_FREE(gdata.history);
@@ -152,29 +223,56 @@ bool STBImageSource::LoadAndScale(const DisplayOptions &options,
 
         CalcScaleToFitDisplay(w, h, options, false, &target_width,
                               &target_height);
-        frames_.push_back(new PreprocessedFrame(
-            data, w, h, target_width, target_height, Duration(), options));
+        const PreprocessedFrame frame(data, w, h, target_width, target_height,
+                                      Duration(), options);
+        frames_->Append(frame.framebuffer(), frame.delay());
         stbi_image_free(data);
     }
+    AccountMemory(frames_->stored_bytes());
+    target_width_  = target_width;
+    target_height_ = target_height;
+    if (!unstored_delays_.empty()) {
+        stdin_data_ = std::move(mem_buffer);  // Needed to decode again.
+    }
 
     indentation_ =
         options.center_horizontally ? (options.width - target_width) / 2 : 0;
 
-    max_frames_ = (frame_count < 0)
-                      ? (int)frames_.size()
-                      : std::min(frame_count, (int)frames_.size());
+    const int total_frames = frames_->size() + (int)unstored_delays_.size();
+    max_frames_            = (frame_count < 0)
+                                 ? total_frames
+                                 : std::min(frame_count, total_frames);
 
     if (img_file) fclose(img_file);
 
-    return !frames_.empty();
+    return !frames_->empty() && !cancel.cancelled();
+}
+
+bool STBImageSource::DecodeUnstoredFrame(int index) {
+    // Frames are composited on top of each other: start over if needed.
+    if (!decoder_ || decoder_->frames_read() - 1 > index) {
+        decoder_.reset(new GIFDecoder(filename(), stdin_data_));
+    }
+    while (decoder_->frames_read() - 1 < index) {
+        if (!decoder_->Next()) {
+            decoder_.reset();
+            return false;
+        }
+    }
+    const PreprocessedFrame frame(decoder_->canvas(), decoder_->width(),
+                                  decoder_->height(), target_width_,
+                                  target_height_, Duration(), options_);
+    unstored_frame_.reset(new Framebuffer(frame.framebuffer()));
+    return true;
 }
 
 void STBImageSource::SendFrames(const Duration &duration, int loops,
                                 const volatile sig_atomic_t &interrupt_received,
                                 const Renderer::WriteFramebufferFun &sink) {
     int last_height         = -1;  // First image emit will not have a height.
-    const bool is_animation = frames_.size() > 1;
-    if (frames_.size() == 1 || !is_animation) {
+    const bool is_animation =
+        frames_->size() + (int)unstored_delays_.size() > 1;
+    if (!is_animation) {
         loops = 1;  // If there is no animation, nothing to repeat.
     }
     // Not initialized or negative value wants us to loop forever.
@@ -182,24 +280,39 @@ void STBImageSource::SendFrames(const Duration &duration, int loops,
     const bool loop_forever =
         (loops < 0) || (loops == timg::kNotInitialized);  // NOLINT
 
+    FrameStore::Player player(*frames_);
     timg::Duration time_from_first_frame;
-    bool is_first = true;
+    bool is_first                 = true;
+    const Framebuffer *last_frame = nullptr;
     for (int k = 0; (loop_forever || k < loops) && !interrupt_received &&
                     time_from_first_frame < duration;
          ++k) {
         for (int f = 0; f < max_frames_ && !interrupt_received; ++f) {
-            const auto &frame = frames_[f];
-            time_from_first_frame.Add(frame->delay());
+            // If the terminal repeats the animation by itself, we only keep
+            // the pace and send the last frame again instead.
+            const bool pace_only =
+                k > 0 && last_frame && !sink.RepeatContentNeeded();
+            // Frames that did not fit into the store are decoded again.
+            const bool stored = f < frames_->size();
+            if (!stored && !pace_only && !DecodeUnstoredFrame(f)) break;
+            const Framebuffer &frame = pace_only ? *last_frame
+                                       : stored  ? player.Get(f)
+                                                 : *unstored_frame_;
+            time_from_first_frame.Add(
+                stored ? frames_->delay(f)
+                       : unstored_delays_[f - frames_->size()]);
             const int dx = indentation_;
             const int dy = is_animation && last_height > 0 ? -last_height : 0;
             SeqType seq_type = SeqType::FrameImmediate;
             if (is_animation) {
-                seq_type = is_first ? SeqType::StartOfAnimation
-                                    : SeqType::AnimationFrame;
+                seq_type =
+                    k > 0 ? SeqType::AnimationRepeat : SeqType::AnimationFrame;
+                if (is_first) seq_type = SeqType::StartOfAnimation;
             }
-            sink(dx, dy, frame->framebuffer(), seq_type,
+            sink(dx, dy, frame, seq_type,
                  std::min(time_from_first_frame, duration));
-            last_height = frame->framebuffer().height();
+            last_height = frame.height();
+            last_frame  = &frame;
             if (time_from_first_frame > duration) break;
             is_first = false;
         }
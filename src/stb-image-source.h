@@ -17,10 +17,12 @@
 #define TIMG_STB_IMAGE_SOURCE_H
 
 #include <csignal>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "display-options.h"
+#include "frame-store.h"
 #include "image-source.h"
 #include "renderer.h"
 #include "timg-time.h"
@@ -35,7 +37,7 @@ public:
     // Attempt to load given filename as video, open stream and set-up scaling.
     // Returns true on success.
     bool LoadAndScale(const DisplayOptions &options, int frame_offset,
-                      int frame_count) final;
+                      int frame_count, const CancellationToken &cancel) final;
 
     // Play video up to given duration.
     //
@@ -49,10 +51,26 @@ public:
 
 private:
     class PreprocessedFrame;
-    std::vector<PreprocessedFrame *> frames_;
+    class GIFDecoder;
+
+    // Decode frame "index" after the ones stored into unstored_frame_.
+    // Returns false if there is no such frame.
+    bool DecodeUnstoredFrame(int index);
+
+    DisplayOptions options_;
+    std::unique_ptr<FrameStore> frames_;
     int orig_width_, orig_height_;
-    int max_frames_  = 1;
-    int indentation_ = 0;
+    int target_width_  = 0;
+    int target_height_ = 0;
+    int max_frames_    = 1;
+    int indentation_   = 0;
+
+    // Frames of a GIF after the store was full are decoded again in each
+    // loop; only their delays are kept. Stdin is kept to read it again.
+    std::vector<Duration> unstored_delays_;
+    std::string stdin_data_;
+    std::unique_ptr<GIFDecoder> decoder_;
+    std::unique_ptr<Framebuffer> unstored_frame_;
 };
 }  // namespace timg
 
@@ -53,7 +53,8 @@ std::string SVGImageSource::FormatTitle(
                                 (int)orig_height_, "svg");
 }
 
-bool SVGImageSource::LoadAndScale(const DisplayOptions &opts, int, int) {
+bool SVGImageSource::LoadAndScale(const DisplayOptions &opts, int, int,
+                                  const CancellationToken &) {
     options_        = opts;
     RsvgHandle *svg = rsvg_handle_new_from_file(filename_.c_str(), nullptr);
     if (!svg) return false;
@@ -86,13 +87,21 @@ bool SVGImageSource::LoadAndScale(const DisplayOptions &opts, int, int) {
     CalcScaleToFitDisplay(orig_width_, orig_height_, opts, false, &target_width,
                           &target_height);
 
-    const auto kCairoFormat = CAIRO_FORMAT_ARGB32;
-    int stride = cairo_format_stride_for_width(kCairoFormat, target_width);
-    image_.reset(new timg::Framebuffer(stride / 4, target_height));
+    // Render into a surface allocated by cairo, which the framebuffer then
+    // adopts; it is destroyed with the framebuffer.
+    cairo_surface_t *const surface = cairo_image_surface_create(
+        CAIRO_FORMAT_ARGB32, target_width, target_height);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        g_object_unref(svg);
+        return false;
+    }
+    image_.reset(new timg::Framebuffer(
+        target_width, target_height,
+        (rgba_t *)cairo_image_surface_get_data(surface),
+        [surface](rgba_t *) { cairo_surface_destroy(surface); },
+        cairo_image_surface_get_stride(surface)));
 
-    cairo_surface_t *surface = cairo_image_surface_create_for_data(
-        (uint8_t *)image_->begin(), kCairoFormat, target_width, target_height,
-        stride);
     cairo_t *cr = cairo_create(surface);
     cairo_scale(cr, 1.0 * target_width / orig_width_,
                 1.0 * target_height / orig_height_);
@@ -117,16 +126,16 @@ bool SVGImageSource::LoadAndScale(const DisplayOptions &opts, int, int) {
 #endif
 
     cairo_destroy(cr);
-    cairo_surface_destroy(surface);
+    cairo_surface_flush(surface);
     g_object_unref(svg);
 
     // Cairo stores A (high-byte), R, G, B (low-byte). We need ABGR.
+    // (Rows are always packed for 4 byte pixels, but if cairo ever pads them,
+    // iterating makes a packed copy first).
     for (rgba_t &pixel : *image_) {
         std::swap(pixel.r, pixel.b);
     }
-
-    // TODO: if there ever could be the condition of
-    // int(stride / sizeof(rgba_t)) != render_width (for alignment?) : copy over
+    AccountMemory(image_->allocated_bytes());
 
     // If requested, merge background with pattern.
     image_->AlphaComposeBackground(
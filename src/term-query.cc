@@ -28,7 +28,10 @@
 #include <cstdlib>
 #include <ctime>
 #include <functional>
+#include <string>
 
+#include "kitty-transfer.h"
+#include "timg-base64.h"
 #include "timg-time.h"
 #include "utils.h"
 
@@ -160,6 +163,19 @@ static const char *find_str(const char *haystack, int64_t len, const char *s) {
     return (const char *)memmem(haystack, len, s, strlen(s));
 }
 
+// Parse a "major.minor" version at "pos" before "end" and return if it is
+// at least the given one.
+static bool VersionAtLeast(const char *pos, const char *end, int major,
+                           int minor) {
+    int parsed[2] = {0, 0};
+    for (int &number : parsed) {
+        if (pos >= end || !isdigit(*pos)) return false;
+        while (pos < end && isdigit(*pos)) number = 10 * number + *pos++ - '0';
+        if (pos < end && *pos == '.') ++pos;
+    }
+    return parsed[0] > major || (parsed[0] == major && parsed[1] >= minor);
+}
+
 // Read background color queried from terminal emulator.
 // Might leak a file-descriptor when bailing out early. Accepted for brevity.
 const char *QueryBackgroundColor() {
@@ -283,6 +299,11 @@ TermGraphicsInfo QuerySupportedGraphicsProtocol() {
                           find_str(data, len, "Konsole 2")) {
                           result.preferred_graphics = GraphicsProtocol::kIterm2;
                       }
+                      // Multipart file transfer since iTerm2 3.5
+                      if (const char *v = find_str(data, len, "iTerm2 ")) {
+                          result.iterm2_multipart =
+                              VersionAtLeast(v + 7, data + len, 3, 5);
+                      }
                       if (find_str(data, len, "WezTerm")) {
                           result.preferred_graphics = GraphicsProtocol::kIterm2;
                           result.sixel.known_broken_cursor_placement = true;
@@ -344,6 +365,96 @@ TermGraphicsInfo QuerySupportedGraphicsProtocol() {
     return result;
 }
 
+KittyTransmission QueryKittyTransmission() {
+    const Duration kTimeBudget = Duration::Millis(250);
+    char buffer[512];
+
+    // Offer a single pixel in each medium with a query action (a=q), which
+    // the terminal answers with OK if it could load it. As with the other
+    // queries, a DSR 5 follows to not wait for terminals that don't answer.
+    static constexpr uint32_t kQueryId = 0x7139;  // Arbitrary.
+    for (const KittyTransmission medium :
+         {KittyTransmission::kSharedMemory, KittyTransmission::kTempFile}) {
+        const std::string name = CreateKittyTransfer(
+            medium, 4, [](char *pixel) { memset(pixel, 0xff, 4); });
+        if (name.empty()) continue;
+
+        char encoded_name[256];
+        if (name.size() > sizeof(encoded_name) / 4 * 3 - 3) continue;
+        *EncodeBase64(name.data(), name.size(), encoded_name) = '\0';
+        char query[512];
+        snprintf(query, sizeof(query),
+                 "\033_Gi=%u,s=1,v=1,a=q,t=%c,f=32;%s\033\\" TERM_CSI "5n",
+                 kQueryId, KittyTransmissionKey(medium), encoded_name);
+
+        bool success = false;
+        char expected_ok[32];
+        snprintf(expected_ok, sizeof(expected_ok), "\033_Gi=%u;OK", kQueryId);
+        QueryTerminal(query, buffer, sizeof(buffer), kTimeBudget,
+                      [&](const char *data, size_t len) {
+                          success = find_str(data, len, expected_ok);
+                          return find_str(data, len, TERM_CSI "0");
+                      });
+        // The terminal only removes it if it could read it.
+        RemoveKittyTransfer(medium, name);
+        if (success) return medium;
+    }
+    return KittyTransmission::kDirect;
+}
+
+bool QueryKittyAnimation() {
+    const Duration kTimeBudget = Duration::Millis(250);
+    char buffer[512];
+
+    // Transmit a single pixel quietly, then add a frame to it, which is
+    // answered with OK only by terminals knowing about animations. The image
+    // is removed again; DSR 5 for terminals that don't answer.
+    static constexpr uint32_t kQueryId = 0x713a;      // Arbitrary.
+    static constexpr char kPixel[]     = "/////w==";  // base64 RGBA white.
+    char query[512];
+    snprintf(query, sizeof(query),
+             "\033_Ga=t,i=%u,s=1,v=1,f=32,q=2;%s\033\\"
+             "\033_Ga=f,i=%u,s=1,v=1,f=32;%s\033\\"
+             "\033_Ga=d,d=I,i=%u,q=2\033\\" TERM_CSI "5n",
+             kQueryId, kPixel, kQueryId, kPixel, kQueryId);
+
+    bool success = false;
+    char expected_ok[32];
+    snprintf(expected_ok, sizeof(expected_ok), "\033_Gi=%u;OK", kQueryId);
+    QueryTerminal(query, buffer, sizeof(buffer), kTimeBudget,
+                  [&](const char *data, size_t len) {
+                      success = find_str(data, len, expected_ok);
+                      return find_str(data, len, TERM_CSI "0");
+                  });
+    return success;
+}
+
+bool QueryKittyPlacement() {
+    const Duration kTimeBudget = Duration::Millis(250);
+    char buffer[512];
+
+    // Like QueryKittyAnimation(), but placing the pixel (without moving the
+    // cursor) is what is answered with OK.
+    static constexpr uint32_t kQueryId = 0x713b;      // Arbitrary.
+    static constexpr char kPixel[]     = "/////w==";  // base64 RGBA white.
+    char query[512];
+    snprintf(query, sizeof(query),
+             "\033_Ga=t,i=%u,s=1,v=1,f=32,q=2;%s\033\\"
+             "\033_Ga=p,i=%u,p=1,C=1\033\\"
+             "\033_Ga=d,d=I,i=%u,q=2\033\\" TERM_CSI "5n",
+             kQueryId, kPixel, kQueryId, kQueryId);
+
+    bool success = false;
+    char expected_ok[32];
+    snprintf(expected_ok, sizeof(expected_ok), "\033_Gi=%u,p=1;OK", kQueryId);
+    QueryTerminal(query, buffer, sizeof(buffer), kTimeBudget,
+                  [&](const char *data, size_t len) {
+                      success = find_str(data, len, expected_ok);
+                      return find_str(data, len, TERM_CSI "0");
+                  });
+    return success;
+}
+
 static bool QueryCellWidthHeight(int *width, int *height) {
     const Duration kTimeBudget      = Duration::Millis(50);
     constexpr char kQuery[]         = TERM_CSI "16t";
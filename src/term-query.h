@@ -50,12 +50,33 @@ struct SixelOptions {
 struct TermGraphicsInfo {
     GraphicsProtocol preferred_graphics = GraphicsProtocol::kNone;
     SixelOptions sixel;
-    bool in_tmux = false;
+    bool in_tmux          = false;
+    bool iterm2_multipart = false;  // Accepts MultipartFile transfers.
 };
 
 // Query the terminal if and what graphics protocol it supports.
 TermGraphicsInfo QuerySupportedGraphicsProtocol();
 
+// How pixel data is transmitted to a terminal with kitty graphics.
+enum class KittyTransmission {
+    kDirect,        // Base64-encoded in the escape sequence.
+    kTempFile,      // In a temporary file the terminal reads.
+    kSharedMemory,  // In a POSIX shared memory object the terminal reads.
+};
+
+// Query a kitty graphics terminal if it can read pixels from shared memory
+// or temporary files we create, i.e. if it runs on the same host. Returns
+// the fastest that works, kDirect if none does.
+KittyTransmission QueryKittyTransmission();
+
+// Query a kitty graphics terminal if it supports animations, i.e. if it
+// accepts additional frames for an image (a=f).
+bool QueryKittyAnimation();
+
+// Query a kitty graphics terminal if an image it has can be placed again
+// by its ID (a=p) without transmitting it.
+bool QueryKittyPlacement();
+
 }  // namespace timg
 
 #endif  // TIMG_TERM_QUERY_H
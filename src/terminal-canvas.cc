@@ -45,8 +45,8 @@ TerminalCanvas::TerminalCanvas(BufferedWriteSequencer *write_sequencer)
 TerminalCanvas::~TerminalCanvas() {
     if (!prefix_send_.empty()) {
         // The final 'cursor on' might still be in the buffer.
-        OutBuffer buffer(new char[prefix_send_.size()], prefix_send_.size());
-        AppendPrefixToBuffer(buffer.data);
+        OutBuffer buffer;
+        AppendPrefixToBuffer(&buffer);
         write_sequencer_->WriteBuffer(std::move(buffer), SeqType::ControlWrite);
     }
 }
@@ -55,12 +55,18 @@ void TerminalCanvas::AddPrefixNextSend(const char *data, int len) {
     prefix_send_.append(data, len);
 }
 
-char *TerminalCanvas::AppendPrefixToBuffer(char *buffer) {
-    if (prefix_send_.empty()) return buffer;
-    const size_t len = prefix_send_.length();
-    memcpy(buffer, prefix_send_.data(), len);
+void TerminalCanvas::AppendPrefixToBuffer(OutBuffer *buffer) {
+    if (prefix_send_.empty()) return;
+    buffer->Append(prefix_send_.data(), prefix_send_.length());
     prefix_send_.clear();
-    return buffer + len;
+}
+
+bool TerminalCanvas::SkipLateSend(SeqType sequence_type,
+                                  const Duration &end_of_frame) {
+    // Pending prefix content (e.g. cursor movements) needs to be written.
+    return ((sequence_type == SeqType::AnimationFrame ||
+             sequence_type == SeqType::AnimationRepeat) &&
+            prefix_send_.empty() && SkipLateFrame(end_of_frame));
 }
 
 void TerminalCanvas::MoveCursorDY(int rows) {
@@ -93,9 +99,8 @@ void TerminalCanvas::CursorOn() {
     // Cursor on after displaying an image should be processed ASAP, so
     // that a Ctrl-C on an image that takes forever to load will leave cursor.
     // TODO: Arguably, Send() should do that at end. AddPostfixNextSend() ?
-    const size_t kCursorOnSize = strlen(CURSOR_ON);
-    OutBuffer buffer(new char[kCursorOnSize], kCursorOnSize);
-    memcpy(buffer.data, CURSOR_ON, kCursorOnSize);  // NOLINT
+    OutBuffer buffer;
+    buffer.Append(CURSOR_ON);
     write_sequencer_->WriteBuffer(std::move(buffer), SeqType::ControlWrite);
 }
 
@@ -39,6 +39,19 @@ public:
     virtual void Send(int x, int dy, const Framebuffer &framebuffer,
                       SeqType sequence_type, Duration end_of_frame) = 0;
 
+    // Returns true if an animation frame finishing at "end_of_frame" is too
+    // late to be shown; it is then counted as skipped and should not be
+    // prepared or sent. See BufferedWriteSequencer::SkipLateFrame().
+    // Thread-safe.
+    bool SkipLateFrame(const Duration &end_of_frame) {
+        return write_sequencer_->SkipLateFrame(end_of_frame);
+    }
+
+    // Returns false if the content of an AnimationRepeat frame sent next is
+    // not used as the terminal repeats the animation by itself; any frame
+    // of the same size keeps the pace then.
+    virtual bool RepeatContentNeeded() const { return true; }
+
     // The following methods add content that is emitted before the next Send()
 
     void AddPrefixNextSend(const char *data, int len);
@@ -51,7 +64,11 @@ public:
     void MoveCursorDX(int cols);  // -: <-left, +: right->
 
 protected:
-    char *AppendPrefixToBuffer(char *buffer);
+    void AppendPrefixToBuffer(OutBuffer *buffer);
+
+    // To be called at the beginning of Send(): returns true if the frame is
+    // to be dropped without encoding as it would be skipped anyway.
+    bool SkipLateSend(SeqType sequence_type, const Duration &end_of_frame);
 
     BufferedWriteSequencer *const write_sequencer_;  // not owned
 
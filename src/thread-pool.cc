@@ -0,0 +1,217 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// timg - a terminal image viewer.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+//
+
+#include "thread-pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "timg-trace.h"
+
+namespace timg {
+namespace {
+// Worker index if the current thread belongs to a pool.
+thread_local const ThreadPool *current_pool = nullptr;
+thread_local int current_worker             = 0;
+}  // namespace
+
+ThreadPool::ThreadPool(int count) {
+    count = std::max(1, count);
+    for (int i = 0; i < count; ++i) {
+        workers_.emplace_back(new Worker());
+    }
+    for (int p = 0; p < kPriorityClasses; ++p) {
+        max_running_[p] = count;
+    }
+    for (int i = 0; i < count; ++i) {
+        workers_[i]->thread = std::thread(&ThreadPool::Runner, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> l(idle_lock_);
+        exiting_ = true;
+    }
+    idle_cv_.notify_all();
+    for (auto &worker : workers_) {
+        worker->thread.join();
+    }
+}
+
+void ThreadPool::LimitConcurrency(Priority priority, int max) {
+    max_running_[(int)priority] = std::max(1, max);
+    idle_cv_.notify_all();
+}
+
+void ThreadPool::Submit(std::function<void()> fn, Priority priority) {
+    const uint64_t sequence = next_sequence_++;
+    // Workers keep their own work, others distribute round-robin.
+    const int index = (current_pool == this)
+                          ? current_worker
+                          : (int)(sequence % workers_.size());
+    {
+        Worker *const worker = workers_[index].get();
+        std::lock_guard<std::mutex> l(worker->lock);
+        worker->queues[(int)priority].push_back({std::move(fn), sequence});
+    }
+    queued_[(int)priority]++;
+    {
+        // Make sure a worker just about to sleep sees the new work.
+        std::lock_guard<std::mutex> l(idle_lock_);
+    }
+    idle_cv_.notify_one();
+}
+
+bool ThreadPool::TakeTask(int self, int priority, Task *task) {
+    // Usually there is work in our own queue; no need to look elsewhere.
+    // Except for decoding, where the image shown next has to be first.
+    if (priority != (int)Priority::kDecode) {
+        Worker *const worker = workers_[self].get();
+        std::lock_guard<std::mutex> l(worker->lock);
+        std::deque<Task> &queue = worker->queues[priority];
+        if (!queue.empty()) {
+            *task = std::move(queue.front());
+            queue.pop_front();
+            return true;
+        }
+    }
+
+    // Otherwise take the oldest task of all. Decode tasks are few and
+    // long-running, so looking at all queues is cheap in comparison.
+    const int count  = (int)workers_.size();
+    int oldest       = -1;
+    uint64_t min_seq = std::numeric_limits<uint64_t>::max();
+    for (int i = 0; i < count; ++i) {
+        const int index      = (self + i) % count;
+        Worker *const worker = workers_[index].get();
+        std::lock_guard<std::mutex> l(worker->lock);
+        const std::deque<Task> &queue = worker->queues[priority];
+        if (!queue.empty() && queue.front().sequence < min_seq) {
+            min_seq = queue.front().sequence;
+            oldest  = index;
+        }
+    }
+    if (oldest < 0) return false;
+    Worker *const worker = workers_[oldest].get();
+    std::lock_guard<std::mutex> l(worker->lock);
+    std::deque<Task> &queue = worker->queues[priority];
+    if (queue.empty()) return false;  // Someone else was faster.
+    *task = std::move(queue.front());
+    queue.pop_front();
+    return true;
+}
+
+bool ThreadPool::RunNextTask(int self) {
+    for (int p = 0; p < kPriorityClasses; ++p) {
+        if (queued_[p] == 0) continue;
+        if (running_[p]++ >= max_running_[p]) {  // Reserve a slot.
+            running_[p]--;
+            continue;
+        }
+        Task task;
+        if (!TakeTask(self, p, &task)) {
+            running_[p]--;
+            continue;
+        }
+        queued_[p]--;
+        task.fn();
+        running_[p]--;
+        if (queued_[p] > 0) {
+            // Might have been held back by the concurrency limit.
+            std::lock_guard<std::mutex> l(idle_lock_);
+            idle_cv_.notify_one();
+        }
+        return true;
+    }
+    return false;
+}
+
+bool ThreadPool::HasRunnableWork() const {
+    for (int p = 0; p < kPriorityClasses; ++p) {
+        if (queued_[p] > 0 && running_[p] < max_running_[p]) return true;
+    }
+    return false;
+}
+
+void ThreadPool::Runner(int index) {
+    Tracer::SetThreadName("worker");
+    current_pool   = this;
+    current_worker = index;
+    for (;;) {
+        if (RunNextTask(index)) continue;
+        std::unique_lock<std::mutex> l(idle_lock_);
+        const auto all_done = [this]() {
+            for (const auto &queued : queued_) {
+                if (queued > 0) return false;
+            }
+            return true;
+        };
+        idle_cv_.wait(l, [&]() {
+            return HasRunnableWork() || (exiting_ && all_done());
+        });
+        if (exiting_ && all_done()) return;
+    }
+}
+
+void ThreadPool::ParallelFor(int begin, int end, int grain,
+                             const std::function<void(int, int)> &fn,
+                             Priority priority) {
+    grain            = std::max(1, grain);
+    const int chunks = (end - begin + grain - 1) / grain;
+    if (chunks <= 0) return;
+    if (chunks == 1) {
+        fn(begin, end);
+        return;
+    }
+
+    // Chunks are claimed by whoever gets to them first; helpers starting
+    // after all chunks are claimed just return.
+    struct State {
+        std::atomic<int> next{0};
+        std::atomic<int> done{0};
+        std::mutex lock;
+        std::condition_variable all_done;
+    };
+    auto state      = std::make_shared<State>();
+    const auto work = [state, begin, end, grain, chunks, &fn]() {
+        for (int c; (c = state->next++) < chunks; /**/) {
+            fn(begin + c * grain, std::min(end, begin + (c + 1) * grain));
+            if (++state->done == chunks) {
+                std::lock_guard<std::mutex> l(state->lock);
+                state->all_done.notify_all();
+            }
+        }
+    };
+    const int helpers = std::min(chunks - 1, size());
+    for (int i = 0; i < helpers; ++i) {
+        Submit(work, priority);
+    }
+    work();
+    std::unique_lock<std::mutex> l(state->lock);
+    state->all_done.wait(l, [&]() { return state->done == chunks; });
+}
+}  // namespace timg
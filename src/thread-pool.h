@@ -18,72 +18,102 @@
 #ifndef TIMG_THREAD_POOL
 #define TIMG_THREAD_POOL
 
+#include <atomic>
 #include <condition_variable>
+#include <cstdint>
 #include <deque>
 #include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <vector>
 
 namespace timg {
-// Simplistic thread-pool. Unfortunately, std::async() was a good idea but
-// not with a relevant implementation
+// Thread pool executing tasks by priority.
+//
+// Each worker has its own queues, so submitting work does not contend on a
+// single lock. Workers take the oldest task of the most urgent priority
+// class from their own queue; only if that is empty, they steal the oldest
+// from the others. Decoding tasks are always taken oldest first from all
+// queues, so images are decoded in the order they are requested. Encoding
+// frames for output is not held up by decoding images further down the
+// list.
 class ThreadPool {
 public:
-    explicit ThreadPool(int count) {
-        while (count--) {
-            threads_.push_back(new std::thread(&ThreadPool::Runner, this));
-        }
-    }
+    // Priority classes, most urgent first.
+    enum class Priority {
+        kInteractive,  // Someone is waiting right away, e.g. terminal query.
+        kEncode,       // Encoding frames for output.
+        kDecode,       // Loading images.
+    };
 
-    ~ThreadPool() {
-        CancelAllWork();
-        for (std::thread *t : threads_) {
-            t->join();
-            delete t;
-        }
-    }
+    explicit ThreadPool(int count);
+    ThreadPool(const ThreadPool &) = delete;
+
+    // Finishes all work queued so far, then stops the threads.
+    ~ThreadPool();
+
+    // Run at most "max" tasks of the given priority class at the same time,
+    // so that threads are left for the other classes.
+    void LimitConcurrency(Priority priority, int max);
 
     template <class T>
-    std::future<T> ExecAsync(std::function<T()> f) {
-        std::promise<T> *p           = new std::promise<T>();
-        std::future<T> future_result = p->get_future();
-        auto promise_fulfiller       = [p, f]() {
-            p->set_value(f());
-            delete p;
-        };
-        lock_.lock();
-        work_queue_.push_back(promise_fulfiller);
-        lock_.unlock();
-        cv_.notify_one();
+    std::future<T> ExecAsync(std::function<T()> f,
+                             Priority priority = Priority::kDecode) {
+        auto task = std::make_shared<std::packaged_task<T()>>(std::move(f));
+        std::future<T> future_result = task->get_future();
+        Submit([task]() { (*task)(); }, priority);
         return future_result;
     }
 
-    void CancelAllWork() {
-        lock_.lock();
-        exiting_ = true;
-        lock_.unlock();
-        cv_.notify_all();
-    }
+    // Call "fn" with consecutive ranges [chunk_begin, chunk_end) of up to
+    // "grain" elements, together covering [begin, end), in parallel.
+    // The calling thread works on chunks as well and returns once all of them
+    // are done; so this can also be used from within a task.
+    void ParallelFor(int begin, int end, int grain,
+                     const std::function<void(int, int)> &fn,
+                     Priority priority = Priority::kEncode);
+
+    int size() const { return (int)workers_.size(); }
 
 private:
-    void Runner() {
-        for (;;) {
-            std::unique_lock<std::mutex> l(lock_);
-            cv_.wait(l, [this]() { return !work_queue_.empty() || exiting_; });
-            if (exiting_) return;
-            auto process_work_item = work_queue_.front();
-            work_queue_.pop_front();
-            l.unlock();
-            process_work_item();
-        }
-    }
+    static constexpr int kPriorityClasses = 3;
+
+    struct Task {
+        std::function<void()> fn;
+        uint64_t sequence;  // Order of submission.
+    };
+
+    struct Worker {
+        std::thread thread;
+        std::mutex lock;
+        std::deque<Task> queues[kPriorityClasses];
+    };
+
+    void Submit(std::function<void()> fn, Priority priority);
+
+    // Take the oldest task of the given priority class from the queue of
+    // "self", or if empty, from any other worker. For kDecode, always the
+    // oldest of all workers. Returns false if there is none.
+    bool TakeTask(int self, int priority, Task *task);
+
+    // Run the most urgent task that can run now. Returns false if none.
+    bool RunNextTask(int self);
+
+    // Needs to be called with idle_lock_ held.
+    bool HasRunnableWork() const;
+
+    void Runner(int index);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<uint64_t> next_sequence_{0};
+    std::atomic<int> queued_[kPriorityClasses]      = {};
+    std::atomic<int> running_[kPriorityClasses]     = {};
+    std::atomic<int> max_running_[kPriorityClasses] = {};
 
-    std::vector<std::thread *> threads_;
-    std::mutex lock_;
-    std::condition_variable cv_;
-    std::deque<std::function<void()>> work_queue_;
+    std::mutex idle_lock_;  // Workers without work wait on idle_cv_.
+    std::condition_variable idle_cv_;
     bool exiting_ = false;
 };
 
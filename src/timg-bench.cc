@@ -0,0 +1,368 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Microbenchmarks of the hot kernels in isolation, using synthetic images.
+// Not built by default; build with
+//   cmake --build <builddir> --target timg-bench
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buffered-write-sequencer.h"
+#include "framebuffer.h"
+#include "image-scaler.h"
+#include "timg-base64.h"
+#include "timg-png.h"
+#include "thread-pool.h"
+#include "timg-time.h"
+#include "unicode-block-canvas.h"
+
+#if defined(WITH_TIMG_SWS_RESIZE)
+static constexpr char kScalerName[] = "sws";
+#elif defined(WITH_TIMG_STB_RESIZE)
+static constexpr char kScalerName[] = "stb";
+#else
+static constexpr char kScalerName[] = "unknown";
+#endif
+
+using timg::Duration;
+using timg::Framebuffer;
+using timg::rgba_t;
+using timg::Time;
+
+namespace {
+struct BenchResult {
+    std::string name;
+    int64_t iterations;
+    double ns_per_op;
+    int64_t bytes_per_op;  // Input bytes processed per op; 0 if n/a.
+};
+
+// Prevent the compiler from optimizing away results we don't look at.
+volatile size_t sink_value;
+
+// Generate a synthetic image that is somewhat like a photo: smooth gradients
+// with a bit of deterministic noise, so that neither the compressor nor the
+// glyph search hit trivial fast paths. If "with_alpha" is set, the top left
+// triangle fades into transparency.
+std::unique_ptr<Framebuffer> CreateTestImage(int width, int height,
+                                             bool with_alpha) {
+    std::unique_ptr<Framebuffer> result(new Framebuffer(width, height));
+    uint32_t lcg = 0x12345678;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            lcg             = lcg * 1664525 + 1013904223;
+            const int noise = (lcg >> 24) & 0x0f;
+            const uint8_t r = (255 * x / width + noise) & 0xff;
+            const uint8_t g = (255 * y / height + noise) & 0xff;
+            const uint8_t b = 128 + 127 * sinf(x * 0.05f + y * 0.03f);
+            const int diag  = x + y - (width + height) / 2;
+            const uint8_t a = (!with_alpha || diag >= 0) ? 0xff
+                              : (diag < -255)            ? 0x00
+                                                         : 255 + diag;
+            result->SetPixel(x, y, {r, g, b, a});
+        }
+    }
+    return result;
+}
+
+// Run "op" repeatedly until at least "min_time" passed and report the
+// average time per call.
+BenchResult RunBenchmark(const std::string &name, const Duration &min_time,
+                         int64_t bytes_per_op, const std::function<void()> &op) {
+    op();  // Warm up caches and lazily allocated buffers.
+
+    int64_t iterations = 0;
+    int64_t batch      = 1;
+    const Time start   = Time::Now();
+    Duration elapsed;
+    do {
+        for (int64_t i = 0; i < batch; ++i) op();
+        iterations += batch;
+        elapsed = Time::Now() - start;
+        if (batch < (1 << 16)) batch *= 2;
+    } while (elapsed < min_time);
+
+    return {name, iterations, 1.0 * elapsed.nanoseconds() / iterations,
+            bytes_per_op};
+}
+
+// Minimal reader for the JSON files we write ourselves; we only need the
+// name -> ns_per_op mapping.
+bool ReadBaseline(const char *filename, std::map<std::string, double> *out) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    std::string content;
+    char buf[4096];
+    size_t r;
+    while ((r = fread(buf, 1, sizeof(buf), f)) > 0) content.append(buf, r);
+    fclose(f);
+
+    static constexpr char kName[]  = "\"name\": \"";
+    static constexpr char kValue[] = "\"ns_per_op\": ";
+    size_t pos                     = 0;
+    while ((pos = content.find(kName, pos)) != std::string::npos) {
+        pos += strlen(kName);
+        const size_t name_end = content.find('"', pos);
+        const size_t value    = content.find(kValue, name_end);
+        if (name_end == std::string::npos || value == std::string::npos) break;
+        (*out)[content.substr(pos, name_end - pos)] =
+            strtod(content.c_str() + value + strlen(kValue), nullptr);
+        pos = value;
+    }
+    return true;
+}
+
+bool WriteJson(const char *filename, const std::vector<BenchResult> &results) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    fprintf(f, "{\n  \"scaler\": \"%s\",\n  \"results\": [\n", kScalerName);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &r = results[i];
+        fprintf(f,
+                "    {\"name\": \"%s\", \"iterations\": %lld, "
+                "\"ns_per_op\": %.1f, \"bytes_per_op\": %lld}%s\n",
+                r.name.c_str(), (long long)r.iterations, r.ns_per_op,
+                (long long)r.bytes_per_op, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+int usage(const char *progname) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "Options:\n"
+            "\t--filter=<substr>    : Only run benchmarks containing substr.\n"
+            "\t--min-time=<ms>      : Minimum run time per benchmark "
+            "(default 500).\n"
+            "\t--json=<file>        : Write results as JSON to file.\n"
+            "\t--baseline=<file>    : Compare against JSON results of an "
+            "earlier run.\n"
+            "\t--threshold=<percent>: Slowdown vs. baseline considered a "
+            "regression (default 10).\n"
+            "Exit code is 1 if any benchmark regressed compared to the "
+            "baseline.\n",
+            progname);
+    return 2;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    enum LongOptionIds {
+        OPT_FILTER = 1000,
+        OPT_MIN_TIME,
+        OPT_JSON,
+        OPT_BASELINE,
+        OPT_THRESHOLD,
+    };
+
+    // clang-format off
+    static constexpr struct option long_options[] = {
+        { "filter",    required_argument, nullptr, OPT_FILTER },
+        { "min-time",  required_argument, nullptr, OPT_MIN_TIME },
+        { "json",      required_argument, nullptr, OPT_JSON },
+        { "baseline",  required_argument, nullptr, OPT_BASELINE },
+        { "threshold", required_argument, nullptr, OPT_THRESHOLD },
+        { "help",      no_argument,       nullptr, 'h' },
+        { nullptr, 0, nullptr, 0},
+    };
+    // clang-format on
+
+    const char *filter        = "";
+    const char *json_out      = nullptr;
+    const char *baseline_file = nullptr;
+    int min_time_ms           = 500;
+    double threshold_percent  = 10;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case OPT_FILTER: filter = optarg; break;
+        case OPT_MIN_TIME: min_time_ms = atoi(optarg); break;
+        case OPT_JSON: json_out = optarg; break;
+        case OPT_BASELINE: baseline_file = optarg; break;
+        case OPT_THRESHOLD: threshold_percent = atof(optarg); break;
+        case 'h':
+        default: return usage(argv[0]);
+        }
+    }
+    const Duration min_time = Duration::Millis(min_time_ms);
+
+    std::map<std::string, double> baseline;
+    if (baseline_file && !ReadBaseline(baseline_file, &baseline)) return 2;
+
+    std::vector<BenchResult> results;
+    auto run = [&](const std::string &name, int64_t bytes_per_op,
+                   const std::function<void()> &op) {
+        if (!strstr(name.c_str(), filter)) return;
+        results.push_back(RunBenchmark(name, min_time, bytes_per_op, op));
+        const BenchResult &r = results.back();
+        fprintf(stderr, "%-36s %12.1f ns/op", r.name.c_str(), r.ns_per_op);
+        if (r.bytes_per_op) {
+            fprintf(stderr, " %9.1f MiB/s",
+                    r.bytes_per_op / (r.ns_per_op * 1e-9) / (1 << 20));
+        }
+        fprintf(stderr, "\n");
+    };
+
+    // Sizes roughly matching what we see in practice: unicode blocks on a
+    // large terminal, graphics protocols on a HiDPI half-screen.
+    const auto block_image_owner   = CreateTestImage(320, 200, true);
+    const auto pixel_image_owner   = CreateTestImage(1280, 720, true);
+    const auto solid_image_owner   = CreateTestImage(1280, 720, false);
+    const Framebuffer &block_image = *block_image_owner;
+    const Framebuffer &pixel_image = *pixel_image_owner;
+    const Framebuffer &solid_image = *solid_image_owner;
+
+    // -- Unicode block canvas. Exercises AppendDoubleRow() and
+    // FindBestGlyph(). Output goes through the sequencer to /dev/null.
+    static volatile sig_atomic_t no_interrupt = 0;
+    const int null_fd                         = open("/dev/null", O_WRONLY);
+    timg::ThreadPool pool(std::thread::hardware_concurrency());
+    {
+        timg::BufferedWriteSequencer sequencer(null_fd, false, 4, true,
+                                               no_interrupt);
+        for (const bool quarter : {false, true}) {
+            for (const bool use_256 : {true, false}) {
+                timg::UnicodeBlockCanvas canvas(&sequencer, &pool, quarter,
+                                                false, use_256);
+                const std::string name =
+                    std::string("unicode/") + (quarter ? "quarter" : "half") +
+                    (use_256 ? "/8bit" : "/24bit");
+                run(name, block_image.width() * block_image.height() * 4,
+                    [&]() {
+                        canvas.Send(0, 0, block_image,
+                                    timg::SeqType::FrameImmediate, {});
+                    });
+                sequencer.Flush();
+            }
+        }
+    }
+
+    // -- PNG encoding, as used by kitty and iTerm2.
+    const size_t png_size =
+        timg::png::UpperBound(pixel_image.width(), pixel_image.height());
+    std::unique_ptr<char[]> png_buffer(new char[png_size]);
+    size_t png_encoded_size = 0;
+    for (int level = 0; level <= 9; ++level) {
+        run("png/rgba/level-" + std::to_string(level),
+            solid_image.width() * solid_image.height() * 4, [&]() {
+                png_encoded_size = timg::png::Encode(
+                    solid_image, level, timg::png::ColorEncoding::kRGBA_32,
+                    png_buffer.get(), png_size);
+            });
+    }
+    run("png/rgb/level-1", solid_image.width() * solid_image.height() * 4,
+        [&]() {
+            sink_value = timg::png::Encode(solid_image, 1,
+                                           timg::png::ColorEncoding::kRGB_24,
+                                           png_buffer.get(), png_size);
+        });
+    for (const int level : {1, 6, 9}) {
+        run("png/rgba/parallel/level-" + std::to_string(level),
+            solid_image.width() * solid_image.height() * 4, [&]() {
+                sink_value = timg::png::Encode(
+                    solid_image, level, timg::png::ColorEncoding::kRGBA_32,
+                    png_buffer.get(), png_size, &pool);
+            });
+    }
+
+    // -- Base64 of (the last) PNG result.
+    std::unique_ptr<char[]> base64_buffer(new char[png_size * 4 / 3 + 4]);
+    run("base64", png_encoded_size, [&]() {
+        const char *end = timg::EncodeBase64(
+            png_buffer.get(), png_encoded_size, base64_buffer.get());
+        sink_value = end - base64_buffer.get();
+    });
+
+    // -- Alpha compositing. Composition modifies the image, so each
+    // iteration starts by restoring the original pixels; the "restore"
+    // benchmark tells how much of the time that accounts for.
+    Framebuffer compose_image(pixel_image);
+    const size_t image_bytes =
+        pixel_image.width() * pixel_image.height() * sizeof(rgba_t);
+    const rgba_t bg      = {0x20, 0x20, 0x20, 0xff};
+    const rgba_t pattern = {0x60, 0x60, 0x60, 0xff};
+    auto get_bg          = [bg]() { return bg; };
+    run("alpha-compose/restore-only", image_bytes, [&]() {
+        memcpy(compose_image.begin(), pixel_image.begin(), image_bytes);
+    });
+    run("alpha-compose/solid", image_bytes, [&]() {
+        memcpy(compose_image.begin(), pixel_image.begin(), image_bytes);
+        compose_image.AlphaComposeBackground(get_bg, {}, 0, 0);
+    });
+    run("alpha-compose/checkerboard", image_bytes, [&]() {
+        memcpy(compose_image.begin(), pixel_image.begin(), image_bytes);
+        compose_image.AlphaComposeBackground(get_bg, pattern, 8, 16);
+    });
+
+    // -- Image scaler backend chosen at compile-time.
+    struct ScaleCase {
+        const char *name;
+        int in_w, in_h, out_w, out_h;
+    };
+    for (const ScaleCase &c : {ScaleCase{"down", 1920, 1080, 640, 360},
+                               ScaleCase{"up", 160, 90, 640, 360}}) {
+        auto in = CreateTestImage(c.in_w, c.in_h, true);
+        Framebuffer out(c.out_w, c.out_h);
+        auto scaler = timg::ImageScaler::Create(
+            c.in_w, c.in_h, timg::ImageScaler::ColorFmt::kRGBA, c.out_w,
+            c.out_h);
+        if (!scaler) continue;
+        run(std::string("scaler/") + kScalerName + "/" + c.name,
+            c.in_w * c.in_h * 4, [&]() { scaler->Scale(*in, &out); });
+    }
+    close(null_fd);
+
+    if (json_out && !WriteJson(json_out, results)) return 2;
+
+    if (baseline.empty()) return 0;
+
+    int regressions = 0;
+    fprintf(stderr, "\n%-36s %12s %12s %8s\n", "Compared to baseline",
+            "base ns/op", "ns/op", "change");
+    for (const BenchResult &r : results) {
+        auto found = baseline.find(r.name);
+        if (found == baseline.end() || found->second <= 0) continue;
+        const double change  = 100.0 * (r.ns_per_op / found->second - 1.0);
+        const bool regressed = change > threshold_percent;
+        fprintf(stderr, "%-36s %12.1f %12.1f %+7.1f%%%s\n", r.name.c_str(),
+                found->second, r.ns_per_op, change,
+                regressed ? "  REGRESSION" : "");
+        if (regressed) ++regressions;
+    }
+    return regressions ? 1 : 0;
+}
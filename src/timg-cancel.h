@@ -0,0 +1,59 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_CANCEL_H_
+#define TIMG_CANCEL_H_
+
+#include <signal.h>
+
+#include <atomic>
+
+namespace timg {
+// Tells long running work, such as loading an image in the thread pool or
+// encoding a frame, that its result is not needed anymore. The work polls
+// cancelled() wherever it conveniently can and then gives up early.
+// Thread-safe.
+class CancellationToken {
+public:
+    // A token that is only cancelled by calling Cancel().
+    CancellationToken() = default;
+
+    // A token that is also cancelled as soon as "interrupt_received" is set,
+    // e.g. by a signal handler. The flag has to outlive the token.
+    explicit CancellationToken(const volatile sig_atomic_t &interrupt_received)
+        : interrupt_received_(&interrupt_received) {}
+
+    CancellationToken(const CancellationToken &) = delete;
+
+    void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+
+    bool cancelled() const {
+        return cancelled_.load(std::memory_order_relaxed) ||
+               (interrupt_received_ && *interrupt_received_);
+    }
+
+    // A token that is never cancelled, for callers that don't need it.
+    static const CancellationToken &Never() {
+        static const CancellationToken kNever;
+        return kNever;
+    }
+
+private:
+    std::atomic<bool> cancelled_{false};
+    const volatile sig_atomic_t *const interrupt_received_ = nullptr;
+};
+}  // namespace timg
+
+#endif  // TIMG_CANCEL_H_
@@ -0,0 +1,96 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "timg-histogram.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+
+namespace timg {
+static constexpr int kSubBucketBits = 4;
+static constexpr int kSubBuckets    = 1 << kSubBucketBits;
+
+// Values below kSubBuckets get their own bucket. Above, each power of two
+// is split into kSubBuckets buckets of equal width.
+int Histogram::BucketFor(int64_t value) {
+    if (value < kSubBuckets) return value < 0 ? 0 : (int)value;
+    int msb = 0;
+    for (uint64_t v = value; v > 1; v >>= 1) ++msb;
+    const int shift      = msb - kSubBucketBits;
+    const int sub_bucket = (int)((value >> shift) & (kSubBuckets - 1));
+    return (shift + 1) * kSubBuckets + sub_bucket;
+}
+
+int64_t Histogram::BucketRepresentative(int bucket) {
+    if (bucket < kSubBuckets) return bucket;
+    const int shift     = bucket / kSubBuckets - 1;
+    const int64_t low   = (int64_t)(kSubBuckets + bucket % kSubBuckets);
+    const int64_t width = (int64_t)1 << shift;
+    return (low << shift) + width / 2;
+}
+
+void Histogram::Add(int64_t value) {
+    if (value < 0) value = 0;
+    const int bucket = BucketFor(value);
+    if (bucket >= (int)buckets_.size()) buckets_.resize(bucket + 1);
+    ++buckets_[bucket];
+    min_ = (count_ == 0) ? value : std::min(min_, value);
+    max_ = std::max(max_, value);
+    sum_ += value;
+    ++count_;
+}
+
+void Histogram::Merge(const Histogram &other) {
+    if (other.count_ == 0) return;
+    if (other.buckets_.size() > buckets_.size()) {
+        buckets_.resize(other.buckets_.size());
+    }
+    for (size_t i = 0; i < other.buckets_.size(); ++i) {
+        buckets_[i] += other.buckets_[i];
+    }
+    min_ = (count_ == 0) ? other.min_ : std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    sum_ += other.sum_;
+    count_ += other.count_;
+}
+
+int64_t Histogram::Percentile(double percent) const {
+    if (count_ == 0) return 0;
+    const int64_t rank = std::max<int64_t>(
+        1, (int64_t)std::ceil(percent / 100.0 * count_));
+    int64_t seen = 0;
+    for (size_t i = 0; i < buckets_.size(); ++i) {
+        seen += buckets_[i];
+        if (seen >= rank) {
+            return std::clamp(BucketRepresentative(i), min_, max_);
+        }
+    }
+    return max_;
+}
+
+void Histogram::WriteJson(FILE *out) const {
+    fprintf(out,
+            "{\"count\": %" PRId64 ", \"min\": %" PRId64 ", \"max\": %" PRId64
+            ", \"mean\": %.1f",
+            count(), min(), max(), mean());
+    for (const int p : {50, 90, 95, 99}) {
+        fprintf(out, ", \"p%d\": %" PRId64, p, Percentile(p));
+    }
+    fprintf(out, "}");
+}
+}  // namespace timg
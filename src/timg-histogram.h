@@ -0,0 +1,64 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_HISTOGRAM_H_
+#define TIMG_HISTOGRAM_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace timg {
+// Histogram of non-negative integer values such as latencies in nanoseconds
+// or sizes in bytes. Memory use is bounded independent of the number of
+// values added: buckets are exact for small values and logarithmically
+// spaced with 16 sub-buckets per power of two above, so percentiles are
+// reported within about 3% of the true value.
+//
+// Not thread-safe; callers serialize access.
+class Histogram {
+public:
+    void Add(int64_t value);
+
+    // Add all values from the other histogram.
+    void Merge(const Histogram &other);
+
+    int64_t count() const { return count_; }
+    int64_t min() const { return count_ ? min_ : 0; }
+    int64_t max() const { return max_; }
+    int64_t sum() const { return sum_; }
+    double mean() const { return count_ ? 1.0 * sum_ / count_ : 0; }
+
+    // Approximate value below which "percent" of the values fall, e.g.
+    // Percentile(99) for p99. Returns 0 if empty.
+    int64_t Percentile(double percent) const;
+
+    // Write summary as JSON object with count, min, max, mean and
+    // percentiles.
+    void WriteJson(FILE *out) const;
+
+private:
+    static int BucketFor(int64_t value);
+    static int64_t BucketRepresentative(int bucket);
+
+    std::vector<int64_t> buckets_;  // Grows to the highest bucket used.
+    int64_t count_ = 0;
+    int64_t min_   = 0;
+    int64_t max_   = 0;
+    int64_t sum_   = 0;
+};
+}  // namespace timg
+
+#endif  // TIMG_HISTOGRAM_H_
@@ -0,0 +1,117 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "timg-memory.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace timg {
+namespace {
+// Released accounts that are kept individually; the peaks of all others are
+// summarized, so the registry does not grow with the number of images shown.
+constexpr size_t kMaxReleasedKept = 16;
+
+struct Registry {
+    std::vector<std::weak_ptr<const MemoryAccount>> live;
+    std::vector<std::shared_ptr<const MemoryAccount>> released;  // Largest.
+    std::shared_ptr<MemoryAccount> released_others;  // Max of the others.
+};
+std::mutex registry_lock;
+Registry *const registry = new Registry();
+}  // namespace
+
+std::shared_ptr<MemoryAccount> MemoryAccount::Create(const std::string &name) {
+    std::shared_ptr<MemoryAccount> result(new MemoryAccount(name), &Release);
+    std::lock_guard<std::mutex> l(registry_lock);
+    registry->live.push_back(result);
+    return result;
+}
+
+void MemoryAccount::Release(MemoryAccount *account) {
+    std::unique_ptr<MemoryAccount> to_delete(account);
+    std::lock_guard<std::mutex> l(registry_lock);
+    // The weak_ptr of the account is expired now, as are possibly others
+    // whose deleter is waiting for the lock; they remove themselves.
+    auto &live = registry->live;
+    live.erase(std::remove_if(live.begin(), live.end(),
+                              [](const auto &a) { return a.expired(); }),
+               live.end());
+    if (account->peak() == 0) return;
+
+    // Keep the peak in a copy that is not updated anymore.
+    std::shared_ptr<MemoryAccount> snapshot(new MemoryAccount(account->name_));
+    snapshot->peak_.store(account->peak());
+    auto &released = registry->released;
+    released.push_back(snapshot);
+    if (released.size() <= kMaxReleasedKept) return;
+    const auto smallest = std::min_element(
+        released.begin(), released.end(),
+        [](const auto &a, const auto &b) { return a->peak() < b->peak(); });
+    std::shared_ptr<MemoryAccount> &others = registry->released_others;
+    if (!others) others.reset(new MemoryAccount("(other released accounts)"));
+    others->peak_.store(std::max(others->peak(), (*smallest)->peak()));
+    released.erase(smallest);
+}
+
+std::vector<std::shared_ptr<const MemoryAccount>> MemoryAccount::All() {
+    std::vector<std::shared_ptr<const MemoryAccount>> result;
+    std::lock_guard<std::mutex> l(registry_lock);
+    for (const auto &account : registry->live) {
+        if (auto a = account.lock()) result.push_back(a);
+    }
+    result.insert(result.end(), registry->released.begin(),
+                  registry->released.end());
+    if (registry->released_others) {
+        result.push_back(registry->released_others);
+    }
+    return result;
+}
+
+MemoryAccount *MemoryAccount::FramebufferCopies() {
+    static const std::shared_ptr<MemoryAccount> account =
+        Create("(framebuffer copies)");
+    return account.get();
+}
+
+MemoryAccount *MemoryAccount::OutputBuffers() {
+    static const std::shared_ptr<MemoryAccount> account =
+        Create("(output buffers)");
+    return account.get();
+}
+
+void MemoryAccount::Add(int64_t bytes) {
+    const int64_t now = current_.fetch_add(bytes) + bytes;
+    int64_t peak      = peak_.load();
+    while (now > peak && !peak_.compare_exchange_weak(peak, now)) {
+    }
+}
+
+int64_t PeakResidentSetBytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+#ifdef __APPLE__
+    return usage.ru_maxrss;  // Already bytes on macOS.
+#else
+    return (int64_t)usage.ru_maxrss * 1024;
+#endif
+}
+}  // namespace timg
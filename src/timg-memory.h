@@ -0,0 +1,69 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_MEMORY_H_
+#define TIMG_MEMORY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace timg {
+// Keeps track of the bytes currently held by some owner, e.g. the decoded
+// frames of an image source, and remembers the peak.
+// Thread-safe.
+class MemoryAccount {
+public:
+    // Create a new account with the given name. Once the last reference is
+    // gone, only its peak is kept for reporting in All(): for the accounts
+    // with the largest peaks individually, for all others summarized in one.
+    static std::shared_ptr<MemoryAccount> Create(const std::string &name);
+
+    // Accounts still in use in order of creation, followed by the ones
+    // kept of the released accounts.
+    static std::vector<std::shared_ptr<const MemoryAccount>> All();
+
+    // Accounts for buffers in flight between pipeline stages: framebuffer
+    // copies needed while a frame is still held by an encoder, and output
+    // buffers on their way to the terminal.
+    static MemoryAccount *FramebufferCopies();
+    static MemoryAccount *OutputBuffers();
+
+    // Add allocated bytes; negative for released bytes.
+    void Add(int64_t bytes);
+
+    const std::string &name() const { return name_; }
+    int64_t current() const { return current_.load(); }
+    int64_t peak() const { return peak_.load(); }
+
+private:
+    explicit MemoryAccount(const std::string &name) : name_(name) {}
+
+    // Deleter of accounts handed out by Create().
+    static void Release(MemoryAccount *account);
+
+    const std::string name_;
+    std::atomic<int64_t> current_{0};
+    std::atomic<int64_t> peak_{0};
+};
+
+// High-water mark of the resident set size of this process in bytes as
+// reported by the operating system.
+int64_t PeakResidentSetBytes();
+}  // namespace timg
+
+#endif  // TIMG_MEMORY_H_
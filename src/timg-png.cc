@@ -18,11 +18,17 @@
 #include <libdeflate.h>
 #include <netinet/in.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include "framebuffer.h"
+#include "thread-pool.h"
 
 namespace timg {
 namespace {
@@ -87,11 +93,523 @@ private:
     uint8_t *pos_;          // Current write position
 };
 
+// Extra bits following length and distance symbols in a deflate stream.
+// https://www.rfc-editor.org/rfc/rfc1951#page-12
+struct LengthExtraBits {
+    constexpr LengthExtraBits() {
+        for (int symbol = 265; symbol < 285; ++symbol) {
+            bits[symbol] = (symbol - 261) / 4;
+        }
+    }
+    uint8_t bits[288] = {};  // Literals and end of block: none.
+};
+constexpr LengthExtraBits kLengthExtra;
+constexpr uint8_t kDistanceExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Reads through a raw deflate stream to find where its final block starts
+// and where the stream ends, both as bit positions. Only checks as much
+// as needed to not get lost; it is used on streams we just compressed.
+class DeflateScanner {
+public:
+    DeflateScanner(const uint8_t *data, size_t len) : data_(data), len_(len) {}
+
+    bool FindFinalBlock(size_t *final_block_bit, size_t *end_bit) {
+        for (;;) {
+            const size_t block_start = bitpos_;
+            const bool is_final      = Bits(1);
+            bool success             = false;
+            switch (Bits(2)) {
+            case 0: success = SkipStored(); break;
+            case 1: success = SkipFixed(); break;
+            case 2: success = SkipDynamic(); break;
+            default: return false;
+            }
+            if (!success || bitpos_ > 8 * len_) return false;
+            if (is_final) {
+                *final_block_bit = block_start;
+                *end_bit         = bitpos_;
+                return true;
+            }
+        }
+    }
+
+private:
+    // Canonical Huffman code: number of codes per length and symbols
+    // ordered by code.
+    // Short codes are looked up directly in "fast", indexed by the next
+    // bits of the stream. Entries contain the symbol and the number of bits
+    // to skip, which already includes the extra bits following the code:
+    // (symbol << 5 | bits), or 0 if the code is longer.
+    static constexpr int kFastBits = 10;
+    struct Huffman {
+        int16_t count[16];
+        int16_t symbol[288];
+        uint16_t fast[1 << kFastBits];
+        const uint8_t *extra_bits;  // Per symbol; nullptr if none.
+    };
+
+    // At least the next 56 bits of the stream starting at bit "pos".
+    uint64_t Peek(size_t pos) const {
+        const size_t byte = pos / 8;
+        uint64_t value    = 0;
+        if (byte + 8 <= len_) {
+            memcpy(&value, data_ + byte, 8);  // Assuming little endian.
+        }
+        else {
+            for (size_t i = 0; byte + i < len_; ++i) {
+                value |= (uint64_t)data_[byte + i] << (8 * i);
+            }
+        }
+        return value >> (pos % 8);
+    }
+
+    uint32_t Bits(int n) {
+        const uint32_t value = Peek(bitpos_) & ((1u << n) - 1);
+        bitpos_ += n;
+        return value;
+    }
+
+    // Decode one symbol from "bits", the stream at "pos", skipping the code
+    // and its extra bits. Returns symbol and bits skipped via "skip";
+    // symbol is -1 if not a valid code.
+    static int Decode(const Huffman &h, uint64_t bits, int *skip) {
+        const uint16_t entry = h.fast[bits & ((1 << kFastBits) - 1)];
+        if (entry) {
+            *skip = entry & 0x1f;
+            return entry >> 5;
+        }
+        // Longer code. These are stored starting with the most significant
+        // bit, so assemble it bit by bit.
+        int code = 0, first = 0, index = 0;
+        for (int len = 1; len <= 15; ++len) {
+            code |= (bits >> (len - 1)) & 1;
+            const int count = h.count[len];
+            if (code - count < first) {
+                const int symbol = h.symbol[index + (code - first)];
+                *skip = len + (h.extra_bits ? h.extra_bits[symbol] : 0);
+                return symbol;
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+
+    static bool Build(Huffman *h, const uint8_t *lengths, int n,
+                      const uint8_t *extra_bits = nullptr) {
+        memset(h->count, 0, sizeof(h->count));
+        for (int sym = 0; sym < n; ++sym) h->count[lengths[sym]]++;
+        int left = 1;
+        for (int len = 1; len <= 15; ++len) {
+            left = (left << 1) - h->count[len];
+            if (left < 0) return false;  // Over-subscribed.
+        }
+        int16_t offsets[16];
+        offsets[1] = 0;
+        for (int len = 1; len < 15; ++len) {
+            offsets[len + 1] = offsets[len] + h->count[len];
+        }
+        for (int sym = 0; sym < n; ++sym) {
+            if (lengths[sym]) h->symbol[offsets[lengths[sym]]++] = sym;
+        }
+
+        h->extra_bits = extra_bits;
+        memset(h->fast, 0, sizeof(h->fast));
+        int code = 0, index = 0;
+        for (int len = 1; len <= kFastBits; ++len, code <<= 1) {
+            for (int i = 0; i < h->count[len]; ++i, ++code) {
+                int reversed = 0;  // Bits in stream order.
+                for (int b = 0; b < len; ++b) {
+                    reversed |= ((code >> b) & 1) << (len - 1 - b);
+                }
+                const int symbol = h->symbol[index++];
+                const int skip   = len + (extra_bits ? extra_bits[symbol] : 0);
+                for (int r = reversed; r < (1 << kFastBits); r += 1 << len) {
+                    h->fast[r] = symbol << 5 | skip;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool SkipStored() {
+        bitpos_             = (bitpos_ + 7) & ~(size_t)7;
+        const uint32_t len  = Bits(16);
+        const uint32_t nlen = Bits(16);
+        if (len != (~nlen & 0xffff)) return false;
+        bitpos_ += 8 * len;
+        return true;
+    }
+
+    bool SkipCodes(const Huffman &lencode, const Huffman &distcode) {
+        // Bits are taken from a local buffer that is only refilled every few
+        // symbols, as loading from the stream for each symbol is slow.
+        size_t pos       = bitpos_;
+        const size_t end = 8 * len_;
+        uint64_t bits    = 0;
+        int available    = 0;  // Valid bits in "bits".
+        auto decode      = [&](const Huffman &h) {
+            if (available < 32) {  // Enough for any code with extra bits.
+                bits      = Peek(pos);
+                available = 56;
+            }
+            int skip         = 0;
+            const int symbol = Decode(h, bits, &skip);
+            bits >>= skip;
+            available -= skip;
+            pos += skip;
+            return symbol;
+        };
+        int symbol;
+        do {
+            symbol = decode(lencode);
+            if (symbol > 256) {  // Length, followed by distance.
+                if (symbol > 285 || decode(distcode) >= 30) return false;
+            }
+        } while (symbol != 256 && symbol >= 0 && pos <= end);
+        bitpos_ = pos;
+        return symbol == 256;  // End of block.
+    }
+
+    bool SkipFixed() {
+        static const struct FixedCodes {
+            FixedCodes() {
+                uint8_t lengths[288];
+                memset(lengths, 8, 144);
+                memset(lengths + 144, 9, 112);
+                memset(lengths + 256, 7, 24);
+                memset(lengths + 280, 8, 8);
+                Build(&lencode, lengths, 288, kLengthExtra.bits);
+                memset(lengths, 5, 30);
+                Build(&distcode, lengths, 30, kDistanceExtra);
+            }
+            Huffman lencode, distcode;
+        } fixed;
+        return SkipCodes(fixed.lencode, fixed.distcode);
+    }
+
+    bool SkipDynamic() {
+        static constexpr uint8_t kOrder[19] = {16, 17, 18, 0, 8,  7, 9,
+                                               6,  10, 5,  11, 4, 12, 3,
+                                               13, 2,  14, 1,  15};
+        const int nlen  = Bits(5) + 257;
+        const int ndist = Bits(5) + 1;
+        const int ncode = Bits(4) + 4;
+        if (nlen > 286 || ndist > 30) return false;
+
+        uint8_t lengths[286 + 30] = {};
+        for (int i = 0; i < ncode; ++i) lengths[kOrder[i]] = Bits(3);
+        Huffman lencode, distcode;
+        if (!Build(&lencode, lengths, 19)) return false;
+
+        int index = 0;
+        while (index < nlen + ndist) {
+            int skip   = 0;
+            int symbol = Decode(lencode, Peek(bitpos_), &skip);
+            if (symbol < 0) return false;
+            bitpos_ += skip;
+            if (symbol < 16) {
+                lengths[index++] = symbol;
+                continue;
+            }
+            uint8_t len = 0;  // Repeated length.
+            if (symbol == 16) {
+                if (index == 0) return false;
+                len    = lengths[index - 1];
+                symbol = 3 + Bits(2);
+            }
+            else if (symbol == 17) {
+                symbol = 3 + Bits(3);
+            }
+            else {
+                symbol = 11 + Bits(7);
+            }
+            if (index + symbol > nlen + ndist) return false;
+            while (symbol--) lengths[index++] = len;
+        }
+        if (!Build(&lencode, lengths, nlen, kLengthExtra.bits) ||
+            !Build(&distcode, lengths + nlen, ndist, kDistanceExtra)) {
+            return false;
+        }
+        return SkipCodes(lencode, distcode);
+    }
+
+    const uint8_t *const data_;
+    const size_t len_;
+    size_t bitpos_ = 0;
+};
+
+// https://w3.org/TR/png/#9Filter-types
+static constexpr uint8_t kFilterType = 0x01;  // simplest substract filter
+
+// Filter rows [y_begin, y_end) into "out", return end of written data.
 template <bool with_alpha>
-static size_t EncodePNGInternal(const Framebuffer &fb, int compression_level,
-                                char *const buffer, size_t size) {
-    static constexpr uint8_t kFilterType = 0x01;  // simplest substract filter
+static uint8_t *FilterRows(const Framebuffer &fb, int y_begin, int y_end,
+                           uint8_t *out) {
+    constexpr int bytes_per_pixel = with_alpha ? 4 : 3;
+    const int width               = fb.width();
+    for (int y = y_begin; y < y_end; ++y) {
+        const rgba_t *const current_line = fb.row(y);
+        *out++ = kFilterType;
+        memcpy(out, current_line, sizeof(rgba_t));  // First pixel
+        out += bytes_per_pixel;
+        for (int i = 1; i < width; ++i) {
+            *out++ = current_line[i].r - current_line[i - 1].r;
+            *out++ = current_line[i].g - current_line[i - 1].g;
+            *out++ = current_line[i].b - current_line[i - 1].b;
+            if (with_alpha) *out++ = current_line[i].a - current_line[i - 1].a;
+        }
+    }
+    return out;
+}
+
+// Bytes of image data we compress in one stripe. Like pigz, we choose it
+// large enough that the compression ratio barely suffers from starting over
+// without history for every stripe.
+static constexpr size_t kStripeBytes = 256 << 10;
+
+// Bytes added to each stripe to join it to the next.
+static constexpr size_t kStripeJoinBytes = 5;
+
+// Bytes per row in the compressed stream; PNG starts each with a filter type.
+static size_t StreamRowBytes(int width, int bytes_per_pixel, bool filtered) {
+    return (size_t)width * bytes_per_pixel + (filtered ? 1 : 0);
+}
+
+static int RowsPerStripe(int width, int bytes_per_pixel, bool filtered) {
+    const size_t row_bytes = StreamRowBytes(width, bytes_per_pixel, filtered);
+    return std::max<size_t>(1, kStripeBytes / row_bytes);
+}
+
+// Unfiltered RGBA rows without padding can be compressed right from the
+// framebuffer; everything else is first written to a scratch buffer.
+template <bool with_alpha, bool filtered>
+static bool StreamRowsInPlace(const Framebuffer &fb) {
+    return with_alpha && !filtered &&
+           fb.stride()[0] == (int)sizeof(rgba_t) * fb.width();
+}
+
+// Return rows [y_begin, y_end) as they go into the compressed stream:
+// PNG-filtered or plain pixels. Written to "scratch" unless in place.
+template <bool with_alpha, bool filtered>
+static const uint8_t *StreamRows(const Framebuffer &fb, int y_begin, int y_end,
+                                 uint8_t *scratch) {
+    if (filtered) {
+        FilterRows<with_alpha>(fb, y_begin, y_end, scratch);
+        return scratch;
+    }
+    const int width     = fb.width();
+    const size_t stride = fb.stride()[0];
+    const uint8_t *row  = (const uint8_t *)fb.row(y_begin);
+    if (StreamRowsInPlace<with_alpha, filtered>(fb)) return row;
+    uint8_t *out = scratch;
+    for (int y = y_begin; y < y_end; ++y, row += stride) {
+        if (with_alpha) {
+            memcpy(out, row, width * sizeof(rgba_t));
+            out += width * sizeof(rgba_t);
+            continue;
+        }
+        const rgba_t *pixel = (const rgba_t *)row;
+        for (int i = 0; i < width; ++i, ++pixel) {
+            *out++ = pixel->r;
+            *out++ = pixel->g;
+            *out++ = pixel->b;
+        }
+    }
+    return scratch;
+}
+
+// Combine the Adler-32 "adler1" of a first and "adler2" of the following
+// "len2" bytes to the checksum of the sequence (as adler32_combine() in zlib)
+static uint32_t CombineAdler32(uint32_t adler1, uint32_t adler2, size_t len2) {
+    static constexpr uint32_t kBase = 65521;
+    const uint32_t rem              = len2 % kBase;
+    uint32_t sum1                   = adler1 & 0xffff;
+    uint32_t sum2                   = (uint64_t)rem * sum1 % kBase;
+    sum1 += (adler2 & 0xffff) + kBase - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + kBase - rem;
+    if (sum1 >= kBase) sum1 -= kBase;
+    if (sum1 >= kBase) sum1 -= kBase;
+    if (sum2 >= (kBase << 1)) sum2 -= (kBase << 1);
+    if (sum2 >= kBase) sum2 -= kBase;
+    return sum1 | (sum2 << 16);
+}
+
+// A raw deflate stream ends with a block marked final, and its last byte is
+// padded. To continue with the stream of the next stripe, clear the final
+// flag and append an empty non-final stored block, which ends byte-aligned.
+// Returns new size or 0 if the stream could not be read.
+static size_t MakeJoinable(uint8_t *stream, size_t size) {
+    size_t final_block_bit, end_bit;
+    DeflateScanner scanner(stream, size);
+    if (!scanner.FindFinalBlock(&final_block_bit, &end_bit)) return 0;
+    stream[final_block_bit / 8] &= ~(1 << (final_block_bit % 8));
+    // Block header (3 bits, all zero) either fits in the padding bits or
+    // needs another byte; then aligned LEN=0 and NLEN=~0.
+    size_t pos = (end_bit + 7) / 8;
+    if (8 * pos - end_bit < 3) stream[pos++] = 0x00;
+    stream[pos++] = 0x00;
+    stream[pos++] = 0x00;
+    stream[pos++] = 0xff;
+    stream[pos++] = 0xff;
+    return pos;
+}
+
+// A stripe of rows compressed as raw deflate stream that can be joined
+// with the following stripes to one zlib stream.
+struct Stripe {
+    std::unique_ptr<uint8_t[]> data;  // Compressed.
+    size_t size = 0;                  // 0 if compression failed.
+    size_t raw_size;
+    uint32_t adler;
+};
 
+// https://www.rfc-editor.org/rfc/rfc1950 Deflate with 32K window.
+static constexpr uint8_t kZlibHeader[] = {0x78, 0x9c};
+
+// Compress rows [y_begin, y_end) into "stripe"; unless "is_last", it is
+// made joinable with the next.
+template <bool with_alpha, bool filtered>
+static void CompressStripe(const Framebuffer &fb,
+                           libdeflate_compressor *compressor, int y_begin,
+                           int y_end, bool is_last, Stripe *stripe) {
+    constexpr int bytes_per_pixel = with_alpha ? 4 : 3;
+    const size_t row_bytes =
+        StreamRowBytes(fb.width(), bytes_per_pixel, filtered);
+    const size_t raw_size = (y_end - y_begin) * row_bytes;
+    std::unique_ptr<uint8_t[]> scratch;
+    if (!StreamRowsInPlace<with_alpha, filtered>(fb)) {
+        scratch.reset(new uint8_t[raw_size]);
+    }
+    const uint8_t *const raw =
+        StreamRows<with_alpha, filtered>(fb, y_begin, y_end, scratch.get());
+
+    const size_t bound =
+        libdeflate_deflate_compress_bound(compressor, raw_size) +
+        kStripeJoinBytes;
+    stripe->data.reset(new uint8_t[bound]);
+    stripe->size = libdeflate_deflate_compress(compressor, raw, raw_size,
+                                               stripe->data.get(), bound);
+    if (stripe->size && !is_last) {
+        stripe->size = MakeJoinable(stripe->data.get(), stripe->size);
+    }
+    stripe->raw_size = raw_size;
+    stripe->adler    = libdeflate_adler32(1, raw, raw_size);
+}
+
+// Compress stripes [first, first + stripes->size()) of "rows_per_stripe"
+// rows each, in parallel if a "pool" is given. Returns true on success.
+template <bool with_alpha, bool filtered>
+static bool CompressStripes(const Framebuffer &fb, int compression_level,
+                            ThreadPool *pool, int rows_per_stripe, int first,
+                            std::vector<Stripe> *stripes) {
+    const int height       = fb.height();
+    const int stripe_count = (height + rows_per_stripe - 1) / rows_per_stripe;
+    std::atomic<bool> success{true};
+    auto compress_range = [&](int begin, int end) {
+        libdeflate_compressor *const compressor =
+            libdeflate_alloc_compressor(compression_level);
+        for (int s = begin; s < end; ++s) {
+            const int y_begin = (first + s) * rows_per_stripe;
+            const int y_end   = std::min(height, y_begin + rows_per_stripe);
+            Stripe &stripe    = (*stripes)[s];
+            CompressStripe<with_alpha, filtered>(
+                fb, compressor, y_begin, y_end,
+                first + s == stripe_count - 1, &stripe);
+            if (!stripe.size) success = false;
+        }
+        libdeflate_free_compressor(compressor);
+    };
+    if (pool) {
+        pool->ParallelFor(0, stripes->size(), 1, compress_range);
+    }
+    else {
+        compress_range(0, stripes->size());
+    }
+    return success;
+}
+
+// Compress stripes in parallel and write them as one zlib stream to "out".
+// Returns bytes written or 0 if that was not possible.
+template <bool with_alpha, bool filtered>
+static size_t CompressStripesParallel(const Framebuffer &fb,
+                                      int compression_level, ThreadPool *pool,
+                                      uint8_t *out, size_t out_avail) {
+    constexpr int bytes_per_pixel = with_alpha ? 4 : 3;
+    const int height              = fb.height();
+    const int rows_per_stripe =
+        RowsPerStripe(fb.width(), bytes_per_pixel, filtered);
+    const int stripe_count = (height + rows_per_stripe - 1) / rows_per_stripe;
+
+    std::vector<Stripe> stripes(stripe_count);
+    if (!CompressStripes<with_alpha, filtered>(fb, compression_level, pool,
+                                               rows_per_stripe, 0, &stripes)) {
+        return 0;
+    }
+
+    size_t total = sizeof(kZlibHeader) + 4;
+    for (const Stripe &stripe : stripes) total += stripe.size;
+    if (total > out_avail) return 0;
+
+    uint8_t *pos = out;
+    memcpy(pos, kZlibHeader, sizeof(kZlibHeader));
+    pos += sizeof(kZlibHeader);
+    uint32_t adler = 1;
+    for (const Stripe &stripe : stripes) {
+        memcpy(pos, stripe.data.get(), stripe.size);
+        pos += stripe.size;
+        adler = CombineAdler32(adler, stripe.adler, stripe.raw_size);
+    }
+    const uint32_t adler_bigint = htonl(adler);
+    memcpy(pos, &adler_bigint, 4);
+    return total;
+}
+
+// Compress image rows into a zlib stream at "out" with at most "out_avail"
+// bytes. Returns bytes written.
+template <bool with_alpha, bool filtered>
+static size_t CompressRows(const Framebuffer &fb, int compression_level,
+                           ThreadPool *pool, uint8_t *out, size_t out_avail) {
+    constexpr int bytes_per_pixel = with_alpha ? 4 : 3;
+    const int width               = fb.width();
+    const int height              = fb.height();
+
+    // Large enough images are compressed in stripes in parallel; unless
+    // there is only one core, as this is a bit more work in total.
+    if (pool && std::thread::hardware_concurrency() > 1 &&
+        height > RowsPerStripe(width, bytes_per_pixel, filtered)) {
+        const size_t written_size =
+            CompressStripesParallel<with_alpha, filtered>(
+                fb, compression_level, pool, out, out_avail);
+        if (written_size) return written_size;
+    }
+
+    // TODO: to reduce allocation overhead in repeated calls, maybe ask
+    // the caller to provide a sufficiently large scratch buffer ?
+    const size_t raw_size =
+        height * StreamRowBytes(width, bytes_per_pixel, filtered);
+    std::unique_ptr<uint8_t[]> scratch;
+    if (!StreamRowsInPlace<with_alpha, filtered>(fb)) {
+        scratch.reset(new uint8_t[raw_size]);
+    }
+    const uint8_t *const raw =
+        StreamRows<with_alpha, filtered>(fb, 0, height, scratch.get());
+
+    libdeflate_compressor *const compressor =
+        libdeflate_alloc_compressor(compression_level);
+    const size_t written_size =
+        libdeflate_zlib_compress(compressor, raw, raw_size, out, out_avail);
+    libdeflate_free_compressor(compressor);
+    return written_size;
+}
+
+template <bool with_alpha>
+static size_t EncodePNGInternal(const Framebuffer &fb, int compression_level,
+                                ThreadPool *pool, char *const buffer,
+                                size_t size) {
     const int width  = fb.width();
     const int height = fb.height();
 
@@ -111,62 +629,151 @@ static size_t EncodePNGInternal(const Framebuffer &fb, int compression_level,
     block.writeByte(0);                   // filter method.
     block.writeByte(0);                   // interlace. None.
 
-    // Prepare data to be compressed.
-    // TODO: to reduce allocation overhead in repeated calls, maybe ask the
-    // caller to provide a sufficiently large scratch buffer ?
-    const size_t cbuffer_size =
-        width * height * sizeof(rgba_t) + height * sizeof(kFilterType);
-    uint8_t *const compress_buffer = new uint8_t[cbuffer_size];
-
-    constexpr int bytes_per_pixel = with_alpha ? 4 : 3;
-    const rgba_t *current_line    = fb.begin();
-    uint8_t *out                  = compress_buffer;
-    for (int y = 0; y < height; ++y, current_line += width) {
-        *out++ = kFilterType;
-        memcpy(out, current_line, sizeof(rgba_t));  // First pixel
-        out += bytes_per_pixel;
-        for (int i = 1; i < width; ++i) {
-            *out++ = current_line[i].r - current_line[i - 1].r;
-            *out++ = current_line[i].g - current_line[i - 1].g;
-            *out++ = current_line[i].b - current_line[i - 1].b;
-            if (with_alpha) *out++ = current_line[i].a - current_line[i - 1].a;
-        }
-    }
-
     // Write image IDAT data.
     uint8_t *const start_data = block.StartNextChunk("IDAT");
     const int compress_avail  = size - (start_data - (uint8_t *)buffer);
-    libdeflate_compressor *const compressor =
-        libdeflate_alloc_compressor(compression_level);
 
-    const size_t written_size = libdeflate_zlib_compress(
-        compressor, compress_buffer, out - compress_buffer,  //
-        start_data, compress_avail);
+    const size_t written_size = CompressRows<with_alpha, true>(
+        fb, compression_level, pool, start_data, compress_avail);
     block.updateWritten(written_size);
 
-    libdeflate_free_compressor(compressor);
-    delete[] compress_buffer;
-
     block.StartNextChunk("IEND");
     return block.Finalize() - (uint8_t *)buffer;
 }
+
+struct ChunkPiece {
+    const uint8_t *data;
+    size_t len;
+};
+
+// Write a PNG chunk whose data are the "pieces" in sequence, without
+// copying them together. Returns bytes written or 0 if "write" failed.
+static size_t WriteChunk(const char *chunk_type, const ChunkPiece *pieces,
+                         int count, const png::WriteFunction &write) {
+    size_t data_len = 0;
+    for (int i = 0; i < count; ++i) data_len += pieces[i].len;
+
+    uint8_t header[8];
+    const uint32_t bigint_len = htonl(data_len);
+    memcpy(header, &bigint_len, 4);
+    memcpy(header + 4, chunk_type, 4);
+    if (!write((const char *)header, sizeof(header))) return 0;
+    uint32_t crc = libdeflate_crc32(0, header + 4, 4);
+    for (int i = 0; i < count; ++i) {
+        if (pieces[i].len == 0) continue;
+        crc = libdeflate_crc32(crc, pieces[i].data, pieces[i].len);
+        if (!write((const char *)pieces[i].data, pieces[i].len)) return 0;
+    }
+    const uint32_t crc_bigint = htonl(crc);
+    if (!write((const char *)&crc_bigint, 4)) return 0;
+    return data_len + 12;
+}
+
+template <bool with_alpha>
+static size_t EncodePNGStreamInternal(const Framebuffer &fb,
+                                      int compression_level, ThreadPool *pool,
+                                      const png::WriteFunction &write) {
+    const int width  = fb.width();
+    const int height = fb.height();
+
+    uint8_t header[64];
+    memcpy(header, kPNGHeader, sizeof(kPNGHeader));
+    ChunkWriter block(header + sizeof(kPNGHeader));
+    block.StartNextChunk("IHDR");
+    block.writeInt(width);                // width
+    block.writeInt(height);               // height
+    block.writeByte(8);                   // bith depth
+    block.writeByte(with_alpha ? 6 : 2);  // PNG color type
+    block.writeByte(0);                   // compression type: deflate()
+    block.writeByte(0);                   // filter method.
+    block.writeByte(0);                   // interlace. None.
+    const size_t header_size = block.Finalize() - header;
+    if (!write((const char *)header, header_size)) return 0;
+    size_t total = header_size;
+
+    // The zlib stream is split into one IDAT chunk per stripe. Stripes are
+    // compressed in batches of one per thread; each batch is written before
+    // starting the next, so only that much is held at a time.
+    constexpr int bytes_per_pixel = with_alpha ? 4 : 3;
+    const int rows_per_stripe     = RowsPerStripe(width, bytes_per_pixel, true);
+    const int stripe_count = (height + rows_per_stripe - 1) / rows_per_stripe;
+    const bool parallel    = pool && std::thread::hardware_concurrency() > 1;
+    const int batch_size   = parallel ? std::max(1, pool->size()) : 1;
+    uint32_t adler         = 1;
+    std::vector<Stripe> stripes;
+    for (int first = 0; first < stripe_count; first += batch_size) {
+        stripes.clear();
+        stripes.resize(std::min(batch_size, stripe_count - first));
+        if (!CompressStripes<with_alpha, true>(
+                fb, compression_level, parallel ? pool : nullptr,
+                rows_per_stripe, first, &stripes)) {
+            return 0;
+        }
+        for (size_t i = 0; i < stripes.size(); ++i) {
+            const Stripe &stripe = stripes[i];
+            const int index      = first + i;
+            adler = CombineAdler32(adler, stripe.adler, stripe.raw_size);
+            const uint32_t adler_bigint = htonl(adler);
+            const ChunkPiece pieces[]   = {
+                {kZlibHeader, index == 0 ? sizeof(kZlibHeader) : 0},
+                {stripe.data.get(), stripe.size},
+                {(const uint8_t *)&adler_bigint,
+                 index == stripe_count - 1 ? (size_t)4 : 0},
+            };
+            const size_t written = WriteChunk("IDAT", pieces, 3, write);
+            if (!written) return 0;
+            total += written;
+        }
+    }
+
+    const size_t written = WriteChunk("IEND", nullptr, 0, write);
+    return written ? total + written : 0;
+}
 }  // namespace
 
 namespace png {
 size_t Encode(const Framebuffer &fb, int compression_level,
-              ColorEncoding encoding, char *buffer, size_t size) {
+              ColorEncoding encoding, char *buffer, size_t size,
+              ThreadPool *pool) {
+    if (encoding == ColorEncoding::kRGB_24) {
+        return EncodePNGInternal<false>(fb, compression_level, pool, buffer,
+                                        size);
+    }
+    return EncodePNGInternal<true>(fb, compression_level, pool, buffer, size);
+}
+
+size_t EncodeStream(const Framebuffer &fb, int compression_level,
+                    ColorEncoding encoding, const WriteFunction &write,
+                    ThreadPool *pool) {
     if (encoding == ColorEncoding::kRGB_24) {
-        return EncodePNGInternal<false>(fb, compression_level, buffer, size);
+        return EncodePNGStreamInternal<false>(fb, compression_level, pool,
+                                              write);
     }
-    return EncodePNGInternal<true>(fb, compression_level, buffer, size);
+    return EncodePNGStreamInternal<true>(fb, compression_level, pool, write);
+}
+
+size_t CompressPixels(const Framebuffer &fb, int compression_level,
+                      ColorEncoding encoding, char *buffer, size_t size,
+                      ThreadPool *pool) {
+    if (encoding == ColorEncoding::kRGB_24) {
+        return CompressRows<false, false>(fb, compression_level, pool,
+                                          (uint8_t *)buffer, size);
+    }
+    return CompressRows<true, false>(fb, compression_level, pool,
+                                     (uint8_t *)buffer, size);
 }
 
 size_t UpperBound(int width, int height) {
     static constexpr size_t kPNGHeaderOverhead = 128;  // reality about ~57
     const size_t image_data_size =
         width * height * sizeof(rgba_t) + height * 1 /*filter-per-row*/;
+
+    // Each stripe compressed separately is a bit of additional overhead.
+    static constexpr size_t kPerStripeOverhead = 64;
+    const int rows_per_stripe = RowsPerStripe(width, sizeof(rgba_t), true);
+    const size_t stripes = (height + rows_per_stripe - 1) / rows_per_stripe;
     return libdeflate_zlib_compress_bound(nullptr, image_data_size) +
-           kPNGHeaderOverhead;
+           kPNGHeaderOverhead + stripes * kPerStripeOverhead;
 }
 }  // namespace png
 }  // namespace timg
@@ -19,9 +19,11 @@
 // This implements a simple and fast PNG encoder https://w3.org/TR/png/
 
 #include <cstddef>
+#include <functional>
 
 namespace timg {
 class Framebuffer;
+class ThreadPool;
 
 namespace png {
 // Encode framebuffer as PNG into given buffer and return encoded size.
@@ -33,14 +35,38 @@ namespace png {
 // only 1 is ever needed (we want to be fast).
 //
 // The ColorEncoding enum requests if 24Bit RGB or full 32Bit RGBA is encoded.
+//
+// If a "pool" is given, larger images are split into horizontal stripes that
+// are filtered and compressed in parallel, then joined into one zlib stream.
 enum class ColorEncoding {
     kRGBA_32,
     kRGB_24,
 };
 size_t Encode(const Framebuffer &fb, int compression_level,
-              ColorEncoding encoding, char *buffer, size_t size);
+              ColorEncoding encoding, char *buffer, size_t size,
+              ThreadPool *pool = nullptr);
+
+// Receives encoded data in sequence; returns false to stop encoding.
+using WriteFunction = std::function<bool(const char *data, size_t len)>;
+
+// Encode framebuffer as PNG like Encode(), but instead of into a buffer of
+// worst-case size, hand the data to "write" in pieces as soon as they are
+// ready. The image data is compressed in horizontal stripes, each written
+// as its own IDAT chunk. Returns encoded size or 0 if stopped or failed.
+size_t EncodeStream(const Framebuffer &fb, int compression_level,
+                    ColorEncoding encoding, const WriteFunction &write,
+                    ThreadPool *pool = nullptr);
+
+// Compress the plain pixels of the framebuffer, row by row without PNG
+// filter or chunks, as zlib stream into buffer and return its size, or 0 if
+// it did not fit. This is what e.g. the kitty protocol accepts with o=z.
+// RGBA pixels are compressed right from the framebuffer without a copy.
+size_t CompressPixels(const Framebuffer &fb, int compression_level,
+                      ColorEncoding encoding, char *buffer, size_t size,
+                      ThreadPool *pool = nullptr);
 
 // Return estimate of maximum size needed to encode image of given size.
+// Also sufficient for CompressPixels().
 size_t UpperBound(int width, int height);
 
 }  // namespace png
@@ -0,0 +1,194 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "timg-trace.h"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "timg-time.h"
+#include "utils.h"
+
+namespace timg {
+namespace {
+// Events kept per thread; later ones are only counted, so tracing a long
+// animation does not grow memory without bound.
+constexpr size_t kMaxEventsPerThread = 1 << 18;
+
+struct TraceEvent {
+    const char *category;
+    const char *name;
+    int64_t start_ns;
+    int64_t end_ns;
+    uint64_t async_id;  // Non-zero for spans not bound to a thread.
+    std::string detail;
+};
+
+// Each thread records into its own buffer. The lock is essentially
+// uncontended, it is only needed to allow WriteJson() to read concurrently.
+struct ThreadEvents {
+    std::mutex lock;
+    int tid;
+    std::string name;
+    std::vector<TraceEvent> events;
+    int64_t dropped = 0;  // Events not kept as we were at the limit.
+};
+
+std::mutex registry_lock;
+// Deliberately leaked: threads might still record while we shut down.
+std::vector<ThreadEvents *> *const registry =
+    new std::vector<ThreadEvents *>();
+std::atomic<int64_t> trace_start_ns{0};
+
+ThreadEvents *GetThreadEvents() {
+    thread_local ThreadEvents *local_events = nullptr;
+    if (!local_events) {
+        local_events = new ThreadEvents();
+        std::lock_guard<std::mutex> l(registry_lock);
+        local_events->tid = (int)registry->size() + 1;
+        registry->push_back(local_events);
+    }
+    return local_events;
+}
+
+void AppendEvent(TraceEvent &&event) {
+    ThreadEvents *const thread_events = GetThreadEvents();
+    std::lock_guard<std::mutex> l(thread_events->lock);
+    if (thread_events->events.size() >= kMaxEventsPerThread) {
+        ++thread_events->dropped;
+        return;
+    }
+    thread_events->events.push_back(std::move(event));
+}
+
+// Chrome trace timestamps are in microseconds.
+double TraceMicros(int64_t ns) { return (ns - trace_start_ns) / 1000.0; }
+}  // namespace
+
+std::atomic<bool> Tracer::enabled_{false};
+
+void Tracer::Enable() {
+    {
+        std::lock_guard<std::mutex> l(registry_lock);
+        for (ThreadEvents *thread_events : *registry) {
+            std::lock_guard<std::mutex> tl(thread_events->lock);
+            thread_events->events.clear();
+            thread_events->dropped = 0;
+        }
+    }
+    trace_start_ns = Time::Now().nanoseconds();
+    enabled_.store(true, std::memory_order_relaxed);
+}
+
+void Tracer::SetThreadName(const char *name) {
+    if (!enabled()) return;
+    ThreadEvents *const thread_events = GetThreadEvents();
+    std::lock_guard<std::mutex> l(thread_events->lock);
+    thread_events->name = name;
+}
+
+void Tracer::AddSpan(const char *category, const char *name,
+                     const Time &start, const Time &end,
+                     const std::string &detail) {
+    if (!enabled()) return;
+    AddSpanNanos(category, name, start.nanoseconds(), end.nanoseconds(),
+                 detail);
+}
+
+void Tracer::AddSpanNanos(const char *category, const char *name,
+                          int64_t start_ns, int64_t end_ns,
+                          const std::string &detail) {
+    if (!enabled()) return;
+    AppendEvent({category, name, start_ns, end_ns, 0, detail});
+}
+
+void Tracer::AddAsyncSpan(const char *category, const char *name,
+                          uint64_t id, int64_t start_ns, int64_t end_ns) {
+    if (!enabled()) return;
+    AppendEvent({category, name, start_ns, end_ns, id, {}});
+}
+
+bool Tracer::WriteJson(const char *filename) {
+    FILE *out = fopen(filename, "w");
+    if (!out) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    const int pid = getpid();
+    fprintf(out, "{\"displayTimeUnit\": \"ms\",\n\"traceEvents\": [\n");
+    fprintf(out,
+            "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d, "
+            "\"args\": {\"name\": \"timg\"}}",
+            pid);
+    std::lock_guard<std::mutex> l(registry_lock);
+    for (ThreadEvents *thread_events : *registry) {
+        std::lock_guard<std::mutex> tl(thread_events->lock);
+        if (!thread_events->name.empty()) {
+            fprintf(out,
+                    ",\n{\"ph\": \"M\", \"name\": \"thread_name\", "
+                    "\"pid\": %d, \"tid\": %d, \"args\": {\"name\": ",
+                    pid, thread_events->tid);
+            fprintf(out, "%s}}", JsonQuote(thread_events->name).c_str());
+        }
+        for (const TraceEvent &e : thread_events->events) {
+            if (e.async_id) {
+                // Async begin/end pair.
+                for (const bool is_begin : {true, false}) {
+                    fprintf(out,
+                            ",\n{\"ph\": \"%s\", \"cat\": \"%s\", "
+                            "\"name\": \"%s\", \"id\": %" PRIu64
+                            ", \"ts\": %.3f, \"pid\": %d, \"tid\": %d}",
+                            is_begin ? "b" : "e", e.category, e.name,
+                            e.async_id,
+                            TraceMicros(is_begin ? e.start_ns : e.end_ns), pid,
+                            thread_events->tid);
+                }
+                continue;
+            }
+            fprintf(out,
+                    ",\n{\"ph\": \"X\", \"cat\": \"%s\", \"name\": \"%s\", "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d",
+                    e.category, e.name, TraceMicros(e.start_ns),
+                    (e.end_ns - e.start_ns) / 1000.0, pid, thread_events->tid);
+            if (!e.detail.empty()) {
+                fprintf(out, ", \"args\": {\"detail\": %s}",
+                        JsonQuote(e.detail).c_str());
+            }
+            fprintf(out, "}");
+        }
+        if (thread_events->dropped) {
+            // Mark where the recording of this thread stopped.
+            fprintf(out,
+                    ",\n{\"ph\": \"i\", \"s\": \"t\", "
+                    "\"name\": \"events dropped\", \"ts\": %.3f, "
+                    "\"pid\": %d, \"tid\": %d, "
+                    "\"args\": {\"count\": %" PRId64 "}}",
+                    TraceMicros(thread_events->events.back().end_ns), pid,
+                    thread_events->tid, thread_events->dropped);
+        }
+    }
+    fprintf(out, "\n]}\n");
+    return fclose(out) == 0;
+}
+}  // namespace timg
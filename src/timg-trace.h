@@ -0,0 +1,102 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2025 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_TRACE_H_
+#define TIMG_TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "timg-time.h"
+
+namespace timg {
+// Records timestamped spans of the processing stages (load, scale, encode,
+// write...) and writes them in the Chrome trace-event format, to be viewed
+// in chrome://tracing or https://ui.perfetto.dev/
+//
+// If not enabled, the cost of a span is a single relaxed atomic load. If
+// enabled, each span is appended to a buffer local to the recording thread,
+// so there is no contention between threads. The number of spans kept per
+// thread is limited; the output notes how many were dropped.
+//
+// Span names and categories are expected to be string literals, they are
+// not copied.
+class Tracer {
+public:
+    // Start recording. Spans recorded before are not kept.
+    static void Enable();
+
+    static bool enabled() {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    // Name the calling thread in the trace output.
+    static void SetThreadName(const char *name);
+
+    // Record a span that happened on the current thread. The "detail" is
+    // optional and shows up as argument in the trace viewer.
+    static void AddSpan(const char *category, const char *name,
+                        const Time &start, const Time &end,
+                        const std::string &detail = {});
+
+    // Record a span that is not bound to a thread, such as the time a
+    // buffer sits in a queue. These can overlap with each other; the "id"
+    // distinguishes them. Timestamps are in Time::nanoseconds().
+    static void AddAsyncSpan(const char *category, const char *name,
+                             uint64_t id, int64_t start_ns, int64_t end_ns);
+
+    // Lower level version of AddSpan() with timestamps given in
+    // Time::nanoseconds()
+    static void AddSpanNanos(const char *category, const char *name,
+                             int64_t start_ns, int64_t end_ns,
+                             const std::string &detail);
+
+    // Write all recorded events to file. Returns success.
+    static bool WriteJson(const char *filename);
+
+private:
+    static std::atomic<bool> enabled_;
+};
+
+// Records a span from construction to destruction if tracing is enabled.
+class TraceSpan {
+public:
+    TraceSpan(const char *category, const char *name)
+        : category_(category), name_(name), active_(Tracer::enabled()) {
+        if (active_) start_ns_ = Time::Now().nanoseconds();
+    }
+
+    // Only build the detail string when tracing; use as e.g.
+    //   if (span.active()) span.set_detail(filename);
+    bool active() const { return active_; }
+    void set_detail(const std::string &detail) { detail_ = detail; }
+
+    ~TraceSpan() {
+        if (!active_) return;
+        Tracer::AddSpanNanos(category_, name_, start_ns_,
+                             Time::Now().nanoseconds(), detail_);
+    }
+
+private:
+    const char *const category_;
+    const char *const name_;
+    const bool active_;
+    int64_t start_ns_ = 0;
+    std::string detail_;
+};
+}  // namespace timg
+
+#endif  // TIMG_TRACE_H_
@@ -25,6 +25,9 @@
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
+#include "file-list.h"
+#include "frame-cache.h"
+#include "image-loader.h"
 #include "image-source.h"
 #include "iterm2-canvas.h"
 #include "kitty-canvas.h"
@@ -32,9 +35,12 @@
 #include "term-query.h"
 #include "terminal-canvas.h"
 #include "thread-pool.h"
+#include "timg-cancel.h"
 #include "timg-help.h"
+#include "timg-memory.h"
 #include "timg-print-version.h"
 #include "timg-time.h"
+#include "timg-trace.h"
 #include "unicode-block-canvas.h"
 #include "utils.h"
 
@@ -132,6 +138,18 @@ struct PresentationOptions {
     bool terminal_use_upper_block = false;
     bool use_256_color = false;  // For terminals that don't do 24 bit color
 
+    // How to get the pixels to a kitty terminal.
+    KittyTransmission kitty_transmission = KittyTransmission::kDirect;
+
+    // If the kitty terminal can loop animations by itself.
+    bool kitty_animation = false;
+
+    // If the kitty terminal should place images shown before again.
+    bool kitty_reuse_images = false;
+
+    // If the iTerm2 terminal accepts images sent in parts.
+    bool iterm2_multipart = false;
+
     // Arrangement
     int grid_cols = 1;  // Grid arrangement
     int grid_rows = 1;
@@ -146,8 +164,15 @@ struct PresentationOptions {
 };
 }  // namespace timg
 
-// Image sources; as future as they are being filled while we start presenting
-typedef std::vector<std::future<timg::ImageSource *>> LoadedImageSources;
+// Load the image source of a file with the given options; nullptr on failure
+// or if cancelled.
+typedef std::function<timg::ImageSource *(const timg::DisplayOptions &,
+                                          const std::string &,
+                                          const timg::CancellationToken &)>
+    LoadImageFun;
+
+// Collect an error message to be shown after the image output.
+typedef std::function<void(const std::string &)> ReportErrorFun;
 
 // Use most cores that are available.
 static const int kDefaultThreadCount =
@@ -249,12 +274,26 @@ static int usage(const char *progname, ExitCode exit_code, int width,
         "\t-E             : Don't hide the cursor while showing images.\n"
         "\t--compress[=level]: Only for -pk or -pi: Compress image data. More\n"
         "\t                 CPU use, but less used bandwidth. (default: 1)\n"
+        "\t--reuse-images : Only for -pk: Place images shown before again\n"
+        "\t                 instead of sending them again.\n"
         "\t--threads=<n>  : Run image decoding in parallel with n threads\n"
         "\t                 (Default %d, 3/4 #cores on this machine)\n"
+        "\t--read-ahead=<num>[:<MiB>]: Load up to num images ahead while\n"
+        "\t                 showing, using at most MiB memory (default:\n"
+        "\t                 2 * threads and 1/4 of available memory).\n"
+        "\t--cache[=<dir>]: Keep scaled still images in a cache to show them\n"
+        "\t                 faster next time (default: ~/.cache/timg).\n"
         "\t--color8       : Choose 8 bit color mode for -ph or -pq\n"
         "\t--version      : Print detailed version including used libraries.\n"
         "\t                 (%s)\n"
         "\t--verbose      : Print some terminal query info and stats.\n"
+        "\t--trace=<file> : Write timing of processing stages to <file> in\n"
+        "\t                 Chrome trace-event format (chrome://tracing).\n"
+        "\t--stats-json=<file> : Write statistics of output timing and\n"
+        "\t                 queueing to <file> in JSON format at exit.\n"
+        "\t--benchmark    : Show images as fast as possible to /dev/null (or\n"
+        "\t                 -o file) with each pixelation (or the one chosen\n"
+        "\t                 with -p) and print throughput and latency stats.\n"
         "\t-h             : Print this help and exit.\n"
         "\t--help         : Page through detailed manpage-like help and exit.\n"
 
@@ -274,6 +313,9 @@ static int usage(const char *progname, ExitCode exit_code, int width,
         "\t--frames=<num>: Only show first num frames (if looping, loop only "
         "these)\n"
         "\t--frame-offset=<num>: Start animation/video at this frame\n"
+        "\t--frame-memory=<MiB>: Memory to keep animation frames in; "
+        "frames\n"
+        "\t                beyond are decoded again. Default: unlimited.\n"
         "\t-t<seconds>   : Stop after this time, independent of --loops or "
         "--frames\n",
         default_title ? "='" : "", default_title ? default_title : "",
@@ -282,65 +324,39 @@ static int usage(const char *progname, ExitCode exit_code, int width,
     return (int)exit_code;
 }
 
-// Read list of filenames from newline separated file.
-// Non-absolute files are resolved relative to the filelist_file or
-// relative to currnet working directory.
-bool AppendToFileList(const std::string &filelist_file,
-                      bool consider_relative_to_filelist,
-                      std::vector<std::string> *filelist) {
-    std::ifstream filelist_stream(
-        filelist_file == "-" ? "/dev/stdin" : filelist_file, std::ifstream::in);
-    if (!filelist_stream) {
-        fprintf(stderr, "%s: %s\n", filelist_file.c_str(), strerror(errno));
-        return false;
-    }
-    const size_t last_slash = filelist_file.find_last_of('/');
-    // Following works as expected if last_slash == npos (lsat_slash+1 == 0)
-    const std::string prefix = filelist_file.substr(0, last_slash + 1);
-    for (std::string filename; std::getline(filelist_stream, filename); /**/) {
-        if (filename.empty()) continue;
-        if (consider_relative_to_filelist &&  //
-            filename[0] != '/' && !prefix.empty()) {
-            filename.insert(0, prefix);
-        }
-        filelist->push_back(filename);
-    }
-    return true;
-}
-
-static int PresentImages(LoadedImageSources *loaded_sources,
+// Show the images from the "loader". Canvas encoding runs in the same
+// "pool" the images are loaded in.
+static int PresentImages(timg::ImageLoader *loader, timg::ThreadPool *pool,
                          const timg::DisplayOptions &display_opts,
                          const timg::PresentationOptions &present,
                          timg::BufferedWriteSequencer *sequencer,
-                         bool *any_animations_seen) {
-    using timg::ThreadPool;
-    std::unique_ptr<ThreadPool> compression_pool;
+                         bool *any_animations_seen,
+                         const ReportErrorFun &report_error) {
     std::unique_ptr<TerminalCanvas> canvas;
     switch (present.pixelation) {
     case Pixelation::kKittyGraphics:
-        compression_pool.reset(new ThreadPool(sequencer->max_queue_len() + 1));
-        canvas.reset(new KittyGraphicsCanvas(sequencer, compression_pool.get(),
+        canvas.reset(new KittyGraphicsCanvas(sequencer, pool,
                                              present.tmux_workaround,
+                                             present.kitty_transmission,
+                                             present.kitty_animation,
+                                             present.kitty_reuse_images,
                                              display_opts));
         break;
     case Pixelation::kiTerm2Graphics:
-        compression_pool.reset(new ThreadPool(sequencer->max_queue_len() + 1));
-        canvas.reset(new ITerm2GraphicsCanvas(sequencer, compression_pool.get(),
-                                              display_opts));
+        canvas.reset(new ITerm2GraphicsCanvas(
+            sequencer, pool, present.iterm2_multipart, display_opts));
         break;
 #ifdef WITH_TIMG_SIXEL
     case Pixelation::kSixelGraphics:
-        compression_pool.reset(new ThreadPool(sequencer->max_queue_len() + 1));
-        canvas.reset(new timg::SixelCanvas(sequencer, compression_pool.get(),
-                                           present.sixel_options,
-                                           display_opts));
+        canvas.reset(new timg::SixelCanvas(
+            sequencer, pool, present.sixel_options, display_opts));
         break;
 #endif
     case Pixelation::kHalfBlock:
     case Pixelation::kQuarterBlock:
     case Pixelation::kNotChosen:  // Should not happen.
         canvas.reset(new UnicodeBlockCanvas(
-            sequencer, present.pixelation == Pixelation::kQuarterBlock,
+            sequencer, pool, present.pixelation == Pixelation::kQuarterBlock,
             present.terminal_use_upper_block, present.use_256_color));
     }
 
@@ -376,9 +392,8 @@ static int PresentImages(LoadedImageSources *loaded_sources,
     // Showing them in order of files on the command line.
     bool is_first    = true;
     int valid_images = 0;
-    for (auto &source_future : *loaded_sources) {
-        if (interrupt_received) break;
-        std::unique_ptr<timg::ImageSource> source(source_future.get());
+    std::unique_ptr<timg::ImageSource> source;
+    while (!interrupt_received && loader->Next(&source)) {
         if (!source) continue;
         valid_images++;
         *any_animations_seen |= source->IsAnimationBeforeFrameLimit();
@@ -388,6 +403,7 @@ static int PresentImages(LoadedImageSources *loaded_sources,
                            renderer->render_cb(
                                source->FormatTitle(display_opts.title_format)));
         after_image_show();
+        for (const std::string &err : source->TakeErrors()) report_error(err);
         renderer->MaybeWaitBetweenImageSources();
         is_first = false;
     }
@@ -423,6 +439,149 @@ static const char *PixelationToString(Pixelation p) {
     return "";  // Make compiler happy.
 }
 
+// Memory accounts that have been used, sorted by peak use, largest first.
+static std::vector<std::shared_ptr<const timg::MemoryAccount>>
+UsedMemoryAccountsByPeak() {
+    auto accounts = timg::MemoryAccount::All();
+    accounts.erase(std::remove_if(accounts.begin(), accounts.end(),
+                                  [](const auto &a) { return a->peak() == 0; }),
+                   accounts.end());
+    std::stable_sort(accounts.begin(), accounts.end(),
+                     [](const auto &a, const auto &b) {
+                         return a->peak() > b->peak();
+                     });
+    return accounts;
+}
+
+// Write statistics about the run to "filename" in JSON format, to be
+// consumed by scripts.
+static bool WriteStatsJson(const char *filename, int file_count,
+                           int successful_images, const Duration &duration,
+                           const timg::BufferedWriteSequencer &sequencer) {
+    FILE *out = fopen(filename, "w");
+    if (!out) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    fprintf(out,
+            "{\n  \"files\": %d,\n  \"successful_images\": %d,\n"
+            "  \"duration_ms\": %.1f,\n",
+            file_count, successful_images, duration.nanoseconds() / 1e6);
+    fprintf(out,
+            "  \"write_sequencer\": {\n"
+            "    \"max_queue_len\": %d,\n"
+            "    \"bytes_total\": %" PRId64 ",\n"
+            "    \"bytes_skipped\": %" PRId64 ",\n"
+            "    \"frames_total\": %" PRId64 ",\n"
+            "    \"frames_skipped\": %" PRId64,
+            (int)sequencer.max_queue_len(), sequencer.bytes_total(),
+            sequencer.bytes_skipped(), sequencer.frames_total(),
+            sequencer.frames_skipped());
+    const auto h = sequencer.histograms();
+    const std::pair<const char *, const timg::Histogram *> histograms[] = {
+        {"queue_depth",        &h.queue_depth       },
+        {"enqueue_blocked_ns", &h.enqueue_blocked_ns},
+        {"buffer_wait_ns",     &h.buffer_wait_ns    },
+        {"lateness_ns",        &h.lateness_ns       },
+        {"encode_ns",          &h.encode_ns         },
+        {"frame_write_ns",     &h.frame_write_ns    },
+        {"write_call_ns",      &h.write_call_ns     },
+        {"write_call_bytes",   &h.write_call_bytes  },
+    };
+    for (const auto &[name, histogram] : histograms) {
+        fprintf(out, ",\n    \"%s\": ", name);
+        histogram->WriteJson(out);
+    }
+    fprintf(out, "\n  },\n");
+
+    fprintf(out,
+            "  \"memory\": {\n    \"peak_rss_bytes\": %" PRId64
+            ",\n    \"accounts\": [",
+            timg::PeakResidentSetBytes());
+    const char *separator = "\n";
+    for (const auto &account : UsedMemoryAccountsByPeak()) {
+        fprintf(out,
+                "%s      {\"name\": %s, \"peak_bytes\": %" PRId64
+                ", \"current_bytes\": %" PRId64 "}",
+                separator, timg::JsonQuote(account->name()).c_str(),
+                account->peak(), account->current());
+        separator = ",\n";
+    }
+    fprintf(out, "\n    ]\n  }\n}\n");
+    return fclose(out) == 0;
+}
+
+// Show all images with each of the given pixelations as fast as possible
+// on the given output and report throughput and latency per pixelation.
+//
+// The "configure" callback adapts display options to the pixelation, the
+// "load" callback loads each of the "filenames" with these options in "pool".
+static ExitCode RunBenchmark(
+    const std::vector<Pixelation> &pixelations,
+    const timg::DisplayOptions &display_opts,
+    const timg::PresentationOptions &present, int output_fd,
+    const std::function<void(Pixelation, timg::DisplayOptions *)> &configure,
+    const std::vector<std::string> &filenames, timg::ThreadPool *pool,
+    const LoadImageFun &load, const ReportErrorFun &report_error) {
+    using timg::HumanReadableByteValue;
+    static constexpr int kAsyncWriteQueueSize = 4;
+    const auto ms = [](int64_t ns) { return ns / 1e6; };
+
+    printf("%-16s %7s %9s %8s %9s %23s %23s\n", "pixelation", "frames",
+           "load-ms", "fps", "bytes/fr", "encode-ms p50/p95/p99",
+           "write-ms p50/p95/p99");
+    ExitCode result = ExitCode::kSuccess;
+    for (const Pixelation pixelation : pixelations) {
+        if (interrupt_received) break;
+        timg::DisplayOptions bench_display_opts = display_opts;
+        timg::PresentationOptions bench_present = present;
+        bench_present.pixelation                = pixelation;
+        configure(pixelation, &bench_display_opts);
+
+        // Only measure presenting; make sure all images are loaded first.
+        const Time load_start = Time::Now();
+        timg::FileList files;
+        for (const std::string &filename : filenames) files.Add(filename);
+        timg::ImageLoader loader(
+            pool, &files,
+            [&](const std::string &filename,
+                const timg::CancellationToken &cancel) {
+                return load(bench_display_opts, filename, cancel);
+            },
+            filenames.size(), 0, interrupt_received);
+        loader.WaitForReadAhead();
+        const Duration load_time = Time::Now() - load_start;
+
+        timg::BufferedWriteSequencer sequencer(output_fd, false,
+                                               kAsyncWriteQueueSize, true,
+                                               interrupt_received);
+        bool any_animations_seen = false;
+        const Time start         = Time::Now();
+        const int successful_images =
+            PresentImages(&loader, pool, bench_display_opts, bench_present,
+                          &sequencer, &any_animations_seen, report_error);
+        const Duration duration = Time::Now() - start;
+        if (successful_images == 0) result = ExitCode::kImageReadError;
+
+        const int64_t frames             = sequencer.frames_total();
+        const auto histograms            = sequencer.histograms();
+        const timg::Histogram &encode_ns = histograms.encode_ns;
+        const timg::Histogram &write_ns  = histograms.frame_write_ns;
+        printf("%-16s %7" PRId64 " %9.1f %8.1f %9s %7.2f/%7.2f/%7.2f "
+               "%7.2f/%7.2f/%7.2f\n",
+               PixelationToString(pixelation), frames,
+               ms(load_time.nanoseconds()), frames / duration,
+               HumanReadableByteValue(frames ? sequencer.bytes_total() / frames
+                                             : 0)
+                   .c_str(),
+               ms(encode_ns.Percentile(50)), ms(encode_ns.Percentile(95)),
+               ms(encode_ns.Percentile(99)), ms(write_ns.Percentile(50)),
+               ms(write_ns.Percentile(95)), ms(write_ns.Percentile(99)));
+        fflush(stdout);
+    }
+    return result;
+}
+
 int main(int argc, char *argv[]) {
 #ifdef WITH_TIMG_GRPAPHICSMAGICK
     Magick::InitializeMagick(*argv);
@@ -442,15 +601,20 @@ int main(int argc, char *argv[]) {
         timg::GetBoolenEnv("TIMG_ALLOW_FRAME_SKIP");
 
     int output_fd = STDOUT_FILENO;
-    std::vector<std::string> filelist;  // from -f<filelist> and command line
+    timg::FileList filelist;  // from -f<filelist> and command line
     int frame_offset          = 0;
     int max_frames            = timg::kNotInitialized;
     bool do_img_loading       = true;
     bool do_vid_loading       = true;
     int thread_count          = kDefaultThreadCount;
+    int read_ahead            = 0;   // Images to load ahead; 0: default.
+    int64_t read_ahead_bytes  = -1;  // Memory for these; -1: default.
     int geometry_width        = (term.cols - 2);
     int geometry_height       = (term.rows - 2);
     bool debug_no_frame_delay = false;
+    const char *trace_file    = nullptr;
+    const char *stats_file    = nullptr;
+    bool benchmark            = false;
 
     if (auto pixelation_from_env = ParsePixelation(getenv("TIMG_PIXELATION"));
         pixelation_from_env.has_value()) {
@@ -478,6 +642,7 @@ int main(int argc, char *argv[]) {
         OPT_NO_FRAME_DELAY,
         OPT_FRAME_COUNT,
         OPT_FRAME_OFFSET,
+        OPT_FRAME_MEMORY,
         OPT_GRID,
         OPT_PATTERN_SIZE,
         OPT_ROTATE,
@@ -488,18 +653,27 @@ int main(int argc, char *argv[]) {
         OPT_MANPAGE_HELP,
         OPT_AUTO_CROP,
         OPT_SCROLL,
+        OPT_TRACE,
+        OPT_BENCHMARK,
+        OPT_STATS_JSON,
+        OPT_CACHE,
+        OPT_READ_AHEAD,
+        OPT_REUSE_IMAGES,
     };
 
     // Flags with optional parameters need to be long-options, as on MacOS,
     // there is no way to have single-character options with
     static constexpr struct option long_options[] = {
         {"auto-crop",            optional_argument, NULL, OPT_AUTO_CROP     },
+        {"benchmark",            no_argument,       NULL, OPT_BENCHMARK     },
+        {"cache",                optional_argument, NULL, OPT_CACHE         },
         {"center",               no_argument,       NULL, 'C'               },
         {"clear",                optional_argument, NULL, OPT_CLEAR_SCREEN  },
         {"color8",               no_argument,       NULL, OPT_COLOR_256     },
         {"compress",             optional_argument, NULL, OPT_COMPRESS_PIXEL},
         {"delta-move",           required_argument, NULL, 'd'               },
         {"debug-no-frame-delay", no_argument,       NULL, OPT_NO_FRAME_DELAY},
+        {"frame-memory",         required_argument, NULL, OPT_FRAME_MEMORY  },
         {"frame-offset",         required_argument, NULL, OPT_FRAME_OFFSET  },
         {"fit-width",            no_argument,       NULL, 'W'               },
         {"frames",               required_argument, NULL, OPT_FRAME_COUNT   },
@@ -508,10 +682,14 @@ int main(int argc, char *argv[]) {
         {"loops",                optional_argument, NULL, 'c'               },
         {"pattern-size",         required_argument, NULL, OPT_PATTERN_SIZE  },
         {"pixelation",           required_argument, NULL, 'p'               },
+        {"read-ahead",           required_argument, NULL, OPT_READ_AHEAD    },
+        {"reuse-images",         no_argument,       NULL, OPT_REUSE_IMAGES  },
         {"rotate",               required_argument, NULL, OPT_ROTATE        },
         {"scroll",               optional_argument, NULL, OPT_SCROLL        },
+        {"stats-json",           required_argument, NULL, OPT_STATS_JSON    },
         {"threads",              required_argument, NULL, OPT_THREADS       },
         {"title",                optional_argument, NULL, OPT_TITLE         },
+        {"trace",                required_argument, NULL, OPT_TRACE         },
         {"upscale",              optional_argument, NULL, 'U'               },
         {"verbose",              no_argument,       NULL, OPT_VERBOSE       },
         {"version",              no_argument,       NULL, OPT_VERSION       },
@@ -576,6 +754,9 @@ int main(int argc, char *argv[]) {
             break;
         case OPT_FRAME_OFFSET: frame_offset = atoi(optarg); break;
         case OPT_FRAME_COUNT: max_frames = atoi(optarg); break;
+        case OPT_FRAME_MEMORY:
+            display_opts.frame_memory_budget = (int64_t)atoi(optarg) << 20;
+            break;
         case 'a': display_opts.antialias = false; break;
         case 'b': bg_color = std::string(optarg); break;
         case 'B': bg_pattern_color = strdup(optarg); break;
@@ -656,7 +837,7 @@ int main(int argc, char *argv[]) {
             }
             break;
         case 'F':
-            if (!AppendToFileList(optarg, true, &filelist)) {
+            if (!filelist.AddFromFile(optarg, true)) {
                 return usage(argv[0], ExitCode::kFilelistProblem,
                              geometry_width, geometry_height);
             }
@@ -677,7 +858,7 @@ int main(int argc, char *argv[]) {
             }
             break;
         case 'f':
-            if (!AppendToFileList(optarg, false, &filelist)) {
+            if (!filelist.AddFromFile(optarg, false)) {
                 return usage(argv[0], ExitCode::kFilelistProblem,
                              geometry_width, geometry_height);
             }
@@ -704,6 +885,24 @@ int main(int argc, char *argv[]) {
         case OPT_COLOR_256: present.use_256_color = true; break;
         case OPT_VERBOSE: verbose = true; break;
         case OPT_NO_FRAME_DELAY: debug_no_frame_delay = true; break;
+        case OPT_TRACE: trace_file = optarg; break;
+        case OPT_BENCHMARK: benchmark = true; break;
+        case OPT_STATS_JSON: stats_file = optarg; break;
+        case OPT_READ_AHEAD: {
+            int mib = -1;
+            if (sscanf(optarg, "%d:%d", &read_ahead, &mib) < 1) {
+                fprintf(stderr, "--read-ahead: expected <num>[:<MiB>]\n");
+                return usage(argv[0], ExitCode::kParameterError,
+                             geometry_width, geometry_height);
+            }
+            if (mib >= 0) read_ahead_bytes = (int64_t)mib << 20;
+            break;
+        }
+        case OPT_REUSE_IMAGES: present.kitty_reuse_images = true; break;
+        case OPT_CACHE:
+            display_opts.cache_dir =
+                optarg ? optarg : timg::FrameCache::DefaultDirectory();
+            break;
         case OPT_MANPAGE_HELP:
             InvokeHelpPager();
             return 0;
@@ -717,6 +916,30 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (trace_file) {
+        timg::Tracer::Enable();
+        timg::Tracer::SetThreadName("main");
+    }
+
+    // Unless a particular pixelation is requested, benchmark all of them.
+    // The terminal is not involved in a benchmark, so no need to query it.
+    std::vector<Pixelation> benchmark_pixelations;
+    if (benchmark) {
+        if (present.pixelation == Pixelation::kNotChosen) {
+            benchmark_pixelations = {
+                Pixelation::kHalfBlock, Pixelation::kQuarterBlock,
+                Pixelation::kKittyGraphics, Pixelation::kiTerm2Graphics,
+#ifdef WITH_TIMG_SIXEL
+                Pixelation::kSixelGraphics,
+#endif
+            };
+            present.pixelation = Pixelation::kQuarterBlock;
+        }
+        else {
+            benchmark_pixelations = {present.pixelation};
+        }
+    }
+
     timg::EnableTerminalQueryLogging(verbose);
     if (verbose) {
         // Called this earlier, but now that verbose enabled, again for logging
@@ -756,9 +979,6 @@ int main(int argc, char *argv[]) {
         // Also apparently termux (Issue #86)
         cell_size_warning_needed = (present.grid_cols > 1);
         max_frames = 1;  // Since don't know how many cells move up next frame
-        // We need a cell size to have something to scale the image into.
-        display_opts.cell_x_px = 9;  // Make up some typical values.
-        display_opts.cell_y_px = 18;
         // hterm does _not_ support PNM, always convert to PNG.
         display_opts.compress_pixel_level = 1;
         // Because we don't know how much to move up and right. Also, hterm
@@ -772,6 +992,7 @@ int main(int argc, char *argv[]) {
         if (term.font_width_px > 0 && term.font_height_px > 0) {
             const auto graphics_info = timg::QuerySupportedGraphicsProtocol();
             present.tmux_workaround  = graphics_info.in_tmux;
+            present.iterm2_multipart = graphics_info.iterm2_multipart;
             switch (graphics_info.preferred_graphics) {
             case timg::GraphicsProtocol::kIterm2:
                 present.pixelation = Pixelation::kiTerm2Graphics;
@@ -805,6 +1026,26 @@ int main(int argc, char *argv[]) {
     }
 #endif
 
+    // A kitty terminal on the same host can read the pixels from shared
+    // memory or temporary files, which saves compressing and encoding them.
+    // Only useful if we actually write to the terminal.
+    if (present.pixelation == Pixelation::kKittyGraphics &&
+        !present.tmux_workaround && !benchmark && isatty(output_fd)) {
+        present.kitty_transmission = timg::QueryKittyTransmission();
+        // With all frames uploaded once, the terminal can loop animations
+        // by itself. Not if frames can be skipped, as then the terminal
+        // would miss some.
+        present.kitty_animation =
+            !display_opts.allow_frame_skipping && timg::QueryKittyAnimation();
+        // Placing images again by ID is not reliable in all terminals that
+        // speak the kitty protocol; only if the terminal confirms it.
+        present.kitty_reuse_images =
+            present.kitty_reuse_images && timg::QueryKittyPlacement();
+    }
+    else {
+        present.kitty_reuse_images = false;
+    }
+
     // The high-res image terminals provide alpha-blending, no need to
     // query the terminal color for 'auto'
     if (is_pixel_direct_with_alpha(present.pixelation) &&
@@ -819,45 +1060,61 @@ int main(int argc, char *argv[]) {
         display_opts.local_alpha_handling = false;
     }
 
-    // If we're using block graphics, we might need to adapt the aspect ratio
-    // slightly depending if the font-cell has a 1:2 ratio.
-    // Terminals using direct pixels don't need this.
-    const float stretch_correct =
-        is_pixel_direct_p(present.pixelation)
-            ? 1.0f
-            : 0.5f * term.font_height_px / term.font_width_px;
-    display_opts.width_stretch =
-        timg::GetFloatEnv("TIMG_FONT_WIDTH_CORRECT", stretch_correct);
-
-    switch (present.pixelation) {
-    case Pixelation::kHalfBlock:
-        display_opts.cell_x_px = 1;
-        display_opts.cell_y_px = 2;
-        break;
-    case Pixelation::kQuarterBlock:
-        display_opts.width_stretch *= 2;
-        display_opts.cell_x_px = 2;
-        display_opts.cell_y_px = 2;
-        break;
+    // Choose the pixel geometry of the images depending on the pixelation.
+    // This is a function as the benchmark needs to do this for each of them.
+    const auto configure_geometry = [&](Pixelation pixelation,
+                                        timg::DisplayOptions *opts) {
+        // If we're using block graphics, we might need to adapt the aspect
+        // ratio slightly depending if the font-cell has a 1:2 ratio.
+        // Terminals using direct pixels don't need this.
+        const float stretch_correct =
+            is_pixel_direct_p(pixelation)
+                ? 1.0f
+                : 0.5f * term.font_height_px / term.font_width_px;
+        opts->width_stretch =
+            timg::GetFloatEnv("TIMG_FONT_WIDTH_CORRECT", stretch_correct);
+
+        switch (pixelation) {
+        case Pixelation::kHalfBlock:
+            opts->cell_x_px = 1;
+            opts->cell_y_px = 2;
+            break;
+        case Pixelation::kQuarterBlock:
+            opts->width_stretch *= 2;
+            opts->cell_x_px = 2;
+            opts->cell_y_px = 2;
+            break;
 #ifdef WITH_TIMG_SIXEL
-    case Pixelation::kSixelGraphics:
+        case Pixelation::kSixelGraphics:
 #endif
-    case Pixelation::kKittyGraphics:
-    case Pixelation::kiTerm2Graphics:
-        if (term.font_width_px > 0) display_opts.cell_x_px = term.font_width_px;
-        if (term.font_height_px > 0)
-            display_opts.cell_y_px = term.font_height_px;
-        break;
-    case Pixelation::kNotChosen: break;  // Should not happen. Was set above.
-    }
-    display_opts.width  = geometry_width * display_opts.cell_x_px;
-    display_opts.height = geometry_height * display_opts.cell_y_px;
+        case Pixelation::kKittyGraphics:
+        case Pixelation::kiTerm2Graphics:
+            // If the cell size is unknown, use made-up typical values.
+            opts->cell_x_px = term.font_width_px > 0 ? term.font_width_px : 9;
+            opts->cell_y_px = term.font_height_px > 0 ? term.font_height_px
+                                                      : 18;
+            break;
+        case Pixelation::kNotChosen: break;  // Should not happen.
+        }
+        opts->width  = geometry_width * opts->cell_x_px;
+        opts->height = geometry_height * opts->cell_y_px;
+
+        if (opts->show_title) {
+            // Leave space for text.
+            opts->height -= opts->cell_y_px * present.grid_rows;
+        }
+
+        // In a grid, we have less space per picture.
+        opts->width /= present.grid_cols;
+        opts->height /= present.grid_rows;
+    };
+    configure_geometry(present.pixelation, &display_opts);
 
     for (int imgarg = optind; imgarg < argc && !interrupt_received; ++imgarg) {
-        filelist.push_back(argv[imgarg]);
+        filelist.Add(argv[imgarg]);
     }
 
-    if (filelist.empty()) {
+    if (filelist.LookAhead(1) == 0) {
         fprintf(stderr,
                 "Expected image filename(s) on command line "
                 "or via -f\n");
@@ -894,24 +1151,27 @@ int main(int argc, char *argv[]) {
 
     // If nothing is set to limit animations but we have multiple images,
     // set some sensible limit.
-    if (filelist.size() > 1 && present.loops == timg::kNotInitialized &&
+    if (filelist.LookAhead(2) > 1 &&
+        present.loops == timg::kNotInitialized &&
         present.duration_per_image == Duration::InfiniteFuture()) {
         present.loops = 1;  // Don't get stuck on the first endless-loop
     }
 
-    if (display_opts.show_title) {
-        // Leave space for text.
-        display_opts.height -= display_opts.cell_y_px * present.grid_rows;
-    }
-
-    // Asynconrous image loading (filelist.size()) and terminal query (+1)
     thread_count = (thread_count > 0 ? thread_count : kDefaultThreadCount);
 
+    // One pool, sized to the machine, for the terminal query, asynchronous
+    // image loading and encoding the output. Image loading only uses up to
+    // thread_count threads, so that encoding finds a free one.
+    //
     // Note: this thread pool will be leaked explicitly to not unnecessarily
     // have to wait on potentially blocking cleanup at program exit where it
     // does not matter.
+    const int machine_threads =
+        std::max(1, (int)std::thread::hardware_concurrency());
     timg::ThreadPool *const pool =
-        new timg::ThreadPool(std::min(thread_count, (int)filelist.size() + 1));
+        new timg::ThreadPool(std::max(machine_threads, thread_count + 1));
+    pool->LimitConcurrency(timg::ThreadPool::Priority::kDecode, thread_count);
+    timg::FrameCache::WriteInBackground(pool);
 
     std::future<rgba_t> background_color_future;
     if (strcasecmp(bg_color.c_str(), "auto") == 0) {
@@ -921,7 +1181,8 @@ int main(int argc, char *argv[]) {
         // Finding the background color might take a while, so we query
         // it asynchonously and only force a wait on it once an image display
         // actually queries it.
-        background_color_future     = pool->ExecAsync(query_terminal);
+        background_color_future     = pool->ExecAsync(
+            query_terminal, timg::ThreadPool::Priority::kInteractive);
         display_opts.bgcolor_getter = [&background_color_future]() {
             static const rgba_t value = background_color_future.get();  // once
             return value;
@@ -934,38 +1195,80 @@ int main(int argc, char *argv[]) {
 
     display_opts.bg_pattern_color = rgba_t::ParseColor(bg_pattern_color);
 
-    // In a grid, we have less space per picture.
-    display_opts.width /= present.grid_cols;
-    display_opts.height /= present.grid_rows;
-
     ExitCode exit_code = ExitCode::kSuccess;
 
     std::mutex errors_lock;  // Collect any errors to display later.
     std::deque<std::string> errors;
+    const ReportErrorFun report_error = [&errors_lock,
+                                         &errors](const std::string &err) {
+        std::unique_lock<std::mutex> l(errors_lock);
+        errors.push_back(err);
+    };
 
-    // Async image loading, preparing them in a thread pool
-    LoadedImageSources loaded_sources;
-    for (const std::string &filename : filelist) {
-        if (interrupt_received) break;
-        const std::function<timg::ImageSource *()> f =
-            [filename, frame_offset, max_frames, do_img_loading, do_vid_loading,
-             &display_opts, &exit_code, &errors_lock,
-             &errors]() -> timg::ImageSource * {
-            if (interrupt_received) return nullptr;
-            // TODO: after switch to c++17, use variant in return ?
-            std::string err;
-            ImageSource *result = ImageSource::Create(
-                filename, display_opts, frame_offset, max_frames,
-                do_img_loading, do_vid_loading, &err);
-            if (!result) {
-                std::unique_lock<std::mutex> l(errors_lock);
-                exit_code = ExitCode::kImageReadError;
-                if (!err.empty()) errors.push_back(err);
+    // Image loading, called in a thread pool.
+    const LoadImageFun load_image =
+        [frame_offset, max_frames, do_img_loading, do_vid_loading, &exit_code,
+         &errors_lock,
+         &errors](const timg::DisplayOptions &opts, const std::string &filename,
+                  const timg::CancellationToken &cancel) -> ImageSource * {
+        if (cancel.cancelled()) return nullptr;
+        // TODO: after switch to c++17, use variant in return ?
+        std::string err;
+        ImageSource *result =
+            ImageSource::Create(filename, opts, frame_offset, max_frames,
+                                do_img_loading, do_vid_loading, cancel, &err);
+        if (!result && !cancel.cancelled()) {
+            std::unique_lock<std::mutex> l(errors_lock);
+            exit_code = ExitCode::kImageReadError;
+            if (!err.empty()) errors.push_back(err);
+        }
+        return result;
+    };
+
+    if (benchmark) {
+        // Without pacing to the output, animations would loop forever.
+        if (present.loops == timg::kNotInitialized) present.loops = 1;
+        if (output_fd == STDOUT_FILENO) {
+            output_fd = open("/dev/null", O_WRONLY);
+        }
+        const auto configure = [&](Pixelation p, timg::DisplayOptions *opts) {
+            configure_geometry(p, opts);
+            // As above: terminals doing alpha-blending don't need ours.
+            if (is_pixel_direct_with_alpha(p) &&
+                strcasecmp(bg_color.c_str(), "auto") == 0) {
+                opts->local_alpha_handling = false;
             }
-            return result;
         };
-        loaded_sources.push_back(pool->ExecAsync(f));
+        // Only measuring presenting; all files are loaded before.
+        std::vector<std::string> filenames;
+        for (std::string filename; filelist.Next(&filename); /**/) {
+            filenames.push_back(filename);
+        }
+        const ExitCode bench_result =
+            RunBenchmark(benchmark_pixelations, display_opts, present,
+                         output_fd, configure, filenames, pool, load_image,
+                         report_error);
+        timg::FrameCache::WaitForWrites();
+        for (const std::string &err : errors) {
+            fprintf(stderr, "%s\n", err.c_str());
+        }
+        if (trace_file) timg::Tracer::WriteJson(trace_file);
+        return (int)bench_result;
+    }
+
+    // Images are loaded in the thread pool while the previous ones are
+    // shown, but only up to the read-ahead window.
+    if (read_ahead <= 0) read_ahead = 2 * thread_count;
+    if (read_ahead_bytes < 0) {
+        read_ahead_bytes = timg::ImageLoader::DefaultMaxBytesAhead();
     }
+    timg::ImageLoader loader(
+        pool, &filelist,
+        [&](const std::string &filename,
+            const timg::CancellationToken &cancel) {
+            return load_image(display_opts, filename, cancel);
+        },
+        read_ahead, read_ahead_bytes, interrupt_received);
 
     // The aync write queue (BufferedWriteSequencer) lines up the next
     // buffers to be emitted.
@@ -980,9 +1283,16 @@ int main(int argc, char *argv[]) {
         debug_no_frame_delay, interrupt_received);
     const Time start_show = Time::Now();
     const int successful_images =
-        PresentImages(&loaded_sources, display_opts, present, &sequencer,
-                      &cell_size_warning_needed);
+        PresentImages(&loader, pool, display_opts, present, &sequencer,
+                      &cell_size_warning_needed, report_error);
     const Time end_show = Time::Now();
+    timg::FrameCache::WaitForWrites();
+
+    if (trace_file) timg::Tracer::WriteJson(trace_file);
+    if (stats_file) {
+        WriteStatsJson(stats_file, filelist.returned(), successful_images,
+                       end_show - start_show, sequencer);
+    }
 
     // Error messages have been collected to not clutter the image output
     // when they happen. Emit them now.
@@ -1038,10 +1348,29 @@ int main(int argc, char *argv[]) {
                         : "default cursor cell jump");
         }
 #endif
+        if (present.pixelation == Pixelation::kiTerm2Graphics &&
+            present.iterm2_multipart) {
+            fprintf(stderr, " (multipart transfer)");
+        }
         if (present.pixelation == Pixelation::kKittyGraphics) {
             if (present.tmux_workaround) {
                 fprintf(stderr, " (with tmux workaround)");
             }
+            switch (present.kitty_transmission) {
+            case timg::KittyTransmission::kSharedMemory:
+                fprintf(stderr, " (via shared memory)");
+                break;
+            case timg::KittyTransmission::kTempFile:
+                fprintf(stderr, " (via temporary files)");
+                break;
+            case timg::KittyTransmission::kDirect: break;
+            }
+            if (present.kitty_animation) {
+                fprintf(stderr, " (terminal loops animations)");
+            }
+            if (present.kitty_reuse_images) {
+                fprintf(stderr, " (reusing images)");
+            }
         }
         fprintf(stderr, ".\n");
         const rgba_t bg = display_opts.bgcolor_getter();
@@ -1072,13 +1401,13 @@ int main(int argc, char *argv[]) {
         fprintf(stderr,
                 "%d file%s (%d successful); %s written (%s/s) "
                 "%" PRId64 " frames",
-                (int)filelist.size(), filelist.size() == 1 ? "" : "s",
+                filelist.returned(), filelist.returned() == 1 ? "" : "s",
                 successful_images,
                 timg::HumanReadableByteValue(written_bytes).c_str(),
                 timg::HumanReadableByteValue(written_bytes / d).c_str(),
                 sequencer.frames_total());
         // Only show FPS if we have one video or animation
-        if (filelist.size() == 1 && sequencer.frames_total() > 50) {
+        if (filelist.returned() == 1 && sequencer.frames_total() > 50) {
             fprintf(stderr, "; %.1ffps", sequencer.frames_total() / d);
         }
         if (display_opts.allow_frame_skipping && sequencer.frames_total() > 0) {
@@ -1089,6 +1418,18 @@ int main(int argc, char *argv[]) {
         }
         fprintf(stderr, "\n");
 
+        fprintf(stderr, "Peak memory use: %s resident.",
+                timg::HumanReadableByteValue(timg::PeakResidentSetBytes())
+                    .c_str());
+        int max_accounts_to_show = 5;
+        for (const auto &account : UsedMemoryAccountsByPeak()) {
+            if (max_accounts_to_show-- == 0) break;
+            fprintf(stderr, "\n %12s  %s",
+                    timg::HumanReadableByteValue(account->peak()).c_str(),
+                    account->name().c_str());
+        }
+        fprintf(stderr, "\n");
+
         auto print_env = [](const char *env) {
             const char *value = getenv(env);
             fprintf(stderr, " %-29s%s", env, value ? " = " : "   (not set)\n");
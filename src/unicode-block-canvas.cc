@@ -15,19 +15,24 @@
 
 #include "unicode-block-canvas.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <memory>
 #include <utility>
+#include <vector>
 
 #include "buffered-write-sequencer.h"
 #include "framebuffer.h"
 #include "terminal-canvas.h"
+#include "thread-pool.h"
 #include "timg-time.h"
+#include "timg-trace.h"
 
-#define SCREEN_CURSOR_UP_FORMAT    "\033[%dA"  // Move cursor up given lines.
 #define SCREEN_CURSOR_DN_FORMAT    "\033[%dB"  // Move cursor down given lines.
 #define SCREEN_CURSOR_RIGHT_FORMAT "\033[%dC"  // Move cursor right given cols
 
@@ -87,16 +92,32 @@ static constexpr const char *kBlockGlyphs[9] = {
     /*[kUpperBlock] =      */ "▀",  // U+2580 Upper half block
 };
 
+// Double rows encoded in one piece of work. Small enough to spread a frame
+// over the threads, large enough to not drown in scheduling overhead.
+static constexpr int kRowsPerBand = 8;
+
+// Output of a band of rows. Rows at the beginning of the band that did not
+// change are not emitted but counted, as the cursor movement to skip them
+// also depends on the bands before.
+struct UnicodeBlockCanvas::EncodedBand {
+    OutBuffer data;
+    int leading_skip  = 0;  // Unchanged rows before the first emitted.
+    int trailing_skip = 0;  // Unchanged rows after the last emitted.
+};
+
 UnicodeBlockCanvas::UnicodeBlockCanvas(BufferedWriteSequencer *ws,
+                                       ThreadPool *thread_pool,
                                        bool use_quarter,
                                        bool use_upper_half_block,
                                        bool use_256_color)
     : TerminalCanvas(ws),
+      executor_(thread_pool),
       use_quarter_blocks_(use_quarter),
       use_upper_half_block_(use_upper_half_block),
       use_256_color_(use_256_color) {}
 
 UnicodeBlockCanvas::~UnicodeBlockCanvas() {
+    if (last_encode_done_.valid()) last_encode_done_.wait();
     free(backing_buffer_);
     free(empty_line_);
 }
@@ -126,6 +147,15 @@ static inline char *str_append(char *pos, const char *value, size_t len) {
     return pos + len;
 }
 
+// Emit cursor down or newlines, whatever is shorter.
+static char *AppendSkipRows(char *pos, int rows) {
+    if (rows <= 4) {
+        memset(pos, '\n', rows);
+        return pos + rows;
+    }
+    return pos + sprintf(pos, SCREEN_CURSOR_DN_FORMAT, rows);
+}
+
 // Compare pixels of top and bottom row with backing store (see StoreBacking())
 template <int N>
 inline bool EqualToBacking(const rgba_t *top, const rgba_t *bottom,
@@ -230,8 +260,8 @@ UnicodeBlockCanvas::GlyphPick UnicodeBlockCanvas::FindBestGlyph(
 template <int N, int colorbits>  // Advancing N x-pixels per char
 char *UnicodeBlockCanvas::AppendDoubleRow(char *pos, int indent, int width,
                                           const rgba_t *tline,
-                                          const rgba_t *bline, bool emit_diff,
-                                          int *y_skip) {
+                                          const rgba_t *bline, rgba_t *backing,
+                                          bool emit_diff, int *y_skip) {
     static constexpr char kStartEscape[] = "\033[";
     GlyphPick last                       = {};
     rgba_t last_foreground               = {};
@@ -240,20 +270,14 @@ char *UnicodeBlockCanvas::AppendDoubleRow(char *pos, int indent, int width,
     int x_skip                           = indent;
     const char *start                    = pos;
     for (int x = 0; x < width;
-         x += N, prev_content_it_ += 2 * N, tline += N, bline += N) {
-        if (emit_diff && EqualToBacking<N>(tline, bline, prev_content_it_)) {
+         x += N, backing += 2 * N, tline += N, bline += N) {
+        if (emit_diff && EqualToBacking<N>(tline, bline, backing)) {
             ++x_skip;
             continue;
         }
 
-        if (*y_skip) {  // Emit cursor down or newlines, whatever is shorter
-            if (*y_skip <= 4) {
-                memset(pos, '\n', *y_skip);
-                pos += *y_skip;
-            }
-            else {
-                pos += sprintf(pos, SCREEN_CURSOR_DN_FORMAT, *y_skip);
-            }
+        if (*y_skip) {
+            pos     = AppendSkipRows(pos, *y_skip);
             *y_skip = 0;
         }
 
@@ -307,7 +331,7 @@ char *UnicodeBlockCanvas::AppendDoubleRow(char *pos, int indent, int width,
                              PIXEL_BLOCK_CHARACTER_LEN);
         }
         last = pick;
-        StoreBacking<N>(prev_content_it_, tline, bline);
+        StoreBacking<N>(backing, tline, bline);
     }
 
     if (pos == start) {  // Nothing emitted for whole line
@@ -320,30 +344,85 @@ char *UnicodeBlockCanvas::AppendDoubleRow(char *pos, int indent, int width,
     return pos;
 }
 
-void UnicodeBlockCanvas::Send(int x, int dy, const Framebuffer &framebuffer,
-                              SeqType seq_type, Duration end_of_frame) {
+void UnicodeBlockCanvas::EncodeRows(const Framebuffer &framebuffer, int x,
+                                    int row_offset, bool emit_difference,
+                                    size_t max_row_size, int first, int last,
+                                    EncodedBand *band) {
     const int width  = framebuffer.width();
     const int height = framebuffer.height();
-    OutBuffer out_buffer(RequestBuffers(width, height), 0);
-    char *pos = out_buffer.data;
 
-    if (dy < 0) MoveCursorDY(cell_height_for_pixels(dy));
+    // Each double row has its own section of the backing buffer, so bands
+    // can be worked on independently.
+    const int n                  = use_quarter_blocks_ ? 2 : 1;
+    const size_t backing_per_row = (width + n - 1) / n * 2 * n;
 
-    pos = AppendPrefixToBuffer(pos);
+    int y_skip = 0;
+    for (int r = first; r < last; ++r) {
+        const int row         = 2 * r + row_offset;
+        const rgba_t *top_row = row < 0 ? empty_line_ : framebuffer.row(row);
+        const rgba_t *bottom_row =
+            (row + 1) >= height ? empty_line_ : framebuffer.row(row + 1);
+        rgba_t *const backing = backing_buffer_ + r * backing_per_row;
+
+        // Skipped rows before anything is emitted in this band are left to
+        // the caller to emit.
+        const bool leading = band->data.empty();
+        int leading_skip   = 0;
+        int *const skip    = leading ? &leading_skip : &y_skip;
+
+        char *const row_start = band->data.Reserve(max_row_size);
+        char *pos             = row_start;
 
-    if (use_quarter_blocks_) x /= 2;  // That is in character cell units.
+        if (use_256_color_) {
+            if (use_quarter_blocks_) {
+                pos = AppendDoubleRow<2, 8>(pos, x, width, top_row, bottom_row,
+                                            backing, emit_difference, skip);
+            }
+            else {
+                pos = AppendDoubleRow<1, 8>(pos, x, width, top_row, bottom_row,
+                                            backing, emit_difference, skip);
+            }
+        }
+        else {
+            if (use_quarter_blocks_) {
+                pos = AppendDoubleRow<2, 24>(pos, x, width, top_row, bottom_row,
+                                             backing, emit_difference, skip);
+            }
+            else {
+                pos = AppendDoubleRow<1, 24>(pos, x, width, top_row, bottom_row,
+                                             backing, emit_difference, skip);
+            }
+        }
+        band->data.Commit(pos - row_start);
+        band->leading_skip += leading_skip;
+    }
+    band->trailing_skip = y_skip;
+}
 
-    const char *before_image_emission = pos;
+void UnicodeBlockCanvas::Send(int x, int dy, const Framebuffer &framebuffer,
+                              SeqType seq_type, Duration end_of_frame) {
+    // Previous frame needs to be done with the backing buffer before we
+    // can re-use (or re-allocate) it.
+    if (last_encode_done_.valid()) last_encode_done_.wait();
+
+    const int width           = framebuffer.width();
+    const int height          = framebuffer.height();
+    const size_t max_row_size = RequestBuffers(width, height);
+
+    if (dy < 0) MoveCursorDY(cell_height_for_pixels(dy));
 
-    const rgba_t *const pixels = framebuffer.begin();
-    const rgba_t *top_row, *bottom_row;
+    OutBuffer *const out_buffer = new OutBuffer();
+    AppendPrefixToBuffer(out_buffer);
+
+    if (use_quarter_blocks_) x /= 2;  // That is in character cell units.
 
     // If we just got requested to move back where we started the last image,
     // we just need to emit pixels that changed.
-    prev_content_it_           = backing_buffer_;
     const bool emit_difference = (x == last_x_indent_) &&
                                  (last_framebuffer_height_ > 0) &&
                                  abs(dy) == last_framebuffer_height_;
+    last_framebuffer_height_ = height;
+    last_x_indent_           = x;
 
     // We are always writing two lines at once with one character, which
     // requires to leave an empty line if the height of the framebuffer is odd.
@@ -357,52 +436,73 @@ void UnicodeBlockCanvas::Send(int x, int dy, const Framebuffer &framebuffer,
     const bool top_optional_blank = !use_upper_half_block_;
     const int row_offset = (needs_empty_line && top_optional_blank) ? -1 : 0;
 
-    int y_skip = 0;
-    for (int y = 0; y < height; y += 2) {
-        const int row = y + row_offset;
-        top_row       = row < 0 ? empty_line_ : &pixels[width * row];
-        bottom_row =
-            (row + 1) >= height ? empty_line_ : &pixels[width * (row + 1)];
-
-        if (use_256_color_) {
-            if (use_quarter_blocks_) {
-                pos = AppendDoubleRow<2, 8>(pos, x, width, top_row, bottom_row,
-                                            emit_difference, &y_skip);
-            }
-            else {
-                pos = AppendDoubleRow<1, 8>(pos, x, width, top_row, bottom_row,
-                                            emit_difference, &y_skip);
-            }
+    // Handle for use in thread; shares the pixels with the original.
+    const Framebuffer *const fb = new Framebuffer(framebuffer);
+    auto *const done            = new std::promise<void>();
+    last_encode_done_           = done->get_future();
+
+    ThreadPool *const pool                  = executor_;
+    BufferedWriteSequencer *const sequencer = write_sequencer_;
+    std::function<OutBuffer()> encode_fun   = [=]() {
+        TraceSpan span("encode", "unicode-block");
+        const Time encode_start;
+        std::unique_ptr<const Framebuffer> auto_delete(fb);
+        std::unique_ptr<OutBuffer> auto_delete_buffer(out_buffer);
+        std::unique_ptr<std::promise<void>> auto_delete_done(done);
+
+        const int double_rows = (height + 1) / 2;
+        std::vector<EncodedBand> bands(
+            (double_rows + kRowsPerBand - 1) / kRowsPerBand);
+        auto encode_band = [&](int first, int last) {
+            EncodeRows(*fb, x, row_offset, emit_difference, max_row_size,
+                       first, last, &bands[first / kRowsPerBand]);
+        };
+        if (pool) {
+            pool->ParallelFor(0, double_rows, kRowsPerBand, encode_band);
         }
         else {
-            if (use_quarter_blocks_) {
-                pos = AppendDoubleRow<2, 24>(pos, x, width, top_row, bottom_row,
-                                             emit_difference, &y_skip);
+            for (int r = 0; r < double_rows; r += kRowsPerBand) {
+                encode_band(r, std::min(r + kRowsPerBand, double_rows));
             }
-            else {
-                pos = AppendDoubleRow<1, 24>(pos, x, width, top_row, bottom_row,
-                                             emit_difference, &y_skip);
+        }
+        done->set_value();  // Backing buffer is updated.
+
+        // Stitch together, emitting the rows skipped between bands.
+        const size_t before_image_emission = out_buffer->size();
+        int y_skip                         = 0;
+        for (const EncodedBand &band : bands) {
+            y_skip += band.leading_skip;
+            if (band.data.empty()) continue;
+            if (y_skip) {
+                char *const skip_start = out_buffer->Reserve(16);
+                out_buffer->Commit(AppendSkipRows(skip_start, y_skip) -
+                                   skip_start);
             }
+            for (const OutBuffer::Segment &segment : band.data.segments()) {
+                out_buffer->Append(segment.data, segment.size);
+            }
+            y_skip = band.trailing_skip;
         }
-    }
-    last_framebuffer_height_ = height;
-    last_x_indent_           = x;
-    if (before_image_emission == pos) {
-        // Don't even emit cursor up/dn jump, keep buffer size zero.
-        write_sequencer_->WriteBuffer(std::move(out_buffer), seq_type,
-                                      end_of_frame);
-        return;
-    }
+        sequencer->RecordEncodeTime(Time::Now() - encode_start);
 
-    if (y_skip) {
-        pos += sprintf(pos, SCREEN_CURSOR_DN_FORMAT, y_skip);
+        // If nothing changed, don't even emit cursor up/dn jump.
+        if (y_skip && before_image_emission != out_buffer->size()) {
+            out_buffer->Appendf(SCREEN_CURSOR_DN_FORMAT, y_skip);
+        }
+        return std::move(*out_buffer);
+    };
+
+    if (pool) {
+        write_sequencer_->WriteBuffer(
+            pool->ExecAsync(encode_fun, ThreadPool::Priority::kEncode),
+            seq_type, end_of_frame);
+    }
+    else {
+        write_sequencer_->WriteBuffer(encode_fun(), seq_type, end_of_frame);
     }
-    out_buffer.size = (size_t)(pos - out_buffer.data);
-    write_sequencer_->WriteBuffer(std::move(out_buffer), seq_type,
-                                  end_of_frame);
 }
 
-char *UnicodeBlockCanvas::RequestBuffers(int width, int height) {
+size_t UnicodeBlockCanvas::RequestBuffers(int width, int height) {
     // Pixels will be variable size depending on if we need to change colors
     // between two adjacent pixels. This is the maximum size they can be.
     static const int max_pixel_size =
@@ -413,15 +513,12 @@ char *UnicodeBlockCanvas::RequestBuffers(int width, int height) {
         + 1                                           /* m */
         + PIXEL_BLOCK_CHARACTER_LEN;
     // Few extra space for number printed in the format.
-    static const int opt_cursor_up    = strlen(SCREEN_CURSOR_UP_FORMAT) + 3;
+    static const int opt_cursor_down  = strlen(SCREEN_CURSOR_DN_FORMAT) + 3;
     static const int opt_cursor_right = strlen(SCREEN_CURSOR_RIGHT_FORMAT) + 3;
-    const int vertical_characters = (height + 1) / 2;  // two pixels, one glyph
-    const size_t content_size =
-        opt_cursor_up  // Jump up
-        +
-        vertical_characters * (opt_cursor_right            // Horizontal jump
-                               + width * max_pixel_size    // pixels in one row
-                               + SCREEN_END_OF_LINE_LEN);  // Finishing a line.
+    const size_t row_size = opt_cursor_down            // Skipped rows
+                            + opt_cursor_right         // Horizontal jump
+                            + width * max_pixel_size   // pixels in one row
+                            + SCREEN_END_OF_LINE_LEN;  // Finishing a line.
 
     // Depending on even/odd situation, we might need one extra row.
     // For quarter, we have one extra possible pixel wider.
@@ -437,7 +534,7 @@ char *UnicodeBlockCanvas::RequestBuffers(int width, int height) {
         empty_line_size_ = new_empty;
         memset(empty_line_, 0x00, empty_line_size_);
     }
-    return new char[content_size];
+    return row_size;
 }
 
 // Converting the colors requires fast uint8 -> ASCII decimal digits with
@@ -18,10 +18,12 @@
 
 #include <cassert>
 #include <cstddef>
+#include <future>
 
 #include "buffered-write-sequencer.h"
 #include "framebuffer.h"
 #include "terminal-canvas.h"
+#include "thread-pool.h"
 #include "timg-time.h"
 
 namespace timg {
@@ -35,8 +37,11 @@ public:
     // if "use_upper_half_block" is set, uses the upper instead of the
     // lower block (only for use_quarter == false).
     // "use_256_color" is for terminals that can't do 24 bit colors.
-    UnicodeBlockCanvas(BufferedWriteSequencer *ws, bool use_quarter,
-                       bool use_upper_half_block, bool use_256_color);
+    // Frames are encoded in bands of rows in parallel on the "thread_pool";
+    // if nullptr, encoding happens synchronously in Send().
+    UnicodeBlockCanvas(BufferedWriteSequencer *ws, ThreadPool *thread_pool,
+                       bool use_quarter, bool use_upper_half_block,
+                       bool use_256_color);
     ~UnicodeBlockCanvas() override;
 
     int cell_height_for_pixels(int pixels) const final {
@@ -48,20 +53,28 @@ public:
 
 private:
     struct GlyphPick;
+    struct EncodedBand;
+
+    ThreadPool *const executor_;
     const bool use_quarter_blocks_;
     const bool use_upper_half_block_;
     const bool use_256_color_;
 
     // Ensure that all buffers needed for emitting the framebuffer have
     // enough space.
-    // Return a buffer large enough to hold the whole ANSI-color encoded text
-    // to be used with the write sequencer.
-    char *RequestBuffers(int width, int height);
+    // Return the maximum number of bytes the ANSI-color encoded text of
+    // one double row can take, to be reserved in the output buffer.
+    size_t RequestBuffers(int width, int height);
+
+    // Encode the double rows [first, last) of the framebuffer into "band".
+    void EncodeRows(const Framebuffer &framebuffer, int x, int row_offset,
+                    bool emit_difference, size_t max_row_size, int first,
+                    int last, EncodedBand *band);
 
     template <int N, int colorbits>
     char *AppendDoubleRow(char *pos, int indent, int width,
                           const rgba_t *top_line, const rgba_t *bottom_line,
-                          bool emit_difference, int *y_skip);
+                          rgba_t *backing, bool emit_difference, int *y_skip);
 
     // Find best glyph for two rows of color.
     template <int N>
@@ -69,14 +82,16 @@ private:
 
     // Backing buffer stores a flattened view of last frame, storing top and
     // bottom pixel linearly.
-    rgba_t *backing_buffer_     = nullptr;  // Remembering last frame
-    size_t backing_buffer_size_ = 0;
-    rgba_t *prev_content_it_;
+    rgba_t *backing_buffer_      = nullptr;  // Remembering last frame
+    size_t backing_buffer_size_  = 0;
     int last_framebuffer_height_ = 0;
     int last_x_indent_           = 0;
 
     rgba_t *empty_line_     = nullptr;
     size_t empty_line_size_ = 0;
+
+    // The backing buffer is in use until the last frame is encoded.
+    std::future<void> last_encode_done_;
 };
 }  // namespace timg
 
@@ -67,4 +67,25 @@ std::string HumanReadableByteValue(int64_t byte_count) {
     return buf;
 }
 
+std::string JsonQuote(const std::string &str) {
+    std::string result = "\"";
+    for (const char c : str) {
+        switch (c) {
+        case '"': result.append("\\\""); break;
+        case '\\': result.append("\\\\"); break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                result.append(buf);
+            }
+            else {
+                result.push_back(c);
+            }
+        }
+    }
+    result.push_back('"');
+    return result;
+}
+
 }  // namespace timg
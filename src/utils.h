@@ -32,6 +32,9 @@ int GetIntEnv(const char *env_name, int default_value = 0);
 // Given number of bytes, return a human-readable version of that
 // (e.g. "13.2 MiB").
 std::string HumanReadableByteValue(int64_t byte_count);
+
+// Return the string quoted and escaped to be used in JSON output.
+std::string JsonQuote(const std::string &str);
 }  // namespace timg
 
 #endif  // TIMG_TERMUTILS_H
@@ -21,21 +21,30 @@
 #include <strings.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <csignal>
 #include <cstdarg>
 #include <cstddef>
 #include <cstdio>
 #include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
 #include "framebuffer.h"
 #include "image-source.h"
 #include "renderer.h"
+#include "timg-cancel.h"
 #include "timg-time.h"
+#include "timg-trace.h"
 
 // libav: "U NO extern C in header ?"
 extern "C" {
@@ -52,6 +61,97 @@ extern "C" {
 static constexpr bool kDebug = false;
 
 namespace timg {
+// Number of frames the decoder may be ahead of the frames being scaled and
+// sent, in addition to the ones being worked on by the scaler threads.
+static constexpr int kFramesAhead = 2;
+
+// Packets read ahead of the decoder.
+static constexpr int kPacketsAhead = 32;
+
+namespace {
+struct PacketDeleter {
+    void operator()(AVPacket *packet) const { av_packet_free(&packet); }
+};
+struct FrameDeleter {
+    void operator()(AVFrame *frame) const { av_frame_free(&frame); }
+};
+using PacketPtr = std::unique_ptr<AVPacket, PacketDeleter>;
+using FramePtr  = std::unique_ptr<AVFrame, FrameDeleter>;
+
+// A decoded frame waiting to be scaled, with the promise to fulfill with
+// the result. The result is empty if the frame is skipped.
+struct ScaleJob {
+    FramePtr frame;
+    Duration end_of_frame;
+    std::promise<std::unique_ptr<Framebuffer>> result;
+};
+
+// Queue with limited capacity connecting the stages of the video pipeline.
+// Push() blocks while the queue is full, Pop() while it is empty.
+//
+// Close() is called by the producer once it is done; consumers still get
+// the remaining items. Cancel() drops the remaining items; it is used to
+// stop all stages before they reach the end of the stream.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+    // Returns false if the queue is closed.
+    bool Push(T item) {
+        std::unique_lock<std::mutex> l(lock_);
+        not_full_.wait(l, [this]() {
+            return closed_ || items_.size() < capacity_;
+        });
+        if (closed_) return false;
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Returns false if the queue is closed and no items are left.
+    bool Pop(T *item) {
+        std::unique_lock<std::mutex> l(lock_);
+        not_empty_.wait(l, [this]() { return closed_ || !items_.empty(); });
+        if (items_.empty()) return false;
+        *item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void Close() {
+        const std::lock_guard<std::mutex> l(lock_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+    void Cancel() {
+        const std::lock_guard<std::mutex> l(lock_);
+        closed_ = true;
+        items_.clear();
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    const size_t capacity_;
+    std::mutex lock_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> items_;
+    bool closed_ = false;
+};
+}  // namespace
+
+// The decoder is already multi-threaded, so only use part of the cores for
+// scaling.
+static int ScalerThreadCount() {
+    const int cores = (int)std::thread::hardware_concurrency();
+    return std::max(1, std::min(4, cores / 2));
+}
+
 // Convert deprecated color formats to new and manually set the color range.
 // YUV has funny ranges (16-235), while the YUVJ are 0-255. SWS prefers to
 // deal with the YUV range, but then requires to set the output range.
@@ -110,10 +210,11 @@ VideoSource::VideoSource(const std::string &filename) : ImageSource(filename) {
 }
 
 VideoSource::~VideoSource() {
-    sws_freeContext(sws_context_);
+    for (SwsContext *sws_context : sws_contexts_) {
+        sws_freeContext(sws_context);
+    }
     avcodec_free_context(&codec_context_);
     avformat_close_input(&format_context_);
-    delete terminal_fb_;
 }
 
 const char *VideoSource::VersionInfo() {
@@ -129,8 +230,24 @@ std::string VideoSource::FormatTitle(const std::string &format_string) const {
                                 orig_height_, "video");
 }
 
+int VideoSource::InterruptCallback(void *source) {
+    const VideoSource *const self = (const VideoSource *)source;
+    if (self->load_cancel_ && self->load_cancel_->cancelled()) return 1;
+    return self->send_interrupt_received_ && *self->send_interrupt_received_;
+}
+
 bool VideoSource::LoadAndScale(const DisplayOptions &display_options,
-                               int frame_offset, int frame_count) {
+                               int frame_offset, int frame_count,
+                               const CancellationToken &cancel) {
+    load_cancel_ = &cancel;
+    const bool success =
+        OpenAndPrepare(display_options, frame_offset, frame_count);
+    load_cancel_ = nullptr;
+    return success && !cancel.cancelled();
+}
+
+bool VideoSource::OpenAndPrepare(const DisplayOptions &display_options,
+                                 int frame_offset, int frame_count) {
     options_      = display_options;
     frame_offset_ = frame_offset;
     frame_count_  = frame_count;
@@ -149,7 +266,9 @@ bool VideoSource::LoadAndScale(const DisplayOptions &display_options,
         }
     }
 
-    format_context_ = avformat_alloc_context();
+    format_context_                              = avformat_alloc_context();
+    format_context_->interrupt_callback.callback = &InterruptCallback;
+    format_context_->interrupt_callback.opaque   = this;
     int ret;
     if ((ret = avformat_open_input(&format_context_, file, nullptr, nullptr)) !=
         0) {
@@ -239,27 +358,38 @@ bool VideoSource::LoadAndScale(const DisplayOptions &display_options,
     if (display_options.center_horizontally) {
         center_indentation_ = (display_options.width - target_width) / 2;
     }
-    // initialize SWS context for software scaling
+    // initialize SWS context for software scaling; each scaler thread gets
+    // its own as they can't be shared.
     // Note: right now, we can't use ImageScaler in the video context, as there
     // is a vast variety of image formats that we can't support universally.
     // However, once we link video libraries, the overhead for sws is minimal.
-    sws_context_ =
-        CreateSWSContext(codec_context_, target_width, target_height);
-    if (!sws_context_) {
-        if (kDebug)
-            fprintf(stderr, "Trouble doing scaling to %dx%d :(\n", opts.width,
-                    opts.height);
-        return false;
+    const int scaler_threads = ScalerThreadCount();
+    for (int i = 0; i < scaler_threads; ++i) {
+        SwsContext *sws_context =
+            CreateSWSContext(codec_context_, target_width, target_height);
+        if (!sws_context) {
+            if (kDebug)
+                fprintf(stderr, "Trouble doing scaling to %dx%d :(\n",
+                        opts.width, opts.height);
+            return false;
+        }
+        sws_contexts_.push_back(sws_context);
     }
 
-    // Framebuffer to interface with the timg TerminalCanvas
-    terminal_fb_ = new timg::Framebuffer(target_width, target_height);
+    target_width_  = target_width;
+    target_height_ = target_height;
+
+    // Framebuffers to interface with the timg TerminalCanvas; one for each
+    // frame in flight.
+    const int64_t frame_bytes =
+        (int64_t)target_width * target_height * sizeof(rgba_t);
+    AccountMemory(frame_bytes * (scaler_threads + kFramesAhead));
     return true;
 }
 
-void VideoSource::AlphaBlendFramebuffer() {
+void VideoSource::AlphaBlendFramebuffer(Framebuffer *framebuffer) const {
     if (!maybe_transparent_) return;
-    terminal_fb_->AlphaComposeBackground(
+    framebuffer->AlphaComposeBackground(
         options_.bgcolor_getter, options_.bg_pattern_color,
         options_.pattern_size * options_.cell_x_px,
         options_.pattern_size * options_.cell_y_px / 2);
@@ -268,7 +398,8 @@ void VideoSource::AlphaBlendFramebuffer() {
 void VideoSource::SendFrames(const Duration &duration, int loops,
                              const volatile sig_atomic_t &interrupt_received,
                              const Renderer::WriteFramebufferFun &sink) {
-    const bool frame_limit = (frame_count_ > 0);
+    send_interrupt_received_ = &interrupt_received;
+    const bool frame_limit   = (frame_count_ > 0);
 
     if (frame_count_ == 1)  // If there is only one frame, nothing to repeat.
         loops = 1;
@@ -284,8 +415,8 @@ void VideoSource::SendFrames(const Duration &duration, int loops,
 
     if (loops == timg::kNotInitialized && !animated_png) loops = 1;
 
-    AVPacket *packet = av_packet_alloc();
-    bool is_first    = true;
+    bool is_first = true;
+    std::atomic<bool> animation_started{false};  // First frame is sent.
     timg::Duration time_from_first_frame;
 
     // We made guesses above if something is potentially an animation, but
@@ -293,12 +424,24 @@ void VideoSource::SendFrames(const Duration &duration, int loops,
     // know beforehand.
     // So we will only loop iff we do not observe exactly one frame.
     int observed_frame_count = 0;
+    std::unique_ptr<Framebuffer> last_frame;  // Last one sent.
 
-    AVFrame *decode_frame = av_frame_alloc();  // Decode video into this
     for (int k = 0;
          ((loop_forever || k < loops) && observed_frame_count != 1) &&
          !interrupt_received && time_from_first_frame < duration;
          ++k) {
+        if (k > 0 && last_frame && !sink.RepeatContentNeeded()) {
+            // The terminal repeats the animation by itself. Only keep the
+            // pace with the last frame; no need to decode and scale.
+            for (int f = 0; f < observed_frame_count && !interrupt_received &&
+                            time_from_first_frame < duration;
+                 ++f) {
+                time_from_first_frame.Add(frame_duration_);
+                sink(center_indentation_, -last_frame->height(), *last_frame,
+                     SeqType::AnimationRepeat, time_from_first_frame);
+            }
+            continue;
+        }
         if (k > 0) {
             // Rewind unless we're just starting.
             av_seek_frame(format_context_, video_stream_index_, 0,
@@ -306,67 +449,130 @@ void VideoSource::SendFrames(const Duration &duration, int loops,
             avcodec_flush_buffers(codec_context_);
         }
         observed_frame_count = 0;
-        int remaining_frames = frame_count_;
-        int skip_offset      = frame_offset_;
-        int decode_in_flight = 0;
-
-        bool state_reading = true;
-
-        while (!interrupt_received && time_from_first_frame < duration &&
-               (!frame_limit || remaining_frames > 0)) {
-            if (state_reading && av_read_frame(format_context_, packet) != 0) {
-                state_reading = false;  // Ran out of packets from input
-            }
-
-            if (!state_reading && decode_in_flight == 0)
-                break;  // Decoder fully drained.
 
-            if (state_reading && packet->stream_index != video_stream_index_) {
-                av_packet_unref(packet);
-                continue;  // Not a packet we're interested in
+        // Pipeline: demux -> decode -> scale (several threads) -> sink.
+        // Frames are scaled out of order, so the decoder queues up the
+        // futures of their results in the order they are to be shown.
+        const int scalers         = (int)sws_contexts_.size();
+        const Duration pass_start = time_from_first_frame;
+        BoundedQueue<PacketPtr> packets(kPacketsAhead);
+        BoundedQueue<ScaleJob> to_scale(scalers);
+        BoundedQueue<std::future<std::unique_ptr<Framebuffer>>> scaled(
+            scalers + kFramesAhead);
+
+        std::thread demux_thread([&]() {
+            Tracer::SetThreadName("video-demux");
+            for (;;) {
+                PacketPtr packet(av_packet_alloc());
+                if (av_read_frame(format_context_, packet.get()) != 0) break;
+                if (packet->stream_index != video_stream_index_) continue;
+                if (!packets.Push(std::move(packet))) break;
             }
-
-            if (state_reading) {
-                if (avcodec_send_packet(codec_context_, packet) == 0) {
-                    ++decode_in_flight;
+            packets.Close();
+        });
+
+        std::thread decode_thread([&]() {
+            Tracer::SetThreadName("video-decode");
+            int remaining_frames  = frame_count_;
+            int skip_offset       = frame_offset_;
+            Duration end_of_frame = pass_start;
+
+            // Hand all frames the decoder has ready to the scalers. Returns
+            // false once no more frames are needed.
+            auto receive_frames = [&]() {
+                for (;;) {
+                    FramePtr frame(av_frame_alloc());
+                    if (avcodec_receive_frame(codec_context_, frame.get()) != 0)
+                        return true;
+                    if (skip_offset > 0) {
+                        // TODO: there is probably a faster/better way to skip
+                        // ahead to the last keyframe first.
+                        --skip_offset;
+                        continue;
+                    }
+                    end_of_frame.Add(frame_duration_);
+                    ScaleJob job;
+                    job.frame        = std::move(frame);
+                    job.end_of_frame = end_of_frame;
+                    if (!scaled.Push(job.result.get_future())) return false;
+                    if (!to_scale.Push(std::move(job))) return false;
+                    if (frame_limit && --remaining_frames <= 0) return false;
                 }
-                av_packet_unref(packet);
+            };
+
+            bool more_frames = true;
+            PacketPtr packet;
+            while (more_frames && packets.Pop(&packet)) {
+                TraceSpan span("load", "avcodec decode");
+                avcodec_send_packet(codec_context_, packet.get());
+                packet.reset();
+                more_frames = receive_frames();
             }
-            else {
-                avcodec_send_packet(codec_context_, nullptr);  // Trigger drain
+            if (more_frames) {
+                avcodec_send_packet(codec_context_, nullptr);  // Drain
+                receive_frames();
             }
-
-            while (decode_in_flight &&
-                   avcodec_receive_frame(codec_context_, decode_frame) == 0) {
-                --decode_in_flight;
-                if (skip_offset > 0) {
-                    // TODO: there is probably a faster/better way to skip
-                    // ahead to the last keyframe first.
-                    --skip_offset;
-                    continue;
+            packets.Cancel();  // No need to read further if we stopped early.
+            to_scale.Close();
+            scaled.Close();
+        });
+
+        std::vector<std::thread> scale_threads;
+        for (SwsContext *sws_context : sws_contexts_) {
+            scale_threads.emplace_back([&, sws_context]() {
+                Tracer::SetThreadName("video-scale");
+                ScaleJob job;
+                while (to_scale.Pop(&job)) {
+                    // Don't bother scaling frames that won't be shown. Only
+                    // known once the animation started.
+                    if (animation_started &&
+                        sink.SkipLateFrame(job.end_of_frame)) {
+                        job.frame.reset();
+                        job.result.set_value(nullptr);
+                        continue;
+                    }
+                    auto framebuffer = std::make_unique<Framebuffer>(
+                        target_width_, target_height_);
+                    {
+                        TraceSpan span("scale", "sws_scale");
+                        sws_scale(sws_context, job.frame->data,
+                                  job.frame->linesize, 0, orig_height_,
+                                  framebuffer->row_data(),
+                                  framebuffer->stride());
+                    }
+                    job.frame.reset();
+                    AlphaBlendFramebuffer(framebuffer.get());
+                    job.result.set_value(std::move(framebuffer));
                 }
+            });
+        }
 
-                time_from_first_frame.Add(frame_duration_);
-                // TODO: when frame skipping enabled, avoid this step if we're
-                // falling behind.
-                sws_scale(sws_context_, decode_frame->data,
-                          decode_frame->linesize, 0, codec_context_->height,
-                          terminal_fb_->row_data(), terminal_fb_->stride());
-                AlphaBlendFramebuffer();
-                const int dy = is_first ? 0 : -terminal_fb_->height();
-                sink(center_indentation_, dy, *terminal_fb_,
-                     is_first ? SeqType::StartOfAnimation
-                              : SeqType::AnimationFrame,
-                     time_from_first_frame);
-                is_first = false;
-                if (frame_limit) --remaining_frames;
-                ++observed_frame_count;
-            }
+        std::future<std::unique_ptr<Framebuffer>> next_frame;
+        while (!interrupt_received && time_from_first_frame < duration &&
+               scaled.Pop(&next_frame)) {
+            std::unique_ptr<Framebuffer> frame = next_frame.get();
+            time_from_first_frame.Add(frame_duration_);
+            ++observed_frame_count;
+            if (!frame) continue;  // Skipped, too late.
+            const int dy = is_first ? 0 : -frame->height();
+            SeqType seq_type =
+                k > 0 ? SeqType::AnimationRepeat : SeqType::AnimationFrame;
+            if (is_first) seq_type = SeqType::StartOfAnimation;
+            sink(center_indentation_, dy, *frame, seq_type,
+                 time_from_first_frame);
+            is_first          = false;
+            animation_started = true;
+            last_frame        = std::move(frame);
         }
-    }
 
-    av_frame_free(&decode_frame);
-    av_packet_free(&packet);
+        // Stop all stages in case we finished before the end of the stream.
+        scaled.Cancel();
+        to_scale.Cancel();
+        packets.Cancel();
+        demux_thread.join();
+        decode_thread.join();
+        for (std::thread &t : scale_threads) t.join();
+    }
 }
 
 }  // namespace timg
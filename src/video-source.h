@@ -18,11 +18,13 @@
 
 #include <csignal>
 #include <string>
+#include <vector>
 
 #include "display-options.h"
 #include "framebuffer.h"
 #include "image-source.h"
 #include "renderer.h"
+#include "timg-cancel.h"
 #include "timg-time.h"
 
 struct AVCodecContext;
@@ -44,12 +46,15 @@ public:
     // Attempt to load given filename as video, open stream and set-up scaling.
     // Returns true on success.
     bool LoadAndScale(const DisplayOptions &options, int frame_offset,
-                      int frame_count) final;
+                      int frame_count, const CancellationToken &cancel) final;
 
     // Play video up to given duration.
     //
     // The reference to the "interrupt_received" can be updated by a signal
     // while the method is running and shall be checked often.
+    //
+    // Demuxing, decoding and scaling run in their own threads, working ahead
+    // of the frames handed to the "sink" in the calling thread.
     void SendFrames(const Duration &duration, int loops,
                     const volatile sig_atomic_t &interrupt_received,
                     const Renderer::WriteFramebufferFun &sink) final;
@@ -60,7 +65,15 @@ public:
     bool IsAnimationBeforeFrameLimit() const override { return true; }
 
 private:
-    void AlphaBlendFramebuffer();
+    // The actual LoadAndScale() while "load_cancel_" is set.
+    bool OpenAndPrepare(const DisplayOptions &options, int frame_offset,
+                        int frame_count);
+
+    // Called by libav while blocked, e.g. reading from a slow stream;
+    // returns non-zero to abort.
+    static int InterruptCallback(void *source);
+
+    void AlphaBlendFramebuffer(Framebuffer *framebuffer) const;
 
     DisplayOptions options_;
     bool maybe_transparent_ = false;
@@ -71,10 +84,16 @@ private:
     int video_stream_index_          = -1;
     AVFormatContext *format_context_ = nullptr;
     AVCodecContext *codec_context_   = nullptr;
-    SwsContext *sws_context_         = nullptr;
-    timg::Duration frame_duration_;  // 1/fps
-    timg::Framebuffer *terminal_fb_ = nullptr;
-    int center_indentation_         = 0;
+    std::vector<SwsContext *> sws_contexts_;  // One per scaler thread.
+    timg::Duration frame_duration_;           // 1/fps
+    int target_width_       = 0;
+    int target_height_      = 0;
+    int center_indentation_ = 0;
+
+    // What InterruptCallback() checks: the cancellation while loading, the
+    // interrupt flag once sending frames.
+    const CancellationToken *load_cancel_                 = nullptr;
+    const volatile sig_atomic_t *send_interrupt_received_ = nullptr;
 };
 
 }  // namespace timg